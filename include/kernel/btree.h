@@ -3,6 +3,10 @@
 
 #define BTREE_MAGIC 0x42545245  // "BTRE"
 #define BTREE_ORDER 8 // Max keys per node (keeps stack usage low)
+#define BTREE_MIN_KEYS (BTREE_ORDER / 2) // Non-root nodes rebalance below this
+#define BTREE_MAX_DEPTH 16
+#define BTREE_LEAF_DATA 256 // Leaf payload area for variable-length items
+#define BTREE_ITEM_MAX (BTREE_LEAF_DATA / 4) // Largest payload of one item
 
 enum {
     BTREE_NODE_LEAF = 1,
@@ -21,7 +25,7 @@ struct btree_hdr {
     uint32_t checksum;
     uint16_t level; // 0 = leaf
     uint16_t nkeys;
-    uint32_t reserved;
+    uint32_t dlen; // Leaf payload bytes in use; 0 for fixed-size nodes
 };
 
 struct btree_key {
@@ -29,21 +33,96 @@ struct btree_key {
     uint64_t value;
 };
 
+// Leaf items may carry a payload of up to BTREE_ITEM_MAX bytes next to
+// their value. ilen and data are only stored on disk when dlen != 0, so
+// nodes without payloads keep the original fixed-size layout.
 struct btree_node {
     struct btree_hdr hdr;
     uint64_t children[BTREE_ORDER + 1]; // internal nodes only
     struct btree_key keys[BTREE_ORDER]; // internal + leaf
+    uint8_t ilen[BTREE_ORDER]; // leaf payload length per slot
+    uint8_t data[BTREE_LEAF_DATA]; // leaf payloads, packed in slot order
 };
 
+uint32_t btree_node_checksum(const struct btree_node *node);
+
 int btree_lookup(uint32_t root_block, uint64_t key, uint64_t *out_value);
 
+// Look up an item and copy up to buflen bytes of its payload to buf.
+// out_len receives the full payload length (0 for plain items).
+int btree_lookup_item(uint32_t root_block, uint64_t key, uint64_t *out_value,
+                      void *buf, uint32_t buflen, uint32_t *out_len);
+
 int btree_lookup_ge(uint32_t root_block, uint64_t key,
                     uint64_t *out_key, uint64_t *out_value);
 int btree_lookup_le(uint32_t root_block, uint64_t key,
                     uint64_t *out_key, uint64_t *out_value);
 
+// Range scan position. The current leaf is cached in the cursor; the
+// path records interior blocks and child slots so stepping past a leaf
+// only touches the nodes that change.
+struct btree_cursor {
+    uint32_t root;
+    uint16_t depth;
+    uint16_t valid;
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint16_t slot[BTREE_MAX_DEPTH];
+    struct btree_node leaf;
+};
+
+// Position on the first item >= key (seek) or last item <= key (seek_le).
+int btree_cursor_seek(struct btree_cursor *cur, uint32_t root_block,
+                      uint64_t key);
+int btree_cursor_seek_le(struct btree_cursor *cur, uint32_t root_block,
+                         uint64_t key);
+int btree_cursor_next(struct btree_cursor *cur);
+int btree_cursor_prev(struct btree_cursor *cur);
+int btree_cursor_get(const struct btree_cursor *cur,
+                     uint64_t *out_key, uint64_t *out_value);
+// Payload of the current item, valid until the cursor moves.
+const uint8_t *btree_cursor_data(const struct btree_cursor *cur,
+                                 uint32_t *out_len);
+
 int btree_insert(uint32_t root_block, uint64_t key, uint64_t value,
                  uint32_t *new_root_block);
+// Insert or replace an item with a payload of len <= BTREE_ITEM_MAX
+// bytes. value must be nonzero, as for btree_insert.
+int btree_insert_item(uint32_t root_block, uint64_t key, uint64_t value,
+                      const void *data, uint32_t len,
+                      uint32_t *new_root_block);
+
+int btree_delete(uint32_t root_block, uint64_t key, uint32_t *new_root_block);
+int btree_compact(uint32_t root_block, uint32_t *new_root_block);
+
+// Remove every key in [lo, hi]. fn, if set, sees each removed live item;
+// a negative return aborts the delete. Subtrees inside the range are
+// dropped without being rewritten.
+typedef int (*btree_range_fn)(uint64_t key, uint64_t value, void *arg);
+int btree_delete_range(uint32_t root_block, uint64_t lo, uint64_t hi,
+                       btree_range_fn fn, void *arg,
+                       uint32_t *new_root_block);
+
+// Free the nodes replaced since the last call. roots are every committed
+// tree root; a replaced node still reachable from one of them is kept.
+// Nodes are held back while a reader of a generation older than the one
+// that replaced them is active (oldest_reader). With no roots nothing is
+// freed and the list is kept for the next call.
+void btree_stale_close(void);
+int btree_reclaim(const uint32_t *roots, int nroots, uint64_t oldest_reader);
+uint32_t btree_stale_count(void);
+
+// Bracket a lock-free reader. Nodes of the open transaction are copied
+// rather than rewritten in place while one is active.
+void btree_reader_enter(void);
+void btree_reader_exit(void);
+
+// Count extra references to nodes shared between trees; seen is a bitmap
+// of sb.nblocks bits shared across calls.
+int btree_share_refs(uint32_t root_block, uint8_t *seen);
+
+// Call fn on every node of the tree, each before its children.
+typedef void (*btree_visit_fn)(uint32_t blk, void *arg);
+int btree_visit(uint32_t root_block, btree_visit_fn fn, void *arg);
 
 int btree_commit_root(uint32_t new_root_block);
 
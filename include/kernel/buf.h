@@ -5,7 +5,8 @@
 #define NBUF 30 // Number of buffers in cache
 
 #define B_VALID 0x1 // Buffer contains valid data
-#define B_DIRTY 0x2 // Buffer has been modified
+#define B_DIRTY 0x2 // Modified; written back on eviction or bflush
+#define B_CLOSED 0x4 // Dirty when its transaction closed; due before its commit
 
 struct buf {
     int flags; // B_VALID, B_DIRTY
@@ -23,4 +24,9 @@ struct buf* bread(uint32_t blockno);
 void bwrite(struct buf *b);
 void brelse(struct buf *b);
 void bmark_dirty(struct buf *b);
+void bflush(void);
+void bsync(uint32_t blockno);
+void bclose(void);
+int bflush_closed(void);
+uint32_t bdirty_count(void);
 
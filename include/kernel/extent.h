@@ -1,15 +1,38 @@
 #pragma once
 #include <stdint.h>
 
+struct superblock;
+
 struct extent {
     uint32_t start;
     uint32_t len;
 };
 
+#define EXTENT_CLASSES 32
+
+// Free-space summary; classes[c] counts free extents of 2^c to
+// 2^(c+1) - 1 blocks.
+struct extent_stats {
+    uint32_t free_blocks;
+    uint32_t free_extents;
+    uint32_t largest;
+    uint32_t classes[EXTENT_CLASSES];
+};
+
 void extent_init(void);
 int extent_alloc(uint32_t len, struct extent *out);
+int extent_alloc_near(uint32_t goal, uint32_t len, struct extent *out);
 int extent_alloc_meta(uint32_t len, struct extent *out);
 int extent_reserve(uint32_t start, uint32_t len);
 void extent_free(uint32_t start, uint32_t len);
+uint32_t extent_deferred_blocks(void);
+uint32_t extent_deferred_runs(void);
+int extent_deferred_spare(void);
+int extent_commit_begin(struct superblock *closed);
+int extent_commit_end(struct superblock *closed);
 int extent_commit(void);
 int extent_meta_active(void);
+void extent_stats(struct extent_stats *out);
+void extent_note_alloc(uint32_t blockno);
+void extent_note_free(uint32_t blockno);
+void extent_note_free_run(uint32_t start, uint32_t len);
@@ -29,6 +29,7 @@ struct superblock {
     uint32_t extent_root; // Root block for free-space extents
     uint32_t root_tree; // Root tree for metadata trees
     uint32_t fs_next_ino; // Next FS-tree inode number
+    uint32_t log_root; // Tree log written by fsync since the last commit
     uint64_t generation; // Superblock generation
     uint32_t checksum; // Checksum of superblock (checksum field zeroed)
     uint32_t reserved; // Padding/reserved
@@ -67,13 +68,22 @@ struct inode {
 };
 
 extern struct superblock sb;
+extern struct superblock sb_committed;
 
 void fsinit(void);
 void readsb(void);
-void writesb(void);
+void sb_close(struct superblock *out);
+void writesb(struct superblock *closed);
+void writesb_log(uint32_t log_root);
 
 uint32_t balloc(void);
 void bfree(uint32_t blockno);
+void bfree_range(uint32_t start, uint32_t len);
+int bmap_is_free(uint32_t blockno);
+int bmap_set(uint32_t blockno);
+void breserve(uint32_t blockno);
+int bmap_next_run(uint32_t from, uint32_t limit, uint32_t *start_out,
+                  uint32_t *len_out);
 
 struct inode* iget(uint32_t inum);
 struct inode* idup(struct inode *ip);
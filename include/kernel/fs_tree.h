@@ -5,6 +5,7 @@
 #define FS_ITEM_DIRENT 2
 #define FS_ITEM_EXTENT 3
 #define FS_ITEM_PARENT 4
+#define FS_ITEM_INLINE 5
 
 void fs_tree_init(void);
 int fs_tree_set_inode(uint32_t ino, uint16_t type, uint64_t size);
@@ -21,6 +22,11 @@ int fs_tree_extent_lookup(uint32_t ino, uint64_t file_off,
 int fs_tree_file_write(uint32_t ino, uint64_t off, const void *src, uint32_t n);
 int fs_tree_file_read(uint32_t ino, uint64_t off, void *dst, uint32_t n);
 int fs_tree_truncate(uint32_t ino, uint64_t newsize);
+int fs_tree_fallocate(uint32_t ino, int mode, uint64_t off, uint64_t len);
+int fs_tree_writeback(uint32_t ino); // ino 0: every file
+int fs_tree_defrag(uint32_t ino, int mode, uint32_t budget);
+int fs_tree_fsync(uint32_t ino, int datasync);
+int fs_tree_log_replay(uint64_t subvol, uint32_t log_root);
 int fs_tree_create_file(const char *path, uint32_t *ino_out);
 int fs_tree_create_file_at(uint32_t start, const char *path, uint32_t *ino_out);
 int fs_tree_create_dir(const char *path);
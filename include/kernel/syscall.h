@@ -10,6 +10,14 @@ struct trapframe;
 #define O_TRUNC 0x400
 #define O_TREE 0x800
 
+// SYSCALL_FALLOCATE modes; 0 reserves blocks and grows the file
+#define FALLOC_KEEP_SIZE 0x1 // Reserve blocks without growing the file
+#define FALLOC_NO_ALLOC 0x2 // Grow the file without reserving blocks
+#define FALLOC_PUNCH_HOLE 0x4 // Free the blocks in the range
+
+// SYSCALL_DEFRAG modes; 0 moves shared extents too, unsharing them
+#define DEFRAG_KEEP_SHARED 0x1 // Leave extents shared with clones/snapshots
+
 enum {
     SYSCALL_PUTC = 1,
     SYSCALL_YIELD = 2,
@@ -38,6 +46,10 @@ enum {
     SYSCALL_SUBVOL_SET = 25,
     SYSCALL_GET_METRICS = 26,
     SYSCALL_GET_WORKLOAD = 27,
+    SYSCALL_FALLOCATE = 28,
+    SYSCALL_DEFRAG = 29,
+    SYSCALL_FSYNC = 30,
+    SYSCALL_FDATASYNC = 31, // fsync without the file's name
 };
 
 void syscall_handler(struct trapframe * tf);
@@ -1,13 +1,38 @@
 #pragma once
 #include <stdint.h>
 
+struct superblock;
+
 #define ROOT_ITEM_EXTENT_ROOT 1
 #define ROOT_ITEM_FS_ROOT 2
 #define ROOT_ITEM_SUBVOL_NEXT 3
 #define ROOT_ITEM_EXTENT_REF_ROOT 4
+#define ROOT_ITEM_FEATURES 5
 #define ROOT_ITEM_SUBVOL_BASE 0x1000
 
+// ROOT_ITEM_FEATURES bits
+#define TREE_FEATURE_NO_TOMBSTONES 0x1 // Deletes remove keys; no zero values
+#define TREE_FEATURE_NODE_REFS 0x2 // Shared tree nodes carry refcounts
+
+// A reader's pinned view of the trees. Nodes reachable from these roots
+// stay allocated until tree_read_end, so lookups and cursors over them
+// need no lock while writers build later generations. tree_read_begin
+// gives the last committed roots; tree_read_begin_open the open
+// transaction's, for readers that must see changes not yet committed.
+struct tree_snapshot {
+    int slot;
+    int open; // Roots are the open transaction's
+    uint64_t generation;
+    uint32_t root_tree;
+    uint32_t fs_root;
+};
+
 void tree_init(void);
+int tree_compact(void);
+int tree_reclaim(const struct superblock *committed);
+int tree_read_begin(struct tree_snapshot *snap);
+int tree_read_begin_open(struct tree_snapshot *snap);
+void tree_read_end(struct tree_snapshot *snap);
 int tree_root_get(uint64_t item_type, uint64_t *out_block);
 int tree_subvol_create(uint64_t *id_out);
 int tree_subvol_get(uint64_t id, uint64_t *root_out);
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+// Tree log: fsync copies one inode's items into its subvolume's log tree
+// and writes just those nodes and the superblocks, which name the log
+// beside the last commit's roots. Mount replays the log; the next commit
+// holds everything it did and drops it.
+uint32_t tree_log_root(uint64_t subvol);
+void tree_log_update_begin(void);
+int tree_log_update_end(uint64_t subvol, uint32_t root, int rc);
+int tree_log_sync(void);
+void tree_log_committed(void);
+void tree_log_replay(void);
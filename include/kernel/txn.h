@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+#define TXN_COMMIT_TICKS 10 // Age at which an open transaction is committed
+#define TXN_MAX_STALE 2048 // Replaced tree nodes held before committing
+
+// The open transaction: every tree, allocator and superblock change
+// since the last close, and the file data buffered meanwhile. Changes sit in dirty buffers and in memory until
+// one commit writes them out behind a single pair of superblock writes.
+// At most one closed transaction is being written while the next is open.
+struct txn {
+    int dirty; // Something changed since the last close
+    int committing; // A closed transaction is still being written
+    uint64_t opened; // Tick of the first change
+    uint64_t commits; // Commits written so far
+    uint64_t stalls; // Closes that waited for the commit ahead
+};
+
+void txn_dirty(void);
+void txn_closed(void);
+void txn_committed(void);
+int txn_close(void);
+int txn_wait(void);
+int txn_commit(void);
+int txn_poll(void);
+void txn_start(void);
+void txn_stat(struct txn *out);
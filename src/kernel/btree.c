@@ -1,20 +1,29 @@
 #include <kernel/btree.h>
 #include <kernel/buf.h>
 #include <kernel/fs.h>
+#include <kernel/kalloc.h>
 #include <kernel/panic.h>
 #include <kernel/string.h>
+#include <kernel/txn.h>
+#include <mmu.h>
 
-static uint32_t btree_checksum(const struct btree_node *node) {
+// Covers the fixed node and, when a leaf holds payloads, the slot lengths
+// and payload bytes in use.
+uint32_t btree_node_checksum(const struct btree_node *node) {
     const uint8_t *p = (const uint8_t *)node;
     uint32_t csum_off = (uint32_t)((const uint8_t *)&node->hdr.checksum - p);
-    uint32_t rsv_off = (uint32_t)((const uint8_t *)&node->hdr.reserved - p);
+    uint32_t dlen_off = (uint32_t)((const uint8_t *)&node->hdr.dlen - p);
+    uint32_t len = (uint32_t)((const uint8_t *)node->ilen - p);
+    if (node->hdr.dlen != 0 && node->hdr.dlen <= BTREE_LEAF_DATA) {
+        len = (uint32_t)((const uint8_t *)node->data - p) + node->hdr.dlen;
+    }
     uint32_t hash = 2166136261u; // FNV-1a
-    for (uint32_t i = 0; i < sizeof(*node); i++) {
+    for (uint32_t i = 0; i < len; i++) {
         uint8_t v = p[i];
         if (i >= csum_off && i < csum_off + sizeof(node->hdr.checksum)) {
             v = 0;
         }
-        if (i >= rsv_off && i < rsv_off + sizeof(node->hdr.reserved)) {
+        if (i >= dlen_off && i < dlen_off + sizeof(node->hdr.dlen)) {
             v = 0;
         }
         hash ^= v;
@@ -25,6 +34,7 @@ static uint32_t btree_checksum(const struct btree_node *node) {
 
 static int btree_read_node(uint32_t blockno, struct btree_node *out);
 static int btree_write_node(uint32_t blockno, struct btree_node *node);
+static uint32_t btree_leaf_off(const struct btree_node *node, uint16_t i);
 
 static int btree_node_validate(const struct btree_node *node, uint32_t blockno) {
     if (node->hdr.magic != BTREE_MAGIC) {
@@ -45,13 +55,29 @@ static int btree_node_validate(const struct btree_node *node, uint32_t blockno)
     if (node->hdr.level != 0 && node->hdr.level > 32) {
         return -1;
     }
-    if (btree_checksum(node) != node->hdr.checksum) {
+    if (node->hdr.dlen > BTREE_LEAF_DATA ||
+        (node->hdr.level != 0 && node->hdr.dlen != 0)) {
+        return -1;
+    }
+    if (btree_node_checksum(node) != node->hdr.checksum) {
+        return -1;
+    }
+    uint32_t used = 0;
+    for (uint16_t i = 0; i < node->hdr.nkeys; i++) {
+        used += node->ilen[i];
+    }
+    if (used != node->hdr.dlen) {
         return -1;
     }
     return 0;
 }
 
 int btree_lookup(uint32_t root_block, uint64_t key, uint64_t *out_value) {
+    return btree_lookup_item(root_block, key, out_value, 0, 0, 0);
+}
+
+int btree_lookup_item(uint32_t root_block, uint64_t key, uint64_t *out_value,
+                      void *buf, uint32_t buflen, uint32_t *out_len) {
     if (root_block == 0 || root_block >= sb.nblocks) {
         return -1;
     }
@@ -77,6 +103,14 @@ int btree_lookup(uint32_t root_block, uint64_t key, uint64_t *out_value) {
                 if (out_value) {
                     *out_value = node.keys[i].value;
                 }
+                uint32_t len = node.ilen[i];
+                if (buf) {
+                    memmove(buf, node.data + btree_leaf_off(&node, i),
+                            len < buflen ? len : buflen);
+                }
+                if (out_len) {
+                    *out_len = len;
+                }
                 return 0;
             }
             return -1;
@@ -94,90 +128,203 @@ int btree_lookup(uint32_t root_block, uint64_t key, uint64_t *out_value) {
     }
 }
 
-static void btree_find_ge(uint32_t block, uint64_t key,
-                          uint64_t *best_key, uint64_t *best_val, int *found) {
-    struct btree_node node;
-    if (btree_read_node(block, &node) < 0) return;
+// Read nodes from path[d] down to a leaf, taking the leftmost child at
+// each level (or the rightmost when walking backwards). The leaf slot is
+// left at the first key, or one past the last key for a backwards walk.
+static int btree_cursor_descend(struct btree_cursor *cur, uint16_t d,
+                                int rightmost) {
+    uint32_t blk = cur->path[d];
+    for (;;) {
+        if (d >= BTREE_MAX_DEPTH || btree_read_node(blk, &cur->leaf) < 0) {
+            return -1;
+        }
+        cur->path[d] = blk;
+        uint16_t n = cur->leaf.hdr.nkeys;
+        if (cur->leaf.hdr.level == 0) {
+            cur->depth = d + 1;
+            cur->slot[d] = rightmost ? n : 0;
+            return 0;
+        }
+        uint16_t i = rightmost ? n : 0;
+        uint64_t child = cur->leaf.children[i];
+        if (child == 0 || child >= sb.nblocks) {
+            return -1;
+        }
+        cur->slot[d] = i;
+        blk = (uint32_t)child;
+        d++;
+    }
+}
 
-    if (node.hdr.level == 0) {
-        for (uint16_t i = 0; i < node.hdr.nkeys; i++) {
-            uint64_t k = node.keys[i].key;
-            uint64_t v = node.keys[i].value;
-            if (v == 0) continue;
-            if (k >= key) {
-                if (!*found || k < *best_key) {
-                    *best_key = k;
-                    *best_val = v;
-                    *found = 1;
-                }
-            }
+// Move to the neighbouring leaf. Interior nodes on the path are re-read
+// here, so a full scan costs about one read per leaf plus one per
+// interior node crossed.
+static int btree_cursor_step_leaf(struct btree_cursor *cur, int dir) {
+    for (int d = (int)cur->depth - 2; d >= 0; d--) {
+        if (btree_read_node(cur->path[d], &cur->leaf) < 0) {
+            return -1;
         }
-        return;
+        uint16_t i = cur->slot[d];
+        if (dir > 0 ? i >= cur->leaf.hdr.nkeys : i == 0) {
+            continue;
+        }
+        i = dir > 0 ? i + 1 : i - 1;
+        uint64_t child = cur->leaf.children[i];
+        if (child == 0 || child >= sb.nblocks) {
+            return -1;
+        }
+        cur->slot[d] = i;
+        cur->path[d + 1] = (uint32_t)child;
+        return btree_cursor_descend(cur, (uint16_t)(d + 1), dir < 0);
     }
+    return -1;
+}
 
-    for (uint16_t i = 0; i < node.hdr.nkeys + 1; i++) {
-        if (node.children[i]) {
-            btree_find_ge((uint32_t)node.children[i], key, best_key, best_val, found);
+// Settle on the nearest live item in direction dir. Forwards the leaf
+// slot is inclusive; backwards it is one past the first candidate.
+static int btree_cursor_settle(struct btree_cursor *cur, int dir) {
+    for (;;) {
+        uint16_t d = cur->depth - 1;
+        uint16_t n = cur->leaf.hdr.nkeys;
+        uint16_t i = cur->slot[d];
+        if (dir > 0) {
+            while (i < n && cur->leaf.keys[i].value == 0) {
+                i++;
+            }
+            if (i < n) {
+                cur->slot[d] = i;
+                cur->valid = 1;
+                return 0;
+            }
+        } else {
+            if (i > n) {
+                i = n;
+            }
+            while (i > 0 && cur->leaf.keys[i - 1].value == 0) {
+                i--;
+            }
+            if (i > 0) {
+                cur->slot[d] = i - 1;
+                cur->valid = 1;
+                return 0;
+            }
+        }
+        if (btree_cursor_step_leaf(cur, dir) < 0) {
+            cur->valid = 0;
+            return -1;
         }
     }
 }
 
-static void btree_find_le(uint32_t block, uint64_t key,
-                          uint64_t *best_key, uint64_t *best_val, int *found) {
-    struct btree_node node;
-    if (btree_read_node(block, &node) < 0) return;
+// Route key down to its leaf and return the number of leaf keys <= key
+// (inclusive) or < key (exclusive).
+static int btree_cursor_route(struct btree_cursor *cur, uint32_t root_block,
+                              uint64_t key, int inclusive) {
+    cur->root = root_block;
+    cur->depth = 0;
+    cur->valid = 0;
+    if (root_block == 0 || root_block >= sb.nblocks) {
+        return -1;
+    }
 
-    if (node.hdr.level == 0) {
-        for (uint16_t i = 0; i < node.hdr.nkeys; i++) {
-            uint64_t k = node.keys[i].key;
-            uint64_t v = node.keys[i].value;
-            if (v == 0) continue;
-            if (k <= key) {
-                if (!*found || k > *best_key) {
-                    *best_key = k;
-                    *best_val = v;
-                    *found = 1;
-                }
+    uint32_t blk = root_block;
+    for (uint16_t d = 0; d < BTREE_MAX_DEPTH; d++) {
+        if (btree_read_node(blk, &cur->leaf) < 0) {
+            return -1;
+        }
+        cur->path[d] = blk;
+        uint16_t n = cur->leaf.hdr.nkeys;
+        uint16_t i = 0;
+        if (cur->leaf.hdr.level == 0) {
+            while (i < n && (inclusive ? cur->leaf.keys[i].key <= key
+                                       : cur->leaf.keys[i].key < key)) {
+                i++;
             }
+            cur->slot[d] = i;
+            cur->depth = d + 1;
+            return 0;
         }
-        return;
+        while (i < n && key >= cur->leaf.keys[i].key) {
+            i++;
+        }
+        uint64_t child = cur->leaf.children[i];
+        if (child == 0 || child >= sb.nblocks) {
+            return -1;
+        }
+        cur->slot[d] = i;
+        blk = (uint32_t)child;
+    }
+    return -1;
+}
+
+int btree_cursor_seek(struct btree_cursor *cur, uint32_t root_block,
+                      uint64_t key) {
+    if (btree_cursor_route(cur, root_block, key, 0) < 0) {
+        return -1;
     }
+    return btree_cursor_settle(cur, 1);
+}
 
-    for (uint16_t i = 0; i < node.hdr.nkeys + 1; i++) {
-        if (node.children[i]) {
-            btree_find_le((uint32_t)node.children[i], key, best_key, best_val, found);
-        }
+int btree_cursor_seek_le(struct btree_cursor *cur, uint32_t root_block,
+                         uint64_t key) {
+    if (btree_cursor_route(cur, root_block, key, 1) < 0) {
+        return -1;
+    }
+    return btree_cursor_settle(cur, -1);
+}
+
+int btree_cursor_next(struct btree_cursor *cur) {
+    if (!cur->valid) {
+        return -1;
+    }
+    cur->slot[cur->depth - 1]++;
+    return btree_cursor_settle(cur, 1);
+}
+
+int btree_cursor_prev(struct btree_cursor *cur) {
+    if (!cur->valid) {
+        return -1;
+    }
+    return btree_cursor_settle(cur, -1);
+}
+
+int btree_cursor_get(const struct btree_cursor *cur,
+                     uint64_t *out_key, uint64_t *out_value) {
+    if (!cur->valid) {
+        return -1;
+    }
+    const struct btree_key *k = &cur->leaf.keys[cur->slot[cur->depth - 1]];
+    if (out_key) *out_key = k->key;
+    if (out_value) *out_value = k->value;
+    return 0;
+}
+
+const uint8_t *btree_cursor_data(const struct btree_cursor *cur,
+                                 uint32_t *out_len) {
+    if (!cur->valid) {
+        return 0;
     }
+    uint16_t i = cur->slot[cur->depth - 1];
+    if (out_len) *out_len = cur->leaf.ilen[i];
+    return cur->leaf.data + btree_leaf_off(&cur->leaf, i);
 }
 
 int btree_lookup_ge(uint32_t root_block, uint64_t key,
                     uint64_t *out_key, uint64_t *out_value) {
-    if (root_block == 0 || root_block >= sb.nblocks) {
+    struct btree_cursor cur;
+    if (btree_cursor_seek(&cur, root_block, key) < 0) {
         return -1;
     }
-    uint64_t best_key = 0;
-    uint64_t best_val = 0;
-    int found = 0;
-    btree_find_ge(root_block, key, &best_key, &best_val, &found);
-    if (!found) return -1;
-    if (out_key) *out_key = best_key;
-    if (out_value) *out_value = best_val;
-    return 0;
+    return btree_cursor_get(&cur, out_key, out_value);
 }
 
 int btree_lookup_le(uint32_t root_block, uint64_t key,
                     uint64_t *out_key, uint64_t *out_value) {
-    if (root_block == 0 || root_block >= sb.nblocks) {
+    struct btree_cursor cur;
+    if (btree_cursor_seek_le(&cur, root_block, key) < 0) {
         return -1;
     }
-    uint64_t best_key = 0;
-    uint64_t best_val = 0;
-    int found = 0;
-    btree_find_le(root_block, key, &best_key, &best_val, &found);
-    if (!found) return -1;
-    if (out_key) *out_key = best_key;
-    if (out_value) *out_value = best_val;
-    return 0;
+    return btree_cursor_get(&cur, out_key, out_value);
 }
 
 static void btree_node_init(struct btree_node *node, uint16_t level) {
@@ -208,10 +355,10 @@ static int btree_write_node(uint32_t blockno, struct btree_node *node) {
     node->hdr.type = BTREE_TYPE_NODE;
     node->hdr.logical = blockno;
     node->hdr.generation = sb.generation + 1;
-    node->hdr.checksum = btree_checksum(node);
+    node->hdr.checksum = btree_node_checksum(node);
     struct buf *bp = bread(blockno);
     memmove(bp->data, node, sizeof(*node));
-    bwrite(bp);
+    bmark_dirty(bp);
     brelse(bp);
     return 0;
 }
@@ -223,112 +370,301 @@ static int btree_read_node(uint32_t blockno, struct btree_node *out) {
     struct buf *bp = bread(blockno);
     memmove(out, bp->data, sizeof(*out));
     brelse(bp);
+    if (out->hdr.dlen == 0) {
+        // Fixed-size nodes leave whatever was in the block after keys.
+        memzero(out->ilen, sizeof(out->ilen) + sizeof(out->data));
+    }
     return btree_node_validate(out, blockno);
 }
 
+// Nodes replaced by copy-on-write since the last reclaim. The on-disk
+// roots may still reference them until the replacing roots are written.
+#define BTREE_STALE_PAGES 8
+#define BTREE_STALE_PER_PAGE (PGSIZE / sizeof(uint32_t))
+
+static uint32_t *stale_pages[BTREE_STALE_PAGES];
+static uint32_t stale_n = 0;
+
+// Entries [0, stale_held) were retired at stale_held_gen and are kept
+// until every reader of an older generation has finished.
+static uint32_t stale_held = 0;
+static uint64_t stale_held_gen = 0;
+
+// Entries [0, stale_closed) were retired before the open transaction
+// closed; the rest wait for the commit after it.
+static uint32_t stale_closed = ~0u;
+
+static uint32_t *btree_stale_at(uint32_t i) {
+    return &stale_pages[i / BTREE_STALE_PER_PAGE][i % BTREE_STALE_PER_PAGE];
+}
+
+// A block that cannot be recorded would leak, so the update replacing it
+// fails instead. txn_poll commits well before the list fills up.
+static int btree_stale_add(uint32_t blk) {
+    uint32_t page = stale_n / BTREE_STALE_PER_PAGE;
+    if (page >= BTREE_STALE_PAGES) {
+        return -1;
+    }
+    if (stale_pages[page] == 0) {
+        stale_pages[page] = kalloc();
+        if (stale_pages[page] == 0) {
+            return -1;
+        }
+    }
+    *btree_stale_at(stale_n++) = blk;
+    return 0;
+}
+
+// Nodes born in the open transaction are under no committed root, so an
+// update rewrites them in place rather than copying them. The update's
+// next node write claims the block back; blocks still here when the
+// outermost update finishes are no longer in any tree and are freed. Not
+// while a reader is walking the open transaction's roots.
+#define BTREE_RECYCLE_MAX 64
+
+static uint32_t recycle[BTREE_RECYCLE_MAX];
+static int recycle_n = 0;
+static int update_depth = 0;
+static int txn_readers = 0;
+
+void btree_reader_enter(void) {
+    txn_readers++;
+}
+
+void btree_reader_exit(void) {
+    if (txn_readers > 0) {
+        txn_readers--;
+    }
+}
+
+static void btree_update_begin(void) {
+    update_depth++;
+}
+
+// A failed update may leave the caller on the old root; leave its blocks
+// to btree_reclaim, which keeps whatever a committed root still reaches.
+static void btree_update_end(int rc) {
+    if (--update_depth > 0) {
+        return;
+    }
+    while (recycle_n > 0) {
+        uint32_t blk = recycle[--recycle_n];
+        if (rc < 0) {
+            btree_stale_add(blk); // Already failing either way
+        } else {
+            bfree(blk);
+        }
+    }
+}
+
+// An exclusive node leaving the tree: reuse it if the open transaction
+// wrote it, otherwise release it after the next commit.
+static int btree_retire(uint32_t blk, const struct btree_node *node) {
+    if (node->hdr.generation == sb.generation + 1 && txn_readers == 0 &&
+        recycle_n < BTREE_RECYCLE_MAX) {
+        recycle[recycle_n++] = blk;
+        return 0;
+    }
+    return btree_stale_add(blk);
+}
+
+// Called once for each existing node an update is about to rewrite. A
+// shared node (refcount > 1) stays on disk for its other owners, so the
+// copy takes a reference on each child and this tree drops its reference
+// on the node. An exclusive node hands its child references to the copy
+// and is retired.
+static int btree_cow(uint32_t blk, const struct btree_node *node) {
+    if (brefcnt_get(blk) > 1) {
+        if (node->hdr.level != 0) {
+            for (uint16_t i = 0; i <= node->hdr.nkeys; i++) {
+                brefcnt_inc((uint32_t)node->children[i]);
+            }
+        }
+        brefcnt_dec(blk);
+        return 0;
+    }
+    return btree_retire(blk, node);
+}
+
+static int btree_write_new(struct btree_node *node, uint32_t *out_block) {
+    uint32_t blk = recycle_n > 0 ? recycle[--recycle_n] : balloc();
+    if (blk == 0) return -1;
+    if (btree_write_node(blk, node) < 0) return -1;
+    *out_block = blk;
+    return 0;
+}
+
+// Leaf payload helpers. Slot i's ilen[i] bytes start after the payloads
+// of the slots before it.
+static uint32_t btree_leaf_off(const struct btree_node *node, uint16_t i) {
+    uint32_t off = 0;
+    for (uint16_t j = 0; j < i; j++) {
+        off += node->ilen[j];
+    }
+    return off;
+}
+
+static void btree_leaf_insert_at(struct btree_node *node, uint16_t i,
+                                 uint64_t key, uint64_t value,
+                                 const uint8_t *data, uint8_t len) {
+    uint16_t n = node->hdr.nkeys;
+    uint32_t off = btree_leaf_off(node, i);
+    memmove(node->data + off + len, node->data + off, node->hdr.dlen - off);
+    if (len != 0) {
+        memmove(node->data + off, data, len);
+    }
+    for (uint16_t j = n; j > i; j--) {
+        node->keys[j] = node->keys[j - 1];
+        node->ilen[j] = node->ilen[j - 1];
+    }
+    node->keys[i].key = key;
+    node->keys[i].value = value;
+    node->ilen[i] = len;
+    node->hdr.nkeys = n + 1;
+    node->hdr.dlen += len;
+}
+
+static void btree_leaf_remove_at(struct btree_node *node, uint16_t i) {
+    uint16_t n = node->hdr.nkeys;
+    uint32_t off = btree_leaf_off(node, i);
+    uint8_t len = node->ilen[i];
+    memmove(node->data + off, node->data + off + len,
+            node->hdr.dlen - off - len);
+    for (uint16_t j = i; j + 1 < n; j++) {
+        node->keys[j] = node->keys[j + 1];
+        node->ilen[j] = node->ilen[j + 1];
+    }
+    node->ilen[n - 1] = 0;
+    node->hdr.nkeys = n - 1;
+    node->hdr.dlen -= len;
+}
+
+// Copy slot si of src, payload included, into slot di of dst.
+static void btree_leaf_copy(struct btree_node *dst, uint16_t di,
+                            const struct btree_node *src, uint16_t si) {
+    btree_leaf_insert_at(dst, di, src->keys[si].key, src->keys[si].value,
+                         src->data + btree_leaf_off(src, si), src->ilen[si]);
+}
+
+// A node needs rebalancing when it has few keys, unless it is a leaf whose
+// payloads already fill a good part of it.
+static int btree_underfull(const struct btree_node *node) {
+    return node->hdr.nkeys < BTREE_MIN_KEYS &&
+           node->hdr.dlen < BTREE_LEAF_DATA / 4;
+}
+
+struct btree_item {
+    uint64_t key;
+    uint64_t value;
+    const uint8_t *data;
+    uint8_t len;
+};
+
 struct btree_split {
     int split;
     uint64_t sep_key;
     uint32_t right_block;
 };
 
+// Item j of old once ins is placed at slot i, replacing slot i if replace.
+static void btree_leaf_item(const struct btree_node *old, uint16_t j,
+                            uint16_t i, int replace,
+                            const struct btree_item *ins,
+                            struct btree_item *out) {
+    if (j == i) {
+        *out = *ins;
+        return;
+    }
+    uint16_t k = (j < i || replace) ? j : j - 1;
+    out->key = old->keys[k].key;
+    out->value = old->keys[k].value;
+    out->data = old->data + btree_leaf_off(old, k);
+    out->len = old->ilen[k];
+}
+
 static int btree_insert_leaf(const struct btree_node *old,
-                             uint64_t key, uint64_t value,
+                             const struct btree_item *ins,
                              uint32_t *out_block,
                              struct btree_split *out_split) {
-    struct btree_key tmp[BTREE_ORDER + 1];
     uint16_t n = old->hdr.nkeys;
     uint16_t i = 0;
-    int replaced = 0;
-
-    while (i < n && key > old->keys[i].key) {
-        tmp[i] = old->keys[i];
+    while (i < n && ins->key > old->keys[i].key) {
         i++;
     }
+    int replace = (i < n && ins->key == old->keys[i].key);
+    uint16_t total = n + (replace ? 0 : 1);
+    uint32_t bytes = old->hdr.dlen + ins->len - (replace ? old->ilen[i] : 0);
 
-    if (i < n && key == old->keys[i].key) {
-        tmp[i] = old->keys[i];
-        tmp[i].value = value;
-        replaced = 1;
-        i++;
-    } else {
-        tmp[i].key = key;
-        tmp[i].value = value;
+    // Split by count, or where the payload bytes balance best.
+    uint16_t mid = total;
+    if (bytes > BTREE_LEAF_DATA) {
+        uint32_t best = ~0u;
+        uint32_t left = 0;
+        for (uint16_t m = 1; m < total; m++) {
+            struct btree_item it;
+            btree_leaf_item(old, m - 1, i, replace, ins, &it);
+            left += it.len;
+            uint32_t worst = (left > bytes - left) ? left : bytes - left;
+            if (worst < best) {
+                best = worst;
+                mid = m;
+            }
+        }
+    } else if (total > BTREE_ORDER) {
+        mid = total / 2;
     }
 
-    for (uint16_t j = i; j < n; j++) {
-        tmp[j + (replaced ? 0 : 1)] = old->keys[j];
+    struct btree_node node;
+    btree_node_init(&node, 0);
+    for (uint16_t j = 0; j < mid; j++) {
+        struct btree_item it;
+        btree_leaf_item(old, j, i, replace, ins, &it);
+        btree_leaf_insert_at(&node, j, it.key, it.value, it.data, it.len);
     }
-
-    uint16_t total = n + (replaced ? 0 : 1);
-    if (total <= BTREE_ORDER) {
-        uint32_t newblk = balloc();
-        if (newblk == 0) return -1;
-        struct btree_node node;
-        btree_node_init(&node, 0);
-        node.hdr.nkeys = total;
-        for (uint16_t k = 0; k < total; k++) {
-            node.keys[k] = tmp[k];
-        }
-        if (btree_write_node(newblk, &node) < 0) return -1;
-        out_split->split = 0;
-        *out_block = newblk;
+    if (btree_write_new(&node, out_block) < 0) return -1;
+    out_split->split = 0;
+    if (mid == total) {
         return 0;
     }
 
-    uint16_t mid = total / 2;
-    uint32_t leftblk = balloc();
-    uint32_t rightblk = balloc();
-    if (leftblk == 0 || rightblk == 0) return -1;
-
-    struct btree_node left;
-    struct btree_node right;
-    btree_node_init(&left, 0);
-    btree_node_init(&right, 0);
-
-    left.hdr.nkeys = mid;
-    for (uint16_t k = 0; k < mid; k++) {
-        left.keys[k] = tmp[k];
-    }
-
-    right.hdr.nkeys = total - mid;
-    for (uint16_t k = 0; k < right.hdr.nkeys; k++) {
-        right.keys[k] = tmp[mid + k];
+    btree_node_init(&node, 0);
+    for (uint16_t j = mid; j < total; j++) {
+        struct btree_item it;
+        btree_leaf_item(old, j, i, replace, ins, &it);
+        btree_leaf_insert_at(&node, j - mid, it.key, it.value, it.data, it.len);
     }
-
-    if (btree_write_node(leftblk, &left) < 0) return -1;
-    if (btree_write_node(rightblk, &right) < 0) return -1;
-
+    if (btree_write_new(&node, &out_split->right_block) < 0) return -1;
     out_split->split = 1;
-    out_split->sep_key = right.keys[0].key;
-    out_split->right_block = rightblk;
-    *out_block = leftblk;
+    out_split->sep_key = node.keys[0].key;
     return 0;
 }
 
 static int btree_insert_internal(const struct btree_node *old,
-                                 uint64_t key, uint64_t value,
+                                 const struct btree_item *ins,
                                  uint32_t *out_block,
                                  struct btree_split *out_split) {
     uint16_t n = old->hdr.nkeys;
     uint16_t i = 0;
-    while (i < n && key >= old->keys[i].key) {
+    while (i < n && ins->key >= old->keys[i].key) {
         i++;
     }
 
     uint32_t child = (uint32_t)old->children[i];
-    struct btree_node child_node;
-    if (btree_read_node(child, &child_node) < 0) {
+    struct btree_node node;
+    if (btree_read_node(child, &node) < 0) {
+        return -1;
+    }
+    if (btree_cow(child, &node) < 0) {
         return -1;
     }
 
     struct btree_split child_split = {0};
     uint32_t new_child = 0;
     int r;
-    if (child_node.hdr.level == 0) {
-        r = btree_insert_leaf(&child_node, key, value, &new_child, &child_split);
+    if (node.hdr.level == 0) {
+        r = btree_insert_leaf(&node, ins, &new_child, &child_split);
     } else {
-        r = btree_insert_internal(&child_node, key, value, &new_child, &child_split);
+        r = btree_insert_internal(&node, ins, &new_child, &child_split);
     }
     if (r < 0) return -1;
 
@@ -357,89 +693,64 @@ static int btree_insert_internal(const struct btree_node *old,
         total++;
     }
 
-    if (total <= BTREE_ORDER) {
-        uint32_t newblk = balloc();
-        if (newblk == 0) return -1;
-        struct btree_node node;
-        btree_node_init(&node, old->hdr.level);
-        node.hdr.nkeys = total;
-        for (uint16_t k = 0; k < total; k++) {
-            node.keys[k] = keys[k];
-        }
-        for (uint16_t k = 0; k < total + 1; k++) {
-            node.children[k] = children[k];
-        }
-        if (btree_write_node(newblk, &node) < 0) return -1;
-        out_split->split = 0;
-        *out_block = newblk;
-        return 0;
-    }
-
-    uint16_t mid = total / 2;
-    uint32_t leftblk = balloc();
-    uint32_t rightblk = balloc();
-    if (leftblk == 0 || rightblk == 0) return -1;
-
-    struct btree_node left;
-    struct btree_node right;
-    btree_node_init(&left, old->hdr.level);
-    btree_node_init(&right, old->hdr.level);
-
-    left.hdr.nkeys = mid;
+    // The child has been written, so its buffer is reused for the output.
+    uint16_t mid = (total <= BTREE_ORDER) ? total : total / 2;
+    btree_node_init(&node, old->hdr.level);
+    node.hdr.nkeys = mid;
     for (uint16_t k = 0; k < mid; k++) {
-        left.keys[k] = keys[k];
+        node.keys[k] = keys[k];
     }
     for (uint16_t k = 0; k < mid + 1; k++) {
-        left.children[k] = children[k];
+        node.children[k] = children[k];
+    }
+    if (btree_write_new(&node, out_block) < 0) return -1;
+    out_split->split = 0;
+    if (mid == total) {
+        return 0;
     }
 
-    right.hdr.nkeys = total - mid - 1;
-    for (uint16_t k = 0; k < right.hdr.nkeys; k++) {
-        right.keys[k] = keys[mid + 1 + k];
+    btree_node_init(&node, old->hdr.level);
+    node.hdr.nkeys = total - mid - 1;
+    for (uint16_t k = 0; k < node.hdr.nkeys; k++) {
+        node.keys[k] = keys[mid + 1 + k];
     }
-    for (uint16_t k = 0; k < right.hdr.nkeys + 1; k++) {
-        right.children[k] = children[mid + 1 + k];
+    for (uint16_t k = 0; k < node.hdr.nkeys + 1; k++) {
+        node.children[k] = children[mid + 1 + k];
     }
-
-    if (btree_write_node(leftblk, &left) < 0) return -1;
-    if (btree_write_node(rightblk, &right) < 0) return -1;
-
+    if (btree_write_new(&node, &out_split->right_block) < 0) return -1;
     out_split->split = 1;
     out_split->sep_key = keys[mid].key;
-    out_split->right_block = rightblk;
-    *out_block = leftblk;
     return 0;
 }
 
-int btree_insert(uint32_t root_block, uint64_t key, uint64_t value,
-                 uint32_t *new_root_block) {
-    if (new_root_block == 0) return -1;
+static int btree_insert_rec(uint32_t root_block,
+                            const struct btree_item *ins,
+                            uint32_t *new_root_block) {
+    if (new_root_block == 0 || ins->len > BTREE_ITEM_MAX) return -1;
 
+    struct btree_node root;
     if (root_block == 0) {
-        uint32_t newblk = balloc();
-        if (newblk == 0) return -1;
-        struct btree_node leaf;
-        btree_node_init(&leaf, 0);
-        leaf.hdr.nkeys = 1;
-        leaf.keys[0].key = key;
-        leaf.keys[0].value = value;
-        if (btree_write_node(newblk, &leaf) < 0) return -1;
-        *new_root_block = newblk;
-        return 0;
+        btree_node_init(&root, 0);
+        btree_leaf_insert_at(&root, 0, ins->key, ins->value, ins->data,
+                             ins->len);
+        return btree_write_new(&root, new_root_block);
     }
 
-    struct btree_node root;
     if (btree_read_node(root_block, &root) < 0) {
         return -1;
     }
+    if (btree_cow(root_block, &root) < 0) {
+        return -1;
+    }
 
     struct btree_split split = {0};
     uint32_t new_root = 0;
+    uint16_t level = root.hdr.level;
     int r;
-    if (root.hdr.level == 0) {
-        r = btree_insert_leaf(&root, key, value, &new_root, &split);
+    if (level == 0) {
+        r = btree_insert_leaf(&root, ins, &new_root, &split);
     } else {
-        r = btree_insert_internal(&root, key, value, &new_root, &split);
+        r = btree_insert_internal(&root, ins, &new_root, &split);
     }
     if (r < 0) return -1;
 
@@ -448,30 +759,829 @@ int btree_insert(uint32_t root_block, uint64_t key, uint64_t value,
         return 0;
     }
 
-    uint32_t topblk = balloc();
-    if (topblk == 0) return -1;
-    struct btree_node top;
-    btree_node_init(&top, root.hdr.level + 1);
-    top.hdr.nkeys = 1;
-    top.keys[0].key = split.sep_key;
-    top.keys[0].value = 0;
-    top.children[0] = new_root;
-    top.children[1] = split.right_block;
+    btree_node_init(&root, level + 1);
+    root.hdr.nkeys = 1;
+    root.keys[0].key = split.sep_key;
+    root.keys[0].value = 0;
+    root.children[0] = new_root;
+    root.children[1] = split.right_block;
+    return btree_write_new(&root, new_root_block);
+}
 
-    if (btree_write_node(topblk, &top) < 0) return -1;
-    *new_root_block = topblk;
-    return 0;
+static int btree_insert_root(uint32_t root_block,
+                             const struct btree_item *ins,
+                             uint32_t *new_root_block) {
+    btree_update_begin();
+    int rc = btree_insert_rec(root_block, ins, new_root_block);
+    btree_update_end(rc);
+    return rc;
 }
 
-int btree_commit_root(uint32_t new_root_block) {
-    if (new_root_block == 0 || new_root_block >= sb.nblocks) {
+int btree_insert(uint32_t root_block, uint64_t key, uint64_t value,
+                 uint32_t *new_root_block) {
+    struct btree_item ins = { key, value, 0, 0 };
+    return btree_insert_root(root_block, &ins, new_root_block);
+}
+
+int btree_insert_item(uint32_t root_block, uint64_t key, uint64_t value,
+                      const void *data, uint32_t len,
+                      uint32_t *new_root_block) {
+    if (len > BTREE_ITEM_MAX || (len != 0 && data == 0)) {
         return -1;
     }
-    sb.btree_root = new_root_block;
-    writesb();
+    // Shrinking a payload in place could leave its leaf underfull, and the
+    // insert path does not rebalance; delete first so the delete path does.
+    uint32_t old_len = 0;
+    if (root_block != 0 &&
+        btree_lookup_item(root_block, key, 0, 0, 0, &old_len) == 0 &&
+        len < old_len) {
+        if (btree_delete(root_block, key, &root_block) < 0) {
+            return -1;
+        }
+    }
+    struct btree_item ins = { key, value, (const uint8_t *)data, (uint8_t)len };
+    return btree_insert_root(root_block, &ins, new_root_block);
+}
+
+static void btree_remove_child(struct btree_node *parent, uint16_t sep) {
+    uint16_t n = parent->hdr.nkeys;
+    for (uint16_t j = sep; j + 1 < n; j++) {
+        parent->keys[j] = parent->keys[j + 1];
+    }
+    for (uint16_t j = sep + 1; j < n; j++) {
+        parent->children[j] = parent->children[j + 1];
+    }
+    parent->children[n] = 0;
+    parent->hdr.nkeys = n - 1;
+}
+
+// Move the last entry of left to the front of right. parent->keys[sep]
+// separates the two siblings.
+static void btree_borrow_left(struct btree_node *parent, uint16_t sep,
+                              struct btree_node *left,
+                              struct btree_node *right) {
+    uint16_t ln = left->hdr.nkeys;
+    uint16_t rn = right->hdr.nkeys;
+    if (right->hdr.level == 0) {
+        btree_leaf_copy(right, 0, left, ln - 1);
+        btree_leaf_remove_at(left, ln - 1);
+        parent->keys[sep].key = right->keys[0].key;
+        return;
+    }
+    for (uint16_t j = rn; j > 0; j--) {
+        right->keys[j] = right->keys[j - 1];
+    }
+    for (uint16_t j = rn + 1; j > 0; j--) {
+        right->children[j] = right->children[j - 1];
+    }
+    right->keys[0].key = parent->keys[sep].key;
+    right->keys[0].value = 0;
+    right->children[0] = left->children[ln];
+    left->children[ln] = 0;
+    parent->keys[sep].key = left->keys[ln - 1].key;
+    left->hdr.nkeys = ln - 1;
+    right->hdr.nkeys = rn + 1;
+}
+
+// Move the first entry of right to the end of left.
+static void btree_borrow_right(struct btree_node *parent, uint16_t sep,
+                               struct btree_node *left,
+                               struct btree_node *right) {
+    uint16_t ln = left->hdr.nkeys;
+    uint16_t rn = right->hdr.nkeys;
+    if (left->hdr.level == 0) {
+        btree_leaf_copy(left, ln, right, 0);
+        btree_leaf_remove_at(right, 0);
+        parent->keys[sep].key = right->keys[0].key;
+        return;
+    }
+    left->keys[ln].key = parent->keys[sep].key;
+    left->keys[ln].value = 0;
+    left->children[ln + 1] = right->children[0];
+    parent->keys[sep].key = right->keys[0].key;
+    for (uint16_t j = 0; j < rn; j++) {
+        right->children[j] = right->children[j + 1];
+    }
+    right->children[rn] = 0;
+    for (uint16_t j = 0; j + 1 < rn; j++) {
+        right->keys[j] = right->keys[j + 1];
+    }
+    left->hdr.nkeys = ln + 1;
+    right->hdr.nkeys = rn - 1;
+}
+
+static int btree_merge_fits(const struct btree_node *left,
+                            const struct btree_node *right) {
+    uint32_t total = (uint32_t)left->hdr.nkeys + right->hdr.nkeys;
+    if (left->hdr.level != 0) {
+        total++;
+    }
+    return total <= BTREE_ORDER &&
+           left->hdr.dlen + right->hdr.dlen <= BTREE_LEAF_DATA;
+}
+
+// Append right to left and drop the separator between them from parent.
+static void btree_merge(struct btree_node *parent, uint16_t sep,
+                        struct btree_node *left,
+                        const struct btree_node *right) {
+    uint16_t ln = left->hdr.nkeys;
+    uint16_t rn = right->hdr.nkeys;
+    if (left->hdr.level == 0) {
+        for (uint16_t j = 0; j < rn; j++) {
+            btree_leaf_copy(left, ln + j, right, j);
+        }
+    } else {
+        left->keys[ln].key = parent->keys[sep].key;
+        left->keys[ln].value = 0;
+        for (uint16_t j = 0; j < rn; j++) {
+            left->keys[ln + 1 + j] = right->keys[j];
+        }
+        for (uint16_t j = 0; j <= rn; j++) {
+            left->children[ln + 1 + j] = right->children[j];
+        }
+        left->hdr.nkeys = ln + 1 + rn;
+    }
+    btree_remove_child(parent, sep);
+}
+
+// Write the modified child at parent->children[i], first borrowing from or
+// merging with a sibling if it became underfull.
+static int btree_fix_child(struct btree_node *parent, uint16_t i,
+                           struct btree_node *child) {
+    if (!btree_underfull(child) || parent->hdr.nkeys == 0) {
+        uint32_t blk = 0;
+        if (btree_write_new(child, &blk) < 0) return -1;
+        parent->children[i] = blk;
+        return 0;
+    }
+
+    uint16_t sib = (i > 0) ? i - 1 : i + 1;
+    struct btree_node other;
+    if (btree_read_node((uint32_t)parent->children[sib], &other) < 0) {
+        return -1;
+    }
+    if (btree_cow((uint32_t)parent->children[sib], &other) < 0) {
+        return -1;
+    }
+
+    uint16_t sep = (i > 0) ? i - 1 : i;
+    struct btree_node *left = (i > 0) ? &other : child;
+    struct btree_node *right = (i > 0) ? child : &other;
+
+    // Merge when borrowing could not leave both sides at MIN_KEYS.
+    if (other.hdr.nkeys + child->hdr.nkeys < 2 * BTREE_MIN_KEYS &&
+        btree_merge_fits(left, right)) {
+        btree_merge(parent, sep, left, right);
+        uint32_t blk = 0;
+        if (btree_write_new(left, &blk) < 0) return -1;
+        parent->children[sep] = blk;
+        return 0;
+    }
+
+    // A leaf that lost a large item can need more than one entry back.
+    while (btree_underfull(child) && other.hdr.nkeys > 0) {
+        if (i > 0) {
+            btree_borrow_left(parent, sep, left, right);
+        } else {
+            btree_borrow_right(parent, sep, left, right);
+        }
+    }
+
+    uint32_t lblk = 0;
+    uint32_t rblk = 0;
+    if (btree_write_new(left, &lblk) < 0) return -1;
+    if (btree_write_new(right, &rblk) < 0) return -1;
+    parent->children[sep] = lblk;
+    parent->children[sep + 1] = rblk;
     return 0;
 }
 
+static int btree_delete_rec(struct btree_node *node, uint64_t key, int *found) {
+    uint16_t n = node->hdr.nkeys;
+    uint16_t i = 0;
+
+    if (node->hdr.level == 0) {
+        while (i < n && key > node->keys[i].key) {
+            i++;
+        }
+        if (i == n || node->keys[i].key != key) {
+            *found = 0;
+            return 0;
+        }
+        btree_leaf_remove_at(node, i);
+        *found = 1;
+        return 0;
+    }
+
+    while (i < n && key >= node->keys[i].key) {
+        i++;
+    }
+
+    struct btree_node child;
+    if (btree_read_node((uint32_t)node->children[i], &child) < 0) {
+        return -1;
+    }
+    if (btree_cow((uint32_t)node->children[i], &child) < 0) {
+        return -1;
+    }
+    if (btree_delete_rec(&child, key, found) < 0) {
+        return -1;
+    }
+    if (!*found) {
+        return 0;
+    }
+    return btree_fix_child(node, i, &child);
+}
+
+// Whether key is stored, counting zero-valued legacy tombstones.
+static int btree_contains(uint32_t root_block, uint64_t key) {
+    uint32_t blk = root_block;
+    for (uint16_t d = 0; d < BTREE_MAX_DEPTH; d++) {
+        struct btree_node node;
+        if (btree_read_node(blk, &node) < 0) {
+            return 0;
+        }
+        uint16_t n = node.hdr.nkeys;
+        uint16_t i = 0;
+        if (node.hdr.level == 0) {
+            while (i < n && key > node.keys[i].key) {
+                i++;
+            }
+            return i < n && node.keys[i].key == key;
+        }
+        while (i < n && key >= node.keys[i].key) {
+            i++;
+        }
+        blk = (uint32_t)node.children[i];
+    }
+    return 0;
+}
+
+static int btree_delete_root(uint32_t root_block, uint64_t key,
+                             uint32_t *new_root_block) {
+    if (new_root_block == 0) return -1;
+    if (root_block == 0) {
+        *new_root_block = 0;
+        return 0;
+    }
+
+    // Nodes are released on the way down, so only start once the key is
+    // known to be present.
+    if (!btree_contains(root_block, key)) {
+        *new_root_block = root_block;
+        return 0;
+    }
+
+    struct btree_node root;
+    if (btree_read_node(root_block, &root) < 0) {
+        return -1;
+    }
+    if (btree_cow(root_block, &root) < 0) {
+        return -1;
+    }
+
+    int found = 0;
+    if (btree_delete_rec(&root, key, &found) < 0) {
+        return -1;
+    }
+
+    // Collapse internal roots left with a single child. The old root was
+    // retired above; every single-child node stepped past leaves the
+    // tree too.
+    if (root.hdr.level != 0 && root.hdr.nkeys == 0) {
+        uint32_t blk = (uint32_t)root.children[0];
+        for (;;) {
+            if (btree_read_node(blk, &root) < 0) {
+                return -1;
+            }
+            if (root.hdr.level == 0 || root.hdr.nkeys != 0) {
+                break;
+            }
+            if (btree_cow(blk, &root) < 0) {
+                return -1;
+            }
+            blk = (uint32_t)root.children[0];
+        }
+        *new_root_block = blk;
+        return 0;
+    }
+
+    return btree_write_new(&root, new_root_block);
+}
+
+int btree_delete(uint32_t root_block, uint64_t key, uint32_t *new_root_block) {
+    btree_update_begin();
+    int rc = btree_delete_root(root_block, key, new_root_block);
+    btree_update_end(rc);
+    return rc;
+}
+
+struct btree_range {
+    uint64_t lo;
+    uint64_t hi;
+    btree_range_fn fn;
+    void *arg;
+};
+
+// Drop a subtree that lies wholly inside the range, reporting its live
+// items. Once a shared node is reached (owned == 0 below it) the subtree
+// stays on disk for its other owners and only loses this tree's reference.
+static int btree_range_drop(uint32_t blk, struct btree_range *r, int owned) {
+    struct btree_node node;
+    if (btree_read_node(blk, &node) < 0) {
+        return -1;
+    }
+    if (owned && brefcnt_get(blk) > 1) {
+        brefcnt_dec(blk);
+        owned = 0;
+    } else if (owned && btree_retire(blk, &node) < 0) {
+        return -1;
+    }
+
+    if (node.hdr.level == 0) {
+        for (uint16_t i = 0; i < node.hdr.nkeys; i++) {
+            if (node.keys[i].value != 0 && r->fn &&
+                r->fn(node.keys[i].key, node.keys[i].value, r->arg) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for (uint16_t i = 0; i <= node.hdr.nkeys; i++) {
+        if (btree_range_drop((uint32_t)node.children[i], r, owned) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Rebalance parent->children[i] until it is no longer underfull. A range
+// delete can leave a boundary child well below the minimum, so this
+// repeats the single-step borrow/merge used by btree_delete.
+static int btree_range_fix(struct btree_node *parent, uint16_t *i) {
+    for (;;) {
+        uint32_t blk = (uint32_t)parent->children[*i];
+        struct btree_node child;
+        if (btree_read_node(blk, &child) < 0) {
+            return -1;
+        }
+        if (!btree_underfull(&child) || parent->hdr.nkeys == 0) {
+            return 0;
+        }
+        if (btree_cow(blk, &child) < 0) {
+            return -1;
+        }
+        uint16_t before = parent->hdr.nkeys;
+        if (btree_fix_child(parent, *i, &child) < 0) {
+            return -1;
+        }
+        if (parent->hdr.nkeys < before && *i > 0) {
+            (*i)--;
+        }
+    }
+}
+
+// Depth below node of the deepest fixable underfull node on the path to
+// key, or 0 if the path is balanced.
+static int btree_range_short(const struct btree_node *node, uint64_t key) {
+    struct btree_node cur = *node;
+    int deepest = 0;
+    for (int d = 1; cur.hdr.level != 0 && d < BTREE_MAX_DEPTH; d++) {
+        uint16_t n = cur.hdr.nkeys;
+        uint16_t i = 0;
+        while (i < n && key >= cur.keys[i].key) {
+            i++;
+        }
+        if (btree_read_node((uint32_t)cur.children[i], &cur) < 0) {
+            return 0;
+        }
+        if (n > 0 && btree_underfull(&cur)) {
+            deepest = d;
+        }
+    }
+    return deepest;
+}
+
+// Rewrite the path to key down to depth levels below node, rebalancing
+// each underfull child before descending into it.
+static int btree_range_repair(struct btree_node *node, uint64_t key, int depth) {
+    uint16_t n = node->hdr.nkeys;
+    uint16_t i = 0;
+    while (i < n && key >= node->keys[i].key) {
+        i++;
+    }
+    if (btree_range_fix(node, &i) < 0) {
+        return -1;
+    }
+    if (depth <= 1) {
+        return 0;
+    }
+
+    uint32_t blk = (uint32_t)node->children[i];
+    struct btree_node child;
+    if (btree_read_node(blk, &child) < 0) {
+        return -1;
+    }
+    if (btree_cow(blk, &child) < 0) {
+        return -1;
+    }
+    if (btree_range_repair(&child, key, depth - 1) < 0) {
+        return -1;
+    }
+    if (btree_write_new(&child, &blk) < 0) {
+        return -1;
+    }
+    node->children[i] = blk;
+    return 0;
+}
+
+// Remove [r->lo, r->hi] from node, which covers keys [nlo, nhi]. Children
+// that lie entirely inside the range are unlinked without being copied;
+// only the two boundary children are rewritten. Underfull nodes are left
+// for btree_range_repair.
+static int btree_range_rec(struct btree_node *node, uint64_t nlo, uint64_t nhi,
+                           struct btree_range *r) {
+    uint16_t n = node->hdr.nkeys;
+
+    if (node->hdr.level == 0) {
+        uint16_t i = 0;
+        while (i < node->hdr.nkeys) {
+            struct btree_key k = node->keys[i];
+            if (k.key < r->lo || k.key > r->hi) {
+                i++;
+                continue;
+            }
+            if (k.value != 0 && r->fn && r->fn(k.key, k.value, r->arg) < 0) {
+                return -1;
+            }
+            btree_leaf_remove_at(node, i);
+        }
+        return 0;
+    }
+
+    uint16_t a = 0;
+    while (a < n && r->lo >= node->keys[a].key) {
+        a++;
+    }
+    uint16_t b = a;
+    while (b < n && r->hi >= node->keys[b].key) {
+        b++;
+    }
+
+    // Child i holds keys [clo, chi]; a separator of 0 cannot bound a
+    // live child, so the wrapped chi is never treated as covered.
+    uint64_t clo_a = (a == 0) ? nlo : node->keys[a - 1].key;
+    uint64_t chi_a = (a == n) ? nhi : node->keys[a].key - 1;
+    uint64_t clo_b = (b == 0) ? nlo : node->keys[b - 1].key;
+    uint64_t chi_b = (b == n) ? nhi : node->keys[b].key - 1;
+    int part_a = !(r->lo <= clo_a && chi_a <= r->hi);
+    int part_b = (b != a) && !(r->lo <= clo_b && chi_b <= r->hi);
+
+    uint16_t edges[2];
+    uint16_t nedges = 0;
+    if (part_a) edges[nedges++] = a;
+    if (part_b) edges[nedges++] = b;
+    for (uint16_t e = 0; e < nedges; e++) {
+        uint16_t i = edges[e];
+        uint32_t blk = (uint32_t)node->children[i];
+        struct btree_node child;
+        if (btree_read_node(blk, &child) < 0) {
+            return -1;
+        }
+        if (btree_cow(blk, &child) < 0) {
+            return -1;
+        }
+        uint64_t clo = (i == 0) ? nlo : node->keys[i - 1].key;
+        uint64_t chi = (i == n) ? nhi : node->keys[i].key - 1;
+        if (btree_range_rec(&child, clo, chi, r) < 0) {
+            return -1;
+        }
+        if (btree_write_new(&child, &blk) < 0) {
+            return -1;
+        }
+        node->children[i] = blk;
+    }
+
+    // Drop the fully covered run of children [c0, c1].
+    uint16_t c0 = part_a ? a + 1 : a;
+    uint16_t c1 = part_b ? b - 1 : b;
+    if (a == b && part_a) {
+        c1 = a;
+        c0 = a + 1;
+    }
+    if (c0 <= c1) {
+        for (uint16_t i = c0; i <= c1; i++) {
+            if (btree_range_drop((uint32_t)node->children[i], r, 1) < 0) {
+                return -1;
+            }
+        }
+        uint16_t m = c1 - c0 + 1;
+        if (m > n) {
+            // Only the root can be covered whole.
+            btree_node_init(node, 0);
+            return 0;
+        }
+        uint16_t s0 = (c0 > 0) ? c0 - 1 : 0;
+        for (uint16_t j = s0; j + m < n; j++) {
+            node->keys[j] = node->keys[j + m];
+        }
+        for (uint16_t j = c0; j + m <= n; j++) {
+            node->children[j] = node->children[j + m];
+        }
+        for (uint16_t j = n - m + 1; j <= n; j++) {
+            node->children[j] = 0;
+        }
+        node->hdr.nkeys = n - m;
+    }
+
+    return 0;
+}
+
+static int btree_range_root(uint32_t root_block, uint64_t lo, uint64_t hi,
+                            btree_range_fn fn, void *arg,
+                            uint32_t *new_root_block) {
+    if (new_root_block == 0) return -1;
+    *new_root_block = root_block;
+    if (root_block == 0 || lo > hi) {
+        return 0;
+    }
+
+    // Boundary paths are rewritten unconditionally, so make sure the
+    // range holds something first.
+    struct btree_cursor cur;
+    uint64_t first = 0;
+    if (btree_cursor_seek(&cur, root_block, lo) < 0 ||
+        btree_cursor_get(&cur, &first, 0) < 0 || first > hi) {
+        return 0;
+    }
+
+    struct btree_node root;
+    if (btree_read_node(root_block, &root) < 0) {
+        return -1;
+    }
+    if (btree_cow(root_block, &root) < 0) {
+        return -1;
+    }
+
+    struct btree_range r = { lo, hi, fn, arg };
+    if (btree_range_rec(&root, 0, ~0ULL, &r) < 0) {
+        return -1;
+    }
+
+    // A merge low on a path can leave an already-visited parent short,
+    // so keep repairing until both boundary paths are balanced.
+    for (;;) {
+        int d = btree_range_short(&root, lo);
+        uint64_t key = lo;
+        if (d == 0) {
+            d = btree_range_short(&root, hi);
+            key = hi;
+        }
+        if (d == 0) {
+            break;
+        }
+        if (btree_range_repair(&root, key, d) < 0) {
+            return -1;
+        }
+    }
+
+    uint32_t blk = 0;
+    while (root.hdr.level != 0 && root.hdr.nkeys == 0) {
+        blk = (uint32_t)root.children[0];
+        if (btree_read_node(blk, &root) < 0) {
+            return -1;
+        }
+    }
+    if (blk != 0) {
+        *new_root_block = blk;
+        return 0;
+    }
+    return btree_write_new(&root, new_root_block);
+}
+
+int btree_delete_range(uint32_t root_block, uint64_t lo, uint64_t hi,
+                       btree_range_fn fn, void *arg,
+                       uint32_t *new_root_block) {
+    btree_update_begin();
+    int rc = btree_range_root(root_block, lo, hi, fn, arg, new_root_block);
+    btree_update_end(rc);
+    return rc;
+}
+
+// Smallest zero-valued leaf key >= from, left behind by the old
+// insert-zero delete convention.
+static int btree_find_tombstone(uint32_t block, uint64_t from, uint64_t *key_out) {
+    struct btree_node node;
+    if (btree_read_node(block, &node) < 0) return -1;
+
+    if (node.hdr.level == 0) {
+        for (uint16_t i = 0; i < node.hdr.nkeys; i++) {
+            if (node.keys[i].key >= from && node.keys[i].value == 0) {
+                *key_out = node.keys[i].key;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < node.hdr.nkeys + 1; i++) {
+        if (i < node.hdr.nkeys && node.keys[i].key <= from) {
+            continue;
+        }
+        if (btree_find_tombstone((uint32_t)node.children[i], from, key_out) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int btree_compact(uint32_t root_block, uint32_t *new_root_block) {
+    if (new_root_block == 0) return -1;
+
+    uint32_t root = root_block;
+    uint64_t cursor = 0;
+    while (root != 0) {
+        uint64_t key = 0;
+        if (btree_find_tombstone(root, cursor, &key) < 0) {
+            break;
+        }
+        if (btree_delete(root, key, &root) < 0) {
+            return -1;
+        }
+        if (key == ~0ULL) {
+            break;
+        }
+        cursor = key + 1;
+    }
+    *new_root_block = root;
+    return 0;
+}
+
+// Whether blk is a node of the tree rooted at root. The node's first key
+// routes to it from the root, so only one path has to be checked.
+static int btree_reachable(uint32_t root, uint32_t blk,
+                           const struct btree_node *node) {
+    if (root == blk) {
+        return 1;
+    }
+    if (node->hdr.nkeys == 0) {
+        return 0; // Only a root can be empty
+    }
+    uint64_t key = node->keys[0].key;
+    struct btree_node cur;
+    uint32_t cur_blk = root;
+    for (int d = 0; d < BTREE_MAX_DEPTH; d++) {
+        if (btree_read_node(cur_blk, &cur) < 0) {
+            return 1; // Be conservative about unreadable trees
+        }
+        if (cur.hdr.level <= node->hdr.level) {
+            return 0;
+        }
+        uint16_t i = 0;
+        while (i < cur.hdr.nkeys && key >= cur.keys[i].key) {
+            i++;
+        }
+        cur_blk = (uint32_t)cur.children[i];
+        if (cur_blk == blk) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// Mark the nodes retired so far as the closing transaction's, for the
+// btree_reclaim that follows its commit.
+void btree_stale_close(void) {
+    stale_closed = stale_n;
+}
+
+int btree_reclaim(const uint32_t *roots, int nroots, uint64_t oldest_reader) {
+    // Everything up to the close became garbage at this generation; a
+    // reader pinned to an older one may still be walking it.
+    uint64_t gen = sb.generation;
+    uint32_t closed = stale_closed < stale_n ? stale_closed : stale_n;
+    uint32_t n = closed;
+    stale_closed = ~0u;
+    if (nroots <= 0) {
+        return 0;
+    }
+    if (oldest_reader < gen) {
+        if (stale_held == 0 || oldest_reader < stale_held_gen) {
+            stale_held = closed;
+            stale_held_gen = gen;
+            return 0;
+        }
+        n = stale_held;
+    }
+
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            uint32_t v = *btree_stale_at(i);
+            uint32_t j = i;
+            while (j >= gap && *btree_stale_at(j - gap) > v) {
+                *btree_stale_at(j) = *btree_stale_at(j - gap);
+                j -= gap;
+            }
+            *btree_stale_at(j) = v;
+        }
+    }
+
+    int freed = 0;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t blk = *btree_stale_at(i);
+        if (blk == prev || blk < sb.data_start || blk >= sb.nblocks ||
+            brefcnt_get(blk) != 1) {
+            continue;
+        }
+        prev = blk;
+
+        // A node still reachable from a committed root was replaced by
+        // an update that never reached disk; keep it.
+        struct btree_node node;
+        if (btree_read_node(blk, &node) < 0) {
+            continue;
+        }
+        int live = 0;
+        for (int r = 0; r < nroots && !live; r++) {
+            live = roots[r] != 0 && btree_reachable(roots[r], blk, &node);
+        }
+        if (!live) {
+            bfree(blk);
+            freed++;
+        }
+    }
+
+    // Entries retired since the freed batch wait for the next commit;
+    // those from after the close are not garbage until the one after.
+    for (uint32_t i = n; i < stale_n; i++) {
+        *btree_stale_at(i - n) = *btree_stale_at(i);
+    }
+    stale_n -= n;
+    stale_held = closed - n;
+    stale_held_gen = gen;
+    return freed;
+}
+
+uint32_t btree_stale_count(void) {
+    return stale_n;
+}
+
+// Take one reference on blk for each extra path that reaches it. seen
+// marks nodes already counted; a node reached again is shared, so its
+// subtree is not walked twice.
+int btree_share_refs(uint32_t root_block, uint8_t *seen) {
+    if (root_block == 0 || root_block >= sb.nblocks) {
+        return -1;
+    }
+    uint8_t bit = 1u << (root_block % 8);
+    if (seen[root_block / 8] & bit) {
+        brefcnt_inc(root_block);
+        return 0;
+    }
+    seen[root_block / 8] |= bit;
+
+    struct btree_node node;
+    if (btree_read_node(root_block, &node) < 0) {
+        return -1;
+    }
+    if (node.hdr.level == 0) {
+        return 0;
+    }
+    for (uint16_t i = 0; i <= node.hdr.nkeys; i++) {
+        if (btree_share_refs((uint32_t)node.children[i], seen) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int btree_visit(uint32_t root_block, btree_visit_fn fn, void *arg) {
+    struct btree_node node;
+    if (btree_read_node(root_block, &node) < 0) {
+        return -1;
+    }
+    fn(root_block, arg);
+    if (node.hdr.level == 0) {
+        return 0;
+    }
+    for (uint16_t i = 0; i <= node.hdr.nkeys; i++) {
+        if (btree_visit((uint32_t)node.children[i], fn, arg) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int btree_commit_root(uint32_t new_root_block) {
+    if (new_root_block == 0 || new_root_block >= sb.nblocks) {
+        return -1;
+    }
+    sb.btree_root = new_root_block;
+    txn_dirty();
+    return txn_commit();
+}
+
 void btree_txn_begin(struct btree_txn *txn) {
     if (!txn) return;
     txn->root = sb.btree_root;
@@ -3,6 +3,7 @@
 #include <kernel/printf.h>
 #include <kernel/panic.h>
 #include <kernel/string.h>
+#include <kernel/txn.h>
 #include <drivers/virtio.h>
 
 static struct {
@@ -31,6 +32,14 @@ void binit(void) {
     kprintf("buf: cache initialized with %d buffers\n", NBUF);
 }
 
+static void bflush_one(struct buf *b) {
+    uint32_t sector = b->blockno * (BSIZE / SECTOR_SIZE);
+    for (int i = 0; i < BSIZE / SECTOR_SIZE; i++) {
+        disk_write(sector + i, b->data + i * SECTOR_SIZE);
+    }
+    b->flags &= ~(B_DIRTY | B_CLOSED);
+}
+
 static struct buf* bget(uint32_t blockno) {
     struct buf *b;
 
@@ -41,20 +50,30 @@ static struct buf* bget(uint32_t blockno) {
         }
     }
 
+    // Recycle the least recently used clean buffer; a dirty one is only
+    // written back when nothing else is free.
+    struct buf *victim = 0;
     for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-        if (b->refcnt == 0) {
-            if (b->flags & B_DIRTY) {
-                uint32_t sector = blockno * (BSIZE / SECTOR_SIZE);
-                for (int i = 0; i < BSIZE / SECTOR_SIZE; i++) {
-                    disk_write(sector + i, b->data + i * SECTOR_SIZE);
-                }
-            }
+        if (b->refcnt != 0) {
+            continue;
+        }
+        if (!(b->flags & B_DIRTY)) {
+            victim = b;
+            break;
+        }
+        if (victim == 0) {
+            victim = b;
+        }
+    }
 
-            b->blockno = blockno;
-            b->flags = 0; // Not valid yet, will be read
-            b->refcnt = 1;
-            return b;
+    if (victim) {
+        if (victim->flags & B_DIRTY) {
+            bflush_one(victim);
         }
+        victim->blockno = blockno;
+        victim->flags = 0; // Not valid yet, will be read
+        victim->refcnt = 1;
+        return victim;
     }
 
     panic("bget: no buffers available");
@@ -89,12 +108,7 @@ void bwrite(struct buf *b) {
         panic("bwrite: buffer not held");
     }
 
-    uint32_t sector = b->blockno * (BSIZE / SECTOR_SIZE);
-    for (int i = 0; i < BSIZE / SECTOR_SIZE; i++) {
-        disk_write(sector + i, b->data + i * SECTOR_SIZE);
-    }
-
-    b->flags &= ~B_DIRTY; // No longer dirty
+    bflush_one(b);
 }
 
 void brelse(struct buf *b) {
@@ -105,7 +119,75 @@ void brelse(struct buf *b) {
     b->refcnt--;
 }
 
+// The change joins the open transaction and reaches disk with its commit,
+// or earlier if the buffer is evicted.
 void bmark_dirty(struct buf *b) {
     b->flags |= B_DIRTY;
+    txn_dirty();
 }
 
+// Write back every dirty buffer, in block order.
+void bflush(void) {
+    for (;;) {
+        struct buf *next = 0;
+        for (struct buf *b = bcache.buf; b < bcache.buf + NBUF; b++) {
+            if ((b->flags & B_DIRTY) &&
+                (next == 0 || b->blockno < next->blockno)) {
+                next = b;
+            }
+        }
+        if (next == 0) {
+            return;
+        }
+        bflush_one(next);
+    }
+}
+
+// Write blockno back now if it is cached dirty; the rest of the open
+// transaction stays in memory.
+void bsync(uint32_t blockno) {
+    for (struct buf *b = bcache.buf; b < bcache.buf + NBUF; b++) {
+        if (b->blockno == blockno && (b->flags & B_VALID) &&
+            (b->flags & B_DIRTY)) {
+            bflush_one(b);
+            return;
+        }
+    }
+}
+
+// Tag the buffers dirty as the open transaction closes. They have to
+// reach disk before its superblocks; later changes to them may go along.
+void bclose(void) {
+    for (struct buf *b = bcache.buf; b < bcache.buf + NBUF; b++) {
+        if (b->flags & B_DIRTY) {
+            b->flags |= B_CLOSED;
+        }
+    }
+}
+
+// Write back the lowest-numbered buffer still tagged by bclose. Returns 0
+// once none is left.
+int bflush_closed(void) {
+    struct buf *next = 0;
+    for (struct buf *b = bcache.buf; b < bcache.buf + NBUF; b++) {
+        if ((b->flags & B_CLOSED) &&
+            (next == 0 || b->blockno < next->blockno)) {
+            next = b;
+        }
+    }
+    if (next == 0) {
+        return 0;
+    }
+    bflush_one(next);
+    return 1;
+}
+
+uint32_t bdirty_count(void) {
+    uint32_t n = 0;
+    for (struct buf *b = bcache.buf; b < bcache.buf + NBUF; b++) {
+        if (b->flags & B_DIRTY) {
+            n++;
+        }
+    }
+    return n;
+}
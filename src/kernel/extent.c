@@ -6,14 +6,66 @@
 #include <kernel/buf.h>
 #include <kernel/string.h>
 #include <kernel/tree.h>
+#include <kernel/kalloc.h>
+#include <kernel/txn.h>
+#include <mmu.h>
 
-#define MAX_DEFERRED 64
+#define MAX_PENDING 256
 
-static struct extent deferred[MAX_DEFERRED];
-static int deferred_n = 0;
+// Frees held back until the commit that drops the last reference to the
+// blocks is on disk. Pages are chained on as the list grows; the commit
+// sorts each page and merges them to free coalesced ranges.
+#define DEFERRED_PER_PAGE \
+    ((PGSIZE - sizeof(void *) - 2 * sizeof(uint32_t)) / sizeof(struct extent))
+
+struct deferred_page {
+    struct deferred_page *next;
+    uint32_t n;
+    uint32_t pos; // Merge cursor
+    struct extent runs[DEFERRED_PER_PAGE];
+};
+
+static struct deferred_page *deferred_head = 0;
+static struct deferred_page *deferred_tail = 0;
+static uint32_t deferred_blocks = 0;
+static struct deferred_page *deferred_closed = 0; // The closed transaction's
+
+// Pages to fall back on when kalloc fails, one for each of the open and
+// the closed transaction. The open one is committed at the next chance
+// once it is down to its spare.
+static struct deferred_page deferred_spare[2];
+static int deferred_spare_used[2];
+static int deferred_on_spare = 0;
 static int extent_meta = 0;
 
-static uint32_t extent_btree_checksum(const struct btree_node *node);
+// Bitmap changes the free-space tree has not seen yet: blocks whose last
+// reference went away, and blocks balloc took straight from the bitmap
+// while the tree was being updated. extent_sync folds them in; entries
+// [0, frozen) are the ones it is working through.
+struct extent_pending {
+    struct extent runs[MAX_PENDING];
+    int n;
+    int frozen;
+};
+
+static struct extent_pending pending_free;
+static struct extent_pending pending_alloc;
+// Set when a pending list overflowed, and at mount since frees from
+// before an unclean shutdown were never recorded: rebuild from the bitmap.
+static int pending_lost = 1;
+
+// Metadata chunks: runs of blocks taken out of the free-space tree in one
+// go and handed to tree nodes a block at a time, so nodes cluster and each
+// allocation is a bitmap update. Nodes freed inside a chunk go back to the
+// chunk rather than the tree, keeping data out of the metadata area; a
+// chunk that empties out returns to the tree at commit. Chunks are only
+// held in memory since the tree is rebuilt from the bitmap at mount.
+#define META_CHUNKS 32
+
+static struct extent meta_chunks[META_CHUNKS]; // Sorted by start
+static int meta_n = 0;
+static int meta_cur = 0; // Chunk the last node came from
+static uint32_t meta_next = 0;
 
 static void extent_meta_enter(void) {
     extent_meta++;
@@ -29,11 +81,11 @@ int extent_meta_active(void) {
     return extent_meta != 0;
 }
 
-static int extent_leaf_read(uint32_t root, struct btree_node *out) {
-    if (root == 0 || root >= sb.nblocks) {
+static int extent_node_read(uint32_t blk, struct btree_node *out) {
+    if (blk == 0 || blk >= sb.nblocks) {
         return -1;
     }
-    struct buf *bp = bread(root);
+    struct buf *bp = bread(blk);
     memmove(out, bp->data, sizeof(*out));
     brelse(bp);
 
@@ -43,39 +95,70 @@ static int extent_leaf_read(uint32_t root, struct btree_node *out) {
     if (out->hdr.type != BTREE_TYPE_NODE) {
         return -1;
     }
-    if (out->hdr.level != 0 || out->hdr.nkeys > BTREE_ORDER) {
-        return -1;
+    if (out->hdr.nkeys > BTREE_ORDER || out->hdr.dlen != 0) {
+        return -1; // Free-space nodes hold no payloads
     }
-    if (out->hdr.logical != 0 && out->hdr.logical != root) {
+    if (out->hdr.logical != 0 && out->hdr.logical != blk) {
         return -1;
     }
-    if (extent_btree_checksum(out) != out->hdr.checksum) {
+    if (btree_node_checksum(out) != out->hdr.checksum) {
         return -1;
     }
     return 0;
 }
 
-static int extent_leaf_write(uint32_t root, struct btree_node *node) {
-    if (root == 0 || root >= sb.nblocks) {
+// Read the leaf that holds, or would hold, key. *limit is the separator
+// above it: keys at or past it route to the next leaf.
+static int extent_leaf_read(uint32_t root, uint64_t key, uint32_t *blk_out,
+                            uint64_t *limit, struct btree_node *out) {
+    uint32_t blk = root;
+    *limit = ~0ULL;
+    for (int depth = 0; depth < BTREE_MAX_DEPTH; depth++) {
+        if (extent_node_read(blk, out) < 0) {
+            return -1;
+        }
+        if (out->hdr.level == 0) {
+            *blk_out = blk;
+            return 0;
+        }
+        uint16_t i = 0;
+        while (i < out->hdr.nkeys && key >= out->keys[i].key) {
+            i++;
+        }
+        if (i < out->hdr.nkeys) {
+            *limit = out->keys[i].key;
+        }
+        blk = (uint32_t)out->children[i];
+    }
+    return -1;
+}
+
+static int extent_leaf_write(uint32_t blk, struct btree_node *node) {
+    if (blk == 0 || blk >= sb.nblocks) {
         return -1;
     }
     node->hdr.magic = BTREE_MAGIC;
     node->hdr.type = BTREE_TYPE_NODE;
-    node->hdr.logical = root;
+    node->hdr.logical = blk;
     node->hdr.level = 0;
-    node->hdr.generation = sb.generation + 1;
-    node->hdr.checksum = extent_btree_checksum(node);
+    // Keep the generation: a committed leaf edited here is still under
+    // the committed root and must not look like the open transaction's.
+    node->hdr.checksum = btree_node_checksum(node);
 
-    struct buf *bp = bread(root);
+    struct buf *bp = bread(blk);
     memmove(bp->data, node, sizeof(*node));
-    bwrite(bp);
+    bmark_dirty(bp);
     brelse(bp);
     return 0;
 }
 
+// Remove key from its leaf in place; fails when the leaf would need
+// rebalancing.
 static int extent_leaf_remove(uint32_t root, uint64_t key) {
     struct btree_node node;
-    if (extent_leaf_read(root, &node) < 0) {
+    uint32_t blk = 0;
+    uint64_t limit = 0;
+    if (extent_leaf_read(root, key, &blk, &limit, &node) < 0) {
         return -1;
     }
 
@@ -87,16 +170,22 @@ static int extent_leaf_remove(uint32_t root, uint64_t key) {
     if (i == n || node.keys[i].key != key) {
         return 0;
     }
+    if (blk != root && n <= BTREE_MIN_KEYS) {
+        return -1;
+    }
     for (uint16_t j = i + 1; j < n; j++) {
         node.keys[j - 1] = node.keys[j];
     }
     node.hdr.nkeys = n - 1;
-    return extent_leaf_write(root, &node);
+    return extent_leaf_write(blk, &node);
 }
 
+// Insert or update key in its leaf in place; fails when the leaf is full.
 static int extent_leaf_insert(uint32_t root, uint64_t key, uint64_t value) {
     struct btree_node node;
-    if (extent_leaf_read(root, &node) < 0) {
+    uint32_t blk = 0;
+    uint64_t limit = 0;
+    if (extent_leaf_read(root, key, &blk, &limit, &node) < 0) {
         return -1;
     }
 
@@ -107,7 +196,7 @@ static int extent_leaf_insert(uint32_t root, uint64_t key, uint64_t value) {
     }
     if (i < n && node.keys[i].key == key) {
         node.keys[i].value = value;
-        return extent_leaf_write(root, &node);
+        return extent_leaf_write(blk, &node);
     }
     if (n >= BTREE_ORDER) {
         return -1;
@@ -118,7 +207,7 @@ static int extent_leaf_insert(uint32_t root, uint64_t key, uint64_t value) {
     node.keys[i].key = key;
     node.keys[i].value = value;
     node.hdr.nkeys = n + 1;
-    return extent_leaf_write(root, &node);
+    return extent_leaf_write(blk, &node);
 }
 
 static uint64_t extent_pack(uint32_t len) {
@@ -129,327 +218,516 @@ static uint32_t extent_unpack(uint64_t v) {
     return (uint32_t)v;
 }
 
-static uint32_t extent_btree_checksum(const struct btree_node *node) {
-    const uint8_t *p = (const uint8_t *)node;
-    uint32_t csum_off = (uint32_t)((const uint8_t *)&node->hdr.checksum - p);
-    uint32_t rsv_off = (uint32_t)((const uint8_t *)&node->hdr.reserved - p);
-    uint32_t hash = 2166136261u;
-    for (uint32_t i = 0; i < sizeof(*node); i++) {
-        uint8_t v = p[i];
-        if (i >= csum_off && i < csum_off + sizeof(node->hdr.checksum)) {
-            v = 0;
-        }
-        if (i >= rsv_off && i < rsv_off + sizeof(node->hdr.reserved)) {
-            v = 0;
-        }
-        hash ^= v;
-        hash *= 16777619u;
+static int extent_tree_prev(uint32_t root, uint64_t start,
+                            uint64_t *key_out, uint64_t *val_out) {
+    struct btree_cursor cur;
+    if (btree_cursor_seek_le(&cur, root, start) < 0) {
+        return -1;
     }
-    return hash;
+    return btree_cursor_get(&cur, key_out, val_out);
 }
 
-static int extent_btree_write_root(uint32_t root,
-                                   const struct btree_key *keys,
-                                   uint16_t nkeys) {
-    if (root == 0 || root >= sb.nblocks || nkeys > BTREE_ORDER) {
+static int extent_tree_next(uint32_t root, uint64_t start,
+                            uint64_t *key_out, uint64_t *val_out) {
+    struct btree_cursor cur;
+    if (btree_cursor_seek(&cur, root, start) < 0) {
         return -1;
     }
+    return btree_cursor_get(&cur, key_out, val_out);
+}
 
+// Move the extent at key to new_key in place. The caller guarantees no
+// other extent lies between them, so only the leaf's bound can get in
+// the way.
+static int extent_leaf_rekey(uint32_t root, uint64_t key, uint64_t new_key,
+                             uint64_t value) {
     struct btree_node node;
-    memzero(&node, sizeof(node));
-    node.hdr.magic = BTREE_MAGIC;
-    node.hdr.type = BTREE_TYPE_NODE;
-    node.hdr.logical = root;
-    node.hdr.generation = sb.generation + 1;
-    node.hdr.level = 0;
-    node.hdr.nkeys = nkeys;
-    for (uint16_t i = 0; i < nkeys; i++) {
-        node.keys[i] = keys[i];
-    }
-    node.hdr.checksum = extent_btree_checksum(&node);
-
-    struct buf *bp = bread(root);
-    memmove(bp->data, &node, sizeof(node));
-    bwrite(bp);
-    brelse(bp);
-    return 0;
+    uint32_t blk = 0;
+    uint64_t limit = 0;
+    if (extent_leaf_read(root, key, &blk, &limit, &node) < 0 ||
+        new_key >= limit) {
+        return -1;
+    }
+
+    uint16_t i = 0;
+    while (i < node.hdr.nkeys && node.keys[i].key < key) {
+        i++;
+    }
+    if (i == node.hdr.nkeys || node.keys[i].key != key) {
+        return -1;
+    }
+    node.keys[i].key = new_key;
+    node.keys[i].value = value;
+    return extent_leaf_write(blk, &node);
 }
 
-static int block_is_free(uint32_t blockno) {
-    uint32_t bmap_block = 1 + NSUPER + blockno / (BSIZE * 8);
-    struct buf *bp = bread(bmap_block);
-    uint32_t bi = blockno % (BSIZE * 8);
-    uint32_t m = 1u << (bi % 8);
-    int free = (bp->data[bi / 8] & m) == 0;
-    brelse(bp);
-    return free;
+#define EXTENT_HASH 256
+
+// In-memory mirror of the free-space tree, so data allocations can pick
+// an extent by size without walking the tree. Extents are hashed by start
+// and chained into size classes by floor(log2(len)).
+struct extent_node {
+    uint32_t start;
+    uint32_t len;
+    struct extent_node *hash_next;
+    struct extent_node *class_next;
+    struct extent_node *class_prev;
+};
+
+static struct extent_node *index_hash[EXTENT_HASH];
+static struct extent_node *index_class[EXTENT_CLASSES];
+static struct extent_node *index_spare;
+static int index_ready = 0;
+static int index_nomem = 0; // No reload until the next rebuild
+static uint32_t index_blocks = 0;
+static uint32_t index_extents = 0;
+
+static uint32_t extent_class(uint32_t len) {
+    uint32_t c = 0;
+    while (len > 1 && c < EXTENT_CLASSES - 1) {
+        len >>= 1;
+        c++;
+    }
+    return c;
 }
 
-static int extent_tree_prev(uint32_t root, uint64_t start,
-                            uint64_t *key_out, uint64_t *val_out) {
-    if (root == 0) return -1;
-    struct btree_node node;
-    if (extent_leaf_read(root, &node) == 0) {
-        uint64_t best_key = 0;
-        uint64_t best_val = 0;
-        int found = 0;
-        for (uint16_t i = 0; i < node.hdr.nkeys; i++) {
-            uint64_t k = node.keys[i].key;
-            uint64_t v = node.keys[i].value;
-            if (v == 0) continue;
-            if (k <= start) {
-                if (!found || k > best_key) {
-                    best_key = k;
-                    best_val = v;
-                    found = 1;
-                }
-            }
-        }
-        if (!found) return -1;
-        if (key_out) *key_out = best_key;
-        if (val_out) *val_out = best_val;
-        return 0;
+static struct extent_node **index_slot(uint32_t start) {
+    struct extent_node **pp = &index_hash[(start * 2654435761u) >> 24];
+    while (*pp != 0 && (*pp)->start != start) {
+        pp = &(*pp)->hash_next;
     }
+    return pp;
+}
 
-    uint64_t cursor = start;
-    for (;;) {
-        uint64_t key = 0;
-        uint64_t val = 0;
-        if (btree_lookup_le(root, cursor, &key, &val) < 0) {
-            return -1;
-        }
-        if (val != 0) {
-            if (key_out) *key_out = key;
-            if (val_out) *val_out = val;
-            return 0;
-        }
-        if (key == 0) {
-            return -1;
+static void index_link(struct extent_node *e) {
+    struct extent_node **head = &index_class[extent_class(e->len)];
+    e->class_prev = 0;
+    e->class_next = *head;
+    if (*head) {
+        (*head)->class_prev = e;
+    }
+    *head = e;
+    index_blocks += e->len;
+    index_extents++;
+}
+
+static void index_unlink(struct extent_node *e) {
+    if (e->class_prev) {
+        e->class_prev->class_next = e->class_next;
+    } else {
+        index_class[extent_class(e->len)] = e->class_next;
+    }
+    if (e->class_next) {
+        e->class_next->class_prev = e->class_prev;
+    }
+    index_blocks -= e->len;
+    index_extents--;
+}
+
+static void index_clear(void) {
+    for (int i = 0; i < EXTENT_HASH; i++) {
+        while (index_hash[i]) {
+            struct extent_node *e = index_hash[i];
+            index_hash[i] = e->hash_next;
+            e->hash_next = index_spare;
+            index_spare = e;
         }
-        cursor = key - 1;
     }
+    for (int c = 0; c < EXTENT_CLASSES; c++) {
+        index_class[c] = 0;
+    }
+    index_blocks = 0;
+    index_extents = 0;
+    index_ready = 0;
 }
 
-static int extent_tree_next(uint32_t root, uint64_t start,
-                            uint64_t *key_out, uint64_t *val_out) {
-    if (root == 0) return -1;
-    struct btree_node node;
-    if (extent_leaf_read(root, &node) == 0) {
-        uint64_t best_key = 0;
-        uint64_t best_val = 0;
-        int found = 0;
-        for (uint16_t i = 0; i < node.hdr.nkeys; i++) {
-            uint64_t k = node.keys[i].key;
-            uint64_t v = node.keys[i].value;
-            if (v == 0) continue;
-            if (k >= start) {
-                if (!found || k < best_key) {
-                    best_key = k;
-                    best_val = v;
-                    found = 1;
-                }
+static void index_set(uint32_t start, uint32_t len) {
+    if (!index_ready) {
+        return;
+    }
+    struct extent_node **pp = index_slot(start);
+    struct extent_node *e = *pp;
+    if (e) {
+        index_unlink(e);
+    } else {
+        if (index_spare == 0) {
+            struct extent_node *page = kalloc();
+            if (page == 0) {
+                // Out of memory: drop the index and walk the tree.
+                index_clear();
+                index_nomem = 1;
+                return;
+            }
+            for (uint32_t i = 0; i < PGSIZE / sizeof(*page); i++) {
+                page[i].hash_next = index_spare;
+                index_spare = &page[i];
             }
         }
-        if (!found) return -1;
-        if (key_out) *key_out = best_key;
-        if (val_out) *val_out = best_val;
-        return 0;
+        e = index_spare;
+        index_spare = e->hash_next;
+        e->start = start;
+        e->hash_next = 0;
+        *pp = e;
     }
+    e->len = len;
+    index_link(e);
+}
 
-    uint64_t cursor = start;
-    for (;;) {
-        uint64_t key = 0;
-        uint64_t val = 0;
-        if (btree_lookup_ge(root, cursor, &key, &val) < 0) {
-            return -1;
+static void index_del(uint32_t start) {
+    if (!index_ready) {
+        return;
+    }
+    struct extent_node **pp = index_slot(start);
+    struct extent_node *e = *pp;
+    if (e == 0) {
+        return;
+    }
+    *pp = e->hash_next;
+    index_unlink(e);
+    e->hash_next = index_spare;
+    index_spare = e;
+}
+
+// Fill the index from the tree; until this succeeds allocation walks
+// the tree instead.
+static void index_load(void) {
+    if (index_nomem) {
+        return;
+    }
+    index_clear();
+    index_ready = 1;
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, sb.extent_root, 0);
+         rc == 0 && index_ready; rc = btree_cursor_next(&cur)) {
+        uint64_t k = 0;
+        uint64_t v = 0;
+        btree_cursor_get(&cur, &k, &v);
+        index_set((uint32_t)k, extent_unpack(v));
+    }
+}
+
+// Best fit: the smallest extent of at least len blocks, lowest start on
+// a tie. Only the first size class that can hold len is searched past.
+static struct extent_node *index_best_fit(uint32_t len) {
+    struct extent_node *best = 0;
+    for (uint32_t c = extent_class(len); c < EXTENT_CLASSES && best == 0;
+         c++) {
+        for (struct extent_node *e = index_class[c]; e; e = e->class_next) {
+            if (e->len >= len &&
+                (best == 0 || e->len < best->len ||
+                 (e->len == best->len && e->start < best->start))) {
+                best = e;
+            }
         }
-        if (val != 0) {
-            if (key_out) *key_out = key;
-            if (val_out) *val_out = val;
-            return 0;
+    }
+    return best;
+}
+
+void extent_stats(struct extent_stats *out) {
+    if (out == 0) {
+        return;
+    }
+    memzero(out, sizeof(*out));
+    if (!index_ready && sb.extent_root != 0) {
+        index_load();
+    }
+    out->free_blocks = index_blocks;
+    out->free_extents = index_extents;
+    for (uint32_t c = 0; c < EXTENT_CLASSES; c++) {
+        for (struct extent_node *e = index_class[c]; e; e = e->class_next) {
+            out->classes[c]++;
+            if (e->len > out->largest) {
+                out->largest = e->len;
+            }
         }
-        cursor = key + 1;
     }
 }
 
+// Leaves are edited in place when that keeps the tree balanced. The
+// bitmap is the authority and the tree is rebuilt from it after mount,
+// so it needs no copy-on-write of its own; splits and merges still go
+// through the B-tree.
+static int extent_tree_put(uint32_t *root, uint64_t key, uint64_t value) {
+    if (extent_leaf_insert(*root, key, value) < 0 &&
+        btree_insert(*root, key, value, root) < 0) {
+        return -1;
+    }
+    index_set((uint32_t)key, extent_unpack(value));
+    return 0;
+}
+
+static int extent_tree_del(uint32_t *root, uint64_t key) {
+    if (extent_leaf_remove(*root, key) < 0 &&
+        btree_delete(*root, key, root) < 0) {
+        return -1;
+    }
+    index_del((uint32_t)key);
+    return 0;
+}
+
+// Add [start, start + len) to the free-space tree, merging it with any
+// extent it touches or overlaps.
 static int extent_tree_add(uint32_t root, uint32_t start, uint32_t len,
                            uint32_t *out_root) {
-    if (len == 0 || root == 0) return -1;
-    if (start < sb.data_start) return -1;
-
-    uint64_t new_start = start;
-    uint64_t new_len = len;
+    uint64_t lo = start;
+    uint64_t hi = (uint64_t)start + len;
     uint32_t new_root = root;
-    int leaf_ok = 1;
-
-    extent_meta_enter();
+    uint64_t k = 0;
+    uint64_t v = 0;
 
-    uint64_t pk = 0;
-    uint64_t pv = 0;
-    if (extent_tree_prev(new_root, start, &pk, &pv) == 0) {
-        uint32_t plen = extent_unpack(pv);
-        if (pk + plen == start) {
-            new_start = pk;
-            new_len += plen;
-            if (extent_leaf_remove(new_root, pk) < 0) {
-                leaf_ok = 0;
-            }
+    if (extent_tree_prev(new_root, start, &k, &v) == 0 &&
+        k + extent_unpack(v) >= start) {
+        lo = k;
+        if (k + extent_unpack(v) > hi) {
+            hi = k + extent_unpack(v);
         }
     }
-
-    for (;;) {
-        uint64_t nk = 0;
-        uint64_t nv = 0;
-        uint64_t cursor = new_start + new_len;
-        if (extent_tree_next(new_root, cursor, &nk, &nv) < 0) {
-            break;
-        }
-        uint32_t nlen = extent_unpack(nv);
-        if (nk != cursor) {
-            break;
+    while (extent_tree_next(new_root, lo + 1, &k, &v) == 0 && k <= hi) {
+        if (k + extent_unpack(v) > hi) {
+            hi = k + extent_unpack(v);
         }
-        new_len += nlen;
-        if (extent_leaf_remove(new_root, nk) < 0) {
-            leaf_ok = 0;
-            break;
+        if (extent_tree_del(&new_root, k) < 0) {
+            return -1;
         }
     }
+    if (extent_tree_put(&new_root, lo, extent_pack((uint32_t)(hi - lo))) < 0) {
+        return -1;
+    }
+    *out_root = new_root;
+    return 0;
+}
+
+// Drop [start, start + len) from the free-space tree, trimming or
+// splitting the extents it overlaps.
+static int extent_tree_remove(uint32_t root, uint32_t start, uint32_t len,
+                              uint32_t *out_root) {
+    uint64_t end = (uint64_t)start + len;
+    uint64_t from = start;
+    uint32_t new_root = root;
+    uint64_t k = 0;
+    uint64_t v = 0;
 
-    if (leaf_ok) {
-        if (extent_leaf_insert(new_root, new_start,
-                               extent_pack((uint32_t)new_len)) < 0) {
-            leaf_ok = 0;
+    if (extent_tree_prev(new_root, start, &k, &v) == 0 &&
+        k + extent_unpack(v) > start) {
+        from = k;
+    }
+    while (extent_tree_next(new_root, from, &k, &v) == 0 && k < end) {
+        uint64_t kend = k + extent_unpack(v);
+        if (k < start) {
+            if (extent_tree_put(&new_root, k,
+                                extent_pack((uint32_t)(start - k))) < 0) {
+                return -1;
+            }
+        } else if (kend > end &&
+                   extent_leaf_rekey(new_root, k, end,
+                                     extent_pack((uint32_t)(kend - end))) == 0) {
+            index_del((uint32_t)k);
+            index_set((uint32_t)end, (uint32_t)(kend - end));
+            break;
+        } else if (extent_tree_del(&new_root, k) < 0) {
+            return -1;
         }
+        if (kend > end &&
+            extent_tree_put(&new_root, end,
+                            extent_pack((uint32_t)(kend - end))) < 0) {
+            return -1;
+        }
+        from = kend;
     }
+    *out_root = new_root;
+    return 0;
+}
 
-    if (out_root) {
-        *out_root = new_root;
+static void pending_add(struct extent_pending *p, uint32_t start,
+                        uint32_t len) {
+    if (p->n > p->frozen) {
+        struct extent *last = &p->runs[p->n - 1];
+        if (last->start + last->len == start) {
+            last->len += len;
+            return;
+        }
+        if (start + len == last->start) {
+            last->start = start;
+            last->len += len;
+            return;
+        }
     }
-    extent_meta_exit();
-    if (leaf_ok) {
-        return 0;
+    if (p->n >= MAX_PENDING) {
+        pending_lost = 1;
+        return;
     }
-    return -1;
+    p->runs[p->n].start = start;
+    p->runs[p->n].len = len;
+    p->n++;
 }
 
-static int extent_rebuild(uint32_t root, uint32_t *out_root) {
-    struct btree_key keys[BTREE_ORDER];
-    uint16_t nkeys = 0;
-    uint32_t run_start = 0;
-    uint32_t run_len = 0;
+static void pending_done(struct extent_pending *p) {
+    for (int i = p->frozen; i < p->n; i++) {
+        p->runs[i - p->frozen] = p->runs[i];
+    }
+    p->n -= p->frozen;
+    p->frozen = 0;
+}
 
-    for (uint32_t b = sb.data_start; b < sb.nblocks; b++) {
-        if (block_is_free(b)) {
-            if (run_len == 0) {
-                run_start = b;
-            }
-            run_len++;
-            continue;
-        }
+// Called by brefcnt_dec when a block's last reference goes away.
+void extent_note_free(uint32_t blockno) {
+    extent_note_free_run(blockno, 1);
+}
 
-        if (run_len != 0) {
-            if (nkeys < BTREE_ORDER) {
-                keys[nkeys].key = run_start;
-                keys[nkeys].value = extent_pack(run_len);
-                nkeys++;
-            }
-            run_len = 0;
-        }
+// The same for a run of blocks, from bfree_range.
+void extent_note_free_run(uint32_t start, uint32_t len) {
+    if (sb.extent_root != 0) {
+        pending_add(&pending_free, start, len);
     }
+}
 
-    if (run_len != 0 && nkeys < BTREE_ORDER) {
-        keys[nkeys].key = run_start;
-        keys[nkeys].value = extent_pack(run_len);
-        nkeys++;
+// Called by balloc for blocks taken from the bitmap, bypassing the tree.
+void extent_note_alloc(uint32_t blockno) {
+    if (sb.extent_root != 0) {
+        pending_add(&pending_alloc, blockno, 1);
     }
+}
 
-    if (nkeys > 0 && nkeys <= BTREE_ORDER) {
-        if (extent_btree_write_root(root, keys, nkeys) < 0) {
-            return -1;
+// Like bmap_next_run, but steps over the metadata chunks.
+static int free_run_next(uint32_t from, uint32_t limit, uint32_t *start_out,
+                         uint32_t *len_out) {
+    for (int i = 0; i < meta_n && from < limit; i++) {
+        uint32_t lo = meta_chunks[i].start;
+        uint32_t hi = lo + meta_chunks[i].len;
+        if (hi <= from) {
+            continue;
         }
-        if (out_root) {
-            *out_root = root;
+        if (from < lo && bmap_next_run(from, lo < limit ? lo : limit,
+                                       start_out, len_out) == 0) {
+            return 0;
         }
-        return 0;
+        from = hi;
     }
+    return bmap_next_run(from, limit, start_out, len_out);
+}
+
+static void extent_free_node(uint32_t blk, void *arg) {
+    (void)arg;
+    bfree(blk);
+}
 
+// Rebuild the free-space tree from the bitmap, dropping whatever it held.
+// A tree left half built by a failure is released, and 0 is returned in
+// its place so the next allocation starts over through extent_init.
+static int extent_rebuild(uint32_t root, uint32_t *out_root) {
     uint32_t new_root = root;
-    run_len = 0;
-    for (uint32_t b = sb.data_start; b < sb.nblocks; b++) {
-        if (block_is_free(b)) {
-            if (run_len == 0) {
-                run_start = b;
-            }
-            run_len++;
-            continue;
-        }
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    int rc = 0;
 
-        if (run_len != 0) {
-            extent_meta_enter();
-            if (btree_insert(new_root, run_start, extent_pack(run_len),
-                             &new_root) < 0) {
-                extent_meta_exit();
-                return -1;
-            }
-            extent_meta_exit();
-            run_len = 0;
-        }
+    extent_meta_enter();
+    pending_free.n = 0;
+    pending_alloc.n = 0;
+    pending_lost = 0;
+    index_clear();
+    // A tree torn by a crash cannot be walked to drop it; start afresh.
+    if (btree_delete_range(new_root, 0, ~0ULL, 0, 0, &new_root) < 0 &&
+        btree_create_empty(0, &new_root) < 0) {
+        rc = -1;
     }
+    index_nomem = 0;
+    index_ready = 1;
 
-    if (run_len != 0) {
-        extent_meta_enter();
-        if (btree_insert(new_root, run_start, extent_pack(run_len),
-                         &new_root) < 0) {
-            extent_meta_exit();
-            return -1;
+    for (uint32_t b = sb.data_start; rc == 0 &&
+         free_run_next(b, sb.nblocks, &run_start, &run_len) == 0;
+         b = run_start + run_len) {
+        if (extent_tree_put(&new_root, run_start, extent_pack(run_len)) < 0) {
+            // Every node of the new tree was written by this rebuild.
+            btree_visit(new_root, extent_free_node, 0);
+            new_root = 0;
+            index_clear();
+            rc = -1;
         }
-        extent_meta_exit();
     }
+    extent_meta_exit();
 
     if (out_root) {
         *out_root = new_root;
     }
-    return 0;
+    return rc;
+}
+
+// Fold the pending bitmap changes into the free-space tree. Freed runs
+// are re-checked against the bitmap: balloc may have handed a block out
+// again since.
+static int extent_sync(void) {
+    uint32_t root = sb.extent_root;
+    if (pending_lost) {
+        int rc = extent_rebuild(root, &root);
+        sb.extent_root = root;
+        return rc;
+    }
+
+    int rc = 0;
+    extent_meta_enter();
+    pending_alloc.frozen = pending_alloc.n;
+    pending_free.frozen = pending_free.n;
+    for (int i = 0; i < pending_alloc.frozen && rc == 0; i++) {
+        rc = extent_tree_remove(root, pending_alloc.runs[i].start,
+                                pending_alloc.runs[i].len, &root);
+    }
+    for (int i = 0; i < pending_free.frozen && rc == 0; i++) {
+        uint32_t end = pending_free.runs[i].start + pending_free.runs[i].len;
+        uint32_t run_start = 0;
+        uint32_t run_len = 0;
+        for (uint32_t b = pending_free.runs[i].start; rc == 0 &&
+             free_run_next(b, end, &run_start, &run_len) == 0;
+             b = run_start + run_len) {
+            rc = extent_tree_add(root, run_start, run_len, &root);
+        }
+    }
+    pending_done(&pending_alloc);
+    pending_done(&pending_free);
+    extent_meta_exit();
+
+    sb.extent_root = root;
+    return rc;
 }
 
-static int extent_root_update(uint32_t new_root) {
+// Keep the root tree's copy of the extent root in step. Its own CoW
+// allocations come from the bitmap so the extent root holds still.
+static int extent_root_update(void) {
     if (sb.root_tree == 0) {
-        sb.extent_root = new_root;
+        return 0;
+    }
+
+    uint64_t cur = 0;
+    if (btree_lookup(sb.root_tree, ROOT_ITEM_EXTENT_ROOT, &cur) == 0 &&
+        cur == sb.extent_root) {
         return 0;
     }
 
     uint32_t root = sb.root_tree;
-    if (btree_insert(root, ROOT_ITEM_EXTENT_ROOT, new_root, &root) < 0) {
+    extent_meta_enter();
+    int rc = btree_insert(root, ROOT_ITEM_EXTENT_ROOT, sb.extent_root, &root);
+    extent_meta_exit();
+    if (rc < 0) {
         return -1;
     }
     sb.root_tree = root;
-    sb.extent_root = new_root;
     return 0;
 }
 
 static int block_mark_alloc(uint32_t blockno) {
-    uint32_t bmap_block = 1 + NSUPER + blockno / (BSIZE * 8);
-    struct buf *bp = bread(bmap_block);
-    uint32_t bi = blockno % (BSIZE * 8);
-    uint32_t m = 1u << (bi % 8);
-    if (bp->data[bi / 8] & m) {
-        brelse(bp);
+    if (bmap_set(blockno) < 0) {
         return -1;
     }
-    bp->data[bi / 8] |= m;
-    bwrite(bp);
-    brelse(bp);
 
     uint32_t refcnt_block = 1 + NSUPER + sb.nbitmap +
                             (blockno / REFCNTS_PER_BLOCK);
-    bp = bread(refcnt_block);
+    struct buf *bp = bread(refcnt_block);
     bp->data[blockno % REFCNTS_PER_BLOCK] = 1;
-    bwrite(bp);
+    bmark_dirty(bp);
     brelse(bp);
 
     bp = bread(blockno);
     memzero(bp->data, BSIZE);
-    bwrite(bp);
+    bmark_dirty(bp);
     brelse(bp);
     return 0;
 }
@@ -470,70 +748,141 @@ void extent_init(void) {
         return;
     }
     sb.extent_root = new_root;
-    if (extent_root_update(new_root) < 0) {
+    if (extent_root_update() < 0) {
         kprintf("extent: root tree update failed\n");
         return;
     }
-    writesb();
+    txn_dirty();
 }
 
-static int extent_alloc_dir(uint32_t len, struct extent *out, int from_end) {
-    if (sb.extent_root == 0) {
-        extent_init();
+// Find len free blocks inside the free extent [k, k + avail) and return
+// the part of it the allocation uses up in [*lo, *hi). Blocks balloc took
+// from the bitmap stay listed until the next sync, so the bitmap has the
+// final say.
+static int extent_fit(uint32_t k, uint32_t avail, uint32_t len, int from_end,
+                      uint32_t *start, uint32_t *lo, uint32_t *hi) {
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    int found = 0;
+    for (uint32_t b = k; bmap_next_run(b, k + avail, &run_start,
+                                       &run_len) == 0;
+         b = run_start + run_len) {
+        if (run_len < len) {
+            continue;
+        }
+        // From the end, the last run that fits wins.
+        *start = from_end ? run_start + run_len - len : run_start;
+        found = 1;
+        if (!from_end) {
+            break;
+        }
     }
-    if (len == 0) return -1;
-    if (extent_meta) return -1;
+    if (!found) {
+        return -1;
+    }
+    *lo = from_end ? *start : k;
+    *hi = from_end ? k + avail : *start + len;
+    return 0;
+}
 
+#define EXTENT_NEAR_SCAN 8
+
+// Place a data allocation at goal, or failing that in one of the first
+// few free extents past it.
+static int extent_find_near(uint32_t goal, uint32_t len, uint32_t *start,
+                            uint32_t *lo, uint32_t *hi) {
     uint64_t k = 0;
     uint64_t v = 0;
-    uint32_t start = 0;
-    if (from_end) {
-        uint64_t cursor = sb.nblocks - 1;
-        for (;;) {
-            if (btree_lookup_le(sb.extent_root, cursor, &k, &v) < 0) {
+    if (extent_tree_prev(sb.extent_root, goal, &k, &v) == 0 &&
+        k + extent_unpack(v) >= (uint64_t)goal + len) {
+        uint32_t run_start = 0;
+        uint32_t run_len = 0;
+        if (bmap_next_run(goal, goal + len, &run_start, &run_len) == 0 &&
+            run_start == goal && run_len == len) {
+            *start = goal;
+            *lo = goal;
+            *hi = goal + len;
+            return 0;
+        }
+    }
+
+    struct btree_cursor cur;
+    int rc = btree_cursor_seek(&cur, sb.extent_root, goal);
+    for (int i = 0; rc == 0 && i < EXTENT_NEAR_SCAN;
+         i++, rc = btree_cursor_next(&cur)) {
+        btree_cursor_get(&cur, &k, &v);
+        if (extent_unpack(v) >= len &&
+            extent_fit((uint32_t)k, extent_unpack(v), len, 0,
+                       start, lo, hi) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Pick the blocks for an allocation. Data goes near its goal if it has
+// one, else takes the best fit from the index; metadata, and data when
+// the index is unavailable or its pick is stale, walks the tree from the
+// end of the disk or from data_start.
+static int extent_find(uint32_t len, int from_end, uint32_t goal,
+                       uint32_t *start, uint32_t *lo, uint32_t *hi) {
+    if (!from_end && goal >= sb.data_start && goal < sb.nblocks &&
+        extent_find_near(goal, len, start, lo, hi) == 0) {
+        return 0;
+    }
+    if (!from_end) {
+        if (!index_ready) {
+            index_load();
+        }
+        if (index_ready) {
+            struct extent_node *e = index_best_fit(len);
+            if (e == 0) {
                 return -1;
             }
-            if (v == 0) {
-                if (k == 0) return -1;
-                cursor = k - 1;
-                continue;
-            }
-            uint32_t avail = extent_unpack(v);
-            uint32_t seg_start = (uint32_t)k;
-            uint32_t seg_end = seg_start + avail - 1;
-            if (seg_end < cursor) {
-                cursor = seg_end;
-            }
-            if (avail < len) {
-                if (seg_start == 0) return -1;
-                cursor = seg_start - 1;
-                continue;
+            if (extent_fit(e->start, e->len, len, 0, start, lo, hi) == 0) {
+                return 0;
             }
-            start = seg_end - len + 1;
-            if (start < seg_start) {
-                if (seg_start == 0) return -1;
-                cursor = seg_start - 1;
-                continue;
-            }
-            break;
         }
+    }
+
+    struct btree_cursor cur;
+    int rc;
+    if (from_end) {
+        rc = btree_cursor_seek_le(&cur, sb.extent_root, sb.nblocks - 1);
     } else {
-        uint64_t cursor = sb.data_start;
-        for (;;) {
-            if (btree_lookup_ge(sb.extent_root, cursor, &k, &v) < 0) {
-                return -1;
-            }
-            if (v == 0) {
-                cursor = k + 1;
-                continue;
-            }
-            uint32_t avail = extent_unpack(v);
-            if (avail >= len) {
-                break;
-            }
-            cursor = k + 1;
+        rc = btree_cursor_seek(&cur, sb.extent_root, sb.data_start);
+    }
+    for (; rc == 0; rc = from_end ? btree_cursor_prev(&cur)
+                                  : btree_cursor_next(&cur)) {
+        uint64_t k = 0;
+        uint64_t v = 0;
+        btree_cursor_get(&cur, &k, &v);
+        if (extent_unpack(v) >= len &&
+            extent_fit((uint32_t)k, extent_unpack(v), len, from_end,
+                       start, lo, hi) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int extent_alloc_dir(uint32_t len, struct extent *out, int from_end,
+                            uint32_t goal) {
+    if (sb.extent_root == 0) {
+        extent_init();
+    }
+    if (len == 0) return -1;
+    if (extent_meta) return -1;
+
+    uint32_t start = 0;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    if (extent_find(len, from_end, goal, &start, &lo, &hi) < 0) {
+        // Freed blocks only join the tree at sync; try once more with them.
+        if ((pending_free.n == 0 && !pending_lost) || extent_sync() < 0 ||
+            extent_find(len, from_end, goal, &start, &lo, &hi) < 0) {
+            return -1;
         }
-        start = (uint32_t)k;
     }
 
     for (uint32_t i = 0; i < len; i++) {
@@ -545,22 +894,26 @@ static int extent_alloc_dir(uint32_t len, struct extent *out, int from_end) {
         }
     }
 
+    // Free blocks skipped over on the way to the fit go back at sync.
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t b = lo; bmap_next_run(b, hi, &run_start, &run_len) == 0;
+         b = run_start + run_len) {
+        extent_note_free_run(run_start, run_len);
+    }
+
     uint32_t new_root = sb.extent_root;
-    if (extent_rebuild(sb.extent_root, &new_root) < 0) {
+    extent_meta_enter();
+    int rc = extent_tree_remove(sb.extent_root, lo, hi - lo, &new_root);
+    extent_meta_exit();
+    if (rc < 0) {
         for (uint32_t i = 0; i < len; i++) {
             bfree(start + i);
         }
         return -1;
     }
-    if (new_root != sb.extent_root) {
-        if (extent_root_update(new_root) < 0) {
-            for (uint32_t i = 0; i < len; i++) {
-                bfree(start + i);
-            }
-            return -1;
-        }
-    }
-    writesb();
+    sb.extent_root = new_root;
+    txn_dirty();
 
     if (out) {
         out->start = start;
@@ -570,11 +923,144 @@ static int extent_alloc_dir(uint32_t len, struct extent *out, int from_end) {
 }
 
 int extent_alloc(uint32_t len, struct extent *out) {
-    return extent_alloc_dir(len, out, 0);
+    return extent_alloc_dir(len, out, 0, 0);
+}
+
+// Like extent_alloc, but prefer blocks starting at goal, e.g. the block
+// after a file's last extent.
+int extent_alloc_near(uint32_t goal, uint32_t len, struct extent *out) {
+    return extent_alloc_dir(len, out, 0, goal);
+}
+
+// Chunk size, scaled to the disk: 1/256th of it, 16 to 256 blocks.
+static uint32_t meta_chunk_len(void) {
+    uint32_t n = sb.nblocks / 256;
+    if (n < 16) n = 16;
+    if (n > 256) n = 256;
+    return n;
+}
+
+// Queue the free blocks in [from, to) for the tree's next sync.
+static void note_free_runs(uint32_t from, uint32_t to) {
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t b = from; bmap_next_run(b, to, &run_start, &run_len) == 0;
+         b = run_start + run_len) {
+        extent_note_free_run(run_start, run_len);
+    }
 }
 
+// Take a fresh chunk from the end of the disk, settling for smaller runs
+// when space is fragmented.
+static int meta_refill(void) {
+    if (sb.extent_root == 0 || extent_meta || meta_n == META_CHUNKS) {
+        return -1;
+    }
+
+    uint32_t len = meta_chunk_len();
+    uint32_t start = 0;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    while (extent_find(len, 1, 0, &start, &lo, &hi) < 0) {
+        len /= 2;
+        if (len == 0) {
+            return -1;
+        }
+    }
+
+    // The free blocks around the chunk go back at the next sync.
+    note_free_runs(lo, start);
+    note_free_runs(start + len, hi);
+    int i = meta_n;
+    while (i > 0 && meta_chunks[i - 1].start > start) {
+        meta_chunks[i] = meta_chunks[i - 1];
+        i--;
+    }
+    meta_chunks[i].start = start;
+    meta_chunks[i].len = len;
+    meta_n++;
+    // The tree's own node copies already come from the new chunk.
+    meta_cur = i;
+    meta_next = start;
+
+    uint32_t new_root = sb.extent_root;
+    extent_meta_enter();
+    int rc = extent_tree_remove(sb.extent_root, lo, hi - lo, &new_root);
+    extent_meta_exit();
+    if (rc < 0) {
+        return -1;
+    }
+    sb.extent_root = new_root;
+    txn_dirty();
+    return 0;
+}
+
+// Next free block in the chunks, starting where the last one came from.
+static int meta_take(uint32_t *out) {
+    for (int k = 0; k < meta_n; k++) {
+        int i = (meta_cur + k) % meta_n;
+        uint32_t lo = meta_chunks[i].start;
+        uint32_t hi = lo + meta_chunks[i].len;
+        uint32_t from = k == 0 && meta_next > lo && meta_next < hi ?
+                        meta_next : lo;
+        uint32_t run_start = 0;
+        uint32_t run_len = 0;
+        if (bmap_next_run(from, hi, &run_start, &run_len) < 0 &&
+            bmap_next_run(lo, from, &run_start, &run_len) < 0) {
+            continue;
+        }
+        if (block_mark_alloc(run_start) < 0) {
+            return -1;
+        }
+        meta_cur = i;
+        meta_next = run_start + 1;
+        *out = run_start;
+        return 0;
+    }
+    return -1;
+}
+
+// Hand chunks with nothing left in them back to the tree, all but the
+// one in use.
+static void meta_trim(void) {
+    int n = 0;
+    for (int i = 0; i < meta_n; i++) {
+        struct extent c = meta_chunks[i];
+        uint32_t run_start = 0;
+        uint32_t run_len = 0;
+        if (i != meta_cur &&
+            bmap_next_run(c.start, c.start + c.len, &run_start,
+                          &run_len) == 0 && run_len == c.len) {
+            extent_note_free_run(c.start, c.len);
+            continue;
+        }
+        if (i == meta_cur) {
+            meta_cur = n;
+        }
+        meta_chunks[n++] = c;
+    }
+    meta_n = n;
+}
+
+// Single tree nodes come from the metadata chunk, which works even while
+// the free-space tree is mid-update. Larger runs go through the tree.
 int extent_alloc_meta(uint32_t len, struct extent *out) {
-    return extent_alloc_dir(len, out, 1);
+    if (len != 1) {
+        return extent_alloc_dir(len, out, 1, 0);
+    }
+    if (sb.extent_root == 0) {
+        extent_init();
+    }
+
+    uint32_t blk = 0;
+    if (meta_take(&blk) < 0 && (meta_refill() < 0 || meta_take(&blk) < 0)) {
+        return -1;
+    }
+    if (out) {
+        out->start = blk;
+        out->len = 1;
+    }
+    return 0;
 }
 
 int extent_reserve(uint32_t start, uint32_t len) {
@@ -597,60 +1083,214 @@ int extent_reserve(uint32_t start, uint32_t len) {
     }
 
     uint32_t new_root = sb.extent_root;
-    if (extent_rebuild(sb.extent_root, &new_root) < 0) {
+    extent_meta_enter();
+    int rc = extent_tree_remove(sb.extent_root, start, len, &new_root);
+    extent_meta_exit();
+    if (rc < 0) {
         for (uint32_t i = 0; i < len; i++) {
             bfree(start + i);
         }
         return -1;
     }
-    if (new_root != sb.extent_root) {
-        if (extent_root_update(new_root) < 0) {
-            for (uint32_t i = 0; i < len; i++) {
-                bfree(start + i);
-            }
-            return -1;
+    sb.extent_root = new_root;
+    txn_dirty();
+    return 0;
+}
+
+static struct deferred_page *deferred_page_alloc(void) {
+    struct deferred_page *pg = kalloc();
+    for (int i = 0; pg == 0 && i < 2; i++) {
+        if (!deferred_spare_used[i]) {
+            deferred_spare_used[i] = 1;
+            deferred_on_spare = 1;
+            pg = &deferred_spare[i];
         }
     }
-    writesb();
-    return 0;
+    return pg;
+}
+
+static void deferred_page_free(struct deferred_page *pg) {
+    if (pg == &deferred_spare[0] || pg == &deferred_spare[1]) {
+        deferred_spare_used[pg - deferred_spare] = 0;
+        return;
+    }
+    kfree(pg);
 }
 
 void extent_free(uint32_t start, uint32_t len) {
     if (len == 0) return;
-    if (deferred_n >= MAX_DEFERRED) {
-        kprintf("extent: deferred list full\n");
-        return;
+    struct deferred_page *pg = deferred_tail;
+    if (pg != 0 && pg->n > 0) {
+        struct extent *last = &pg->runs[pg->n - 1];
+        if (last->start + last->len == start) {
+            last->len += len;
+            deferred_blocks += len;
+            return;
+        }
+    }
+    if (pg == 0 || pg->n == DEFERRED_PER_PAGE) {
+        pg = deferred_page_alloc();
+        if (pg == 0) {
+            kprintf("extent: no room to defer free of %u+%u\n", start, len);
+            return;
+        }
+        pg->next = 0;
+        pg->n = 0;
+        if (deferred_tail) {
+            deferred_tail->next = pg;
+        } else {
+            deferred_head = pg;
+        }
+        deferred_tail = pg;
     }
-    deferred[deferred_n].start = start;
-    deferred[deferred_n].len = len;
-    deferred_n++;
+    pg->runs[pg->n].start = start;
+    pg->runs[pg->n].len = len;
+    pg->n++;
+    deferred_blocks += len;
 }
 
-int extent_commit(void) {
+// Blocks freed in the open transaction, held until it commits.
+uint32_t extent_deferred_blocks(void) {
+    return deferred_blocks;
+}
+
+// Runs on the deferred-free list, after merging at append.
+uint32_t extent_deferred_runs(void) {
+    uint32_t n = 0;
+    for (struct deferred_page *pg = deferred_head; pg; pg = pg->next) {
+        n += pg->n;
+    }
+    return n;
+}
+
+// Whether the open transaction's frees are down to a spare page.
+int extent_deferred_spare(void) {
+    return deferred_on_spare;
+}
+
+static void deferred_sift(struct extent *r, uint32_t i, uint32_t n) {
+    for (;;) {
+        uint32_t big = i;
+        uint32_t l = 2 * i + 1;
+        if (l < n && r[l].start > r[big].start) big = l;
+        if (l + 1 < n && r[l + 1].start > r[big].start) big = l + 1;
+        if (big == i) return;
+        struct extent t = r[i];
+        r[i] = r[big];
+        r[big] = t;
+        i = big;
+    }
+}
+
+// Heapsort a page's runs by start block.
+static void deferred_sort(struct extent *r, uint32_t n) {
+    for (uint32_t i = n / 2; i-- > 0; ) {
+        deferred_sift(r, i, n);
+    }
+    for (uint32_t end = n; end-- > 1; ) {
+        struct extent t = r[0];
+        r[0] = r[end];
+        r[end] = t;
+        deferred_sift(r, 0, end);
+    }
+}
+
+// Free everything the closed transaction deferred in block order, joining
+// runs that abut. Runs that overlap stay separate: each one drops a
+// reference.
+static void deferred_apply(void) {
+    struct deferred_page *head = deferred_closed;
+    deferred_closed = 0;
+
+    for (struct deferred_page *pg = head; pg; pg = pg->next) {
+        deferred_sort(pg->runs, pg->n);
+        pg->pos = 0;
+    }
+
+    struct extent cur = { 0, 0 };
+    for (;;) {
+        struct deferred_page *min = 0;
+        for (struct deferred_page *pg = head; pg; pg = pg->next) {
+            if (pg->pos < pg->n &&
+                (min == 0 ||
+                 pg->runs[pg->pos].start < min->runs[min->pos].start)) {
+                min = pg;
+            }
+        }
+        if (min == 0) {
+            break;
+        }
+        struct extent *r = &min->runs[min->pos++];
+        if (cur.len != 0 && cur.start + cur.len == r->start) {
+            cur.len += r->len;
+            continue;
+        }
+        if (cur.len != 0) {
+            bfree_range(cur.start, cur.len);
+        }
+        cur = *r;
+    }
+    if (cur.len != 0) {
+        bfree_range(cur.start, cur.len);
+    }
+
+    while (head) {
+        struct deferred_page *next = head->next;
+        deferred_page_free(head);
+        head = next;
+    }
+}
+
+// Close the open transaction: the root tree takes the current extent
+// root and *closed names every root as of now. Buffers, replaced nodes
+// and deferred frees so far belong to it; later ones to the next.
+int extent_commit_begin(struct superblock *closed) {
     if (sb.extent_root == 0) {
         extent_init();
     }
     if (sb.extent_root == 0) {
         return -1;
     }
-    for (int i = 0; i < deferred_n; i++) {
-        uint32_t start = deferred[i].start;
-        uint32_t len = deferred[i].len;
-        for (uint32_t b = 0; b < len; b++) {
-            bfree(start + b);
-        }
-    }
-    deferred_n = 0;
 
-    uint32_t new_root = sb.extent_root;
-    if (extent_rebuild(sb.extent_root, &new_root) < 0) {
+    if (extent_root_update() < 0) {
         return -1;
     }
-    if (new_root != sb.extent_root) {
-        if (extent_root_update(new_root) < 0) {
-            return -1;
-        }
+    sb_close(closed);
+    bclose();
+    btree_stale_close();
+    deferred_closed = deferred_head;
+    deferred_head = deferred_tail = 0;
+    deferred_blocks = 0;
+    deferred_on_spare = 0;
+    txn_closed();
+    return 0;
+}
+
+// Once the closed transaction's buffers are out: the superblocks naming
+// it follow, then the nodes and blocks it replaced are released. The
+// free-space tree work that follows belongs to the open transaction.
+int extent_commit_end(struct superblock *closed) {
+    writesb(closed);
+    txn_committed();
+    tree_reclaim(closed);
+
+    deferred_apply();
+    meta_trim();
+
+    // The root tree catches up with the synced extent root at the next
+    // commit, before anything it still points at is reclaimed.
+    if (extent_sync() < 0) {
+        return -1;
     }
-    writesb();
     return 0;
 }
+
+// Write out the open transaction in one go.
+int extent_commit(void) {
+    struct superblock closed;
+    if (extent_commit_begin(&closed) < 0) {
+        return -1;
+    }
+    bflush();
+    return extent_commit_end(&closed);
+}
@@ -71,6 +71,9 @@ void fileclose(struct file *f) {
     if (type == FD_INODE && ip) {
         iput(ip);
     }
+    if (type == FD_TREE && f->writable) {
+        fs_tree_writeback(f->tree_ino);
+    }
 }
 
 int fileread(struct file *f, char *addr, int n) {
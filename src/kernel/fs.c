@@ -5,9 +5,17 @@
 #include <kernel/panic.h>
 #include <kernel/string.h>
 #include <kernel/extent.h>
+#include <kernel/kalloc.h>
+#include <kernel/tree_log.h>
+#include <mmu.h>
 
 struct superblock sb;
 
+// The superblock as last written by a commit.
+struct superblock sb_committed;
+
+static void bmap_summary_reset(void);
+
 static uint32_t sb_checksum(const struct superblock *sbp) {
     struct superblock tmp = *sbp;
     tmp.checksum = 0;
@@ -46,23 +54,46 @@ void readsb(void) {
     }
 
     memmove(&sb, &best, sizeof(sb));
+    memmove(&sb_committed, &best, sizeof(sb_committed));
 }
 
-void writesb(void) {
-    sb.generation++;
-    sb.checksum = sb_checksum(&sb);
-
+static void sb_write(struct superblock *sbp) {
+    sbp->checksum = sb_checksum(sbp);
     for (uint32_t i = 0; i < NSUPER; i++) {
         struct buf *bp = bread(1 + i);
         memzero(bp->data, BSIZE);
-        memmove(bp->data, &sb, sizeof(sb));
+        memmove(bp->data, sbp, sizeof(*sbp));
         bwrite(bp);
         brelse(bp);
     }
 }
 
+// Close the open transaction: *out names its roots from here on, and
+// whatever changes next belongs to the generation after it.
+void sb_close(struct superblock *out) {
+    sb.generation++;
+    sb.log_root = 0; // The commit holds everything the log did
+    memmove(out, &sb, sizeof(*out));
+}
+
+// Commit point: everything a closed transaction's roots reach is on disk
+// before the superblocks that name them.
+void writesb(struct superblock *closed) {
+    sb_write(closed);
+    memmove(&sb_committed, closed, sizeof(sb_committed));
+}
+
+// Point the last commit's superblocks at a tree log. The generation stays
+// put: the log only means something on top of that commit.
+void writesb_log(uint32_t log_root) {
+    struct superblock tmp = sb_committed;
+    tmp.log_root = log_root;
+    sb_write(&tmp);
+}
+
 void fsinit(void) {
     readsb();
+    bmap_summary_reset();
 
     if (sb.magic != FS_MAGIC) {
         kprintf("fs: no valid filesystem found (magic=%x)\n", sb.magic);
@@ -72,6 +103,242 @@ void fsinit(void) {
 
     kprintf("fs: mounted (v%d, %d blocks, %d inodes)\n",
             sb.version, sb.nblocks, sb.ninodes);
+
+    // Before anything allocates: the log's blocks are free in the bitmap
+    // of the commit it sits on.
+    if (sb.log_root != 0) {
+        tree_log_replay();
+    }
+}
+
+#define BPB (BSIZE * 8) // Bitmap bits per block
+#define BMAP_WORDS (BSIZE / sizeof(uint64_t))
+#define BMAP_SUMMARY_MAX (PGSIZE / sizeof(uint16_t))
+
+// Free bits per bitmap block, counted on first use, so scans step over
+// full blocks without reading them. Unused on disks too big for a page.
+static uint16_t *bmap_free;
+static int bmap_ready;
+
+// No bit-manipulation instructions on rv64imac and no libgcc to fall
+// back on, so these stay in C.
+static uint32_t ctz64(uint64_t x) {
+    static const uint8_t debruijn[64] = {
+        0, 1, 2, 53, 3, 7, 54, 27, 4, 38, 41, 8, 34, 55, 48, 28,
+        62, 5, 39, 46, 44, 42, 22, 9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52, 6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12,
+    };
+    return debruijn[((x & -x) * 0x022fdd63cc95386dULL) >> 58];
+}
+
+static uint32_t fls64(uint64_t x) {
+    uint32_t n = 0;
+    for (uint32_t s = 32; s > 0; s >>= 1) {
+        if (x >> s) {
+            x >>= s;
+            n += s;
+        }
+    }
+    return n;
+}
+
+static uint32_t popcount64(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (uint32_t)((x * 0x0101010101010101ULL) >> 56);
+}
+
+static void bmap_summary_reset(void) {
+    bmap_ready = 0;
+}
+
+static void bmap_summary_load(void) {
+    if (sb.nbitmap > BMAP_SUMMARY_MAX) {
+        return;
+    }
+    if (bmap_free == 0) {
+        bmap_free = kalloc();
+        if (bmap_free == 0) {
+            return;
+        }
+    }
+    for (uint32_t map = 0; map < sb.nbitmap; map++) {
+        struct buf *bp = bread(1 + NSUPER + map);
+        const uint64_t *w = (const uint64_t *)bp->data;
+        uint32_t used = 0;
+        for (uint32_t i = 0; i < BMAP_WORDS; i++) {
+            used += popcount64(w[i]);
+        }
+        brelse(bp);
+        bmap_free[map] = (uint16_t)(BPB - used);
+    }
+    bmap_ready = 1;
+}
+
+// Free bits in bitmap block map, or -1 if not known.
+static int bmap_count(uint32_t map) {
+    if (!bmap_ready) {
+        bmap_summary_load();
+    }
+    if (!bmap_ready || map >= sb.nbitmap) {
+        return -1;
+    }
+    return bmap_free[map];
+}
+
+int bmap_is_free(uint32_t blockno) {
+    int count = bmap_count(blockno / BPB);
+    if (count == 0 || count == BPB) {
+        return count != 0;
+    }
+    struct buf *bp = bread(1 + NSUPER + blockno / BPB);
+    uint32_t bi = blockno % BPB;
+    int free = (bp->data[bi / 8] & (1u << (bi % 8))) == 0;
+    brelse(bp);
+    return free;
+}
+
+// Mark blockno allocated in the bitmap; fails if it already was.
+int bmap_set(uint32_t blockno) {
+    uint32_t map = blockno / BPB;
+    struct buf *bp = bread(1 + NSUPER + map);
+    uint32_t bi = blockno % BPB;
+    uint32_t m = 1u << (bi % 8);
+    if (bp->data[bi / 8] & m) {
+        brelse(bp);
+        return -1;
+    }
+    bp->data[bi / 8] |= m;
+    bmark_dirty(bp);
+    brelse(bp);
+    if (bmap_ready) {
+        bmap_free[map]--;
+    }
+    return 0;
+}
+
+static void bmap_clear(uint32_t blockno) {
+    uint32_t map = blockno / BPB;
+    struct buf *bp = bread(1 + NSUPER + map);
+    uint32_t bi = blockno % BPB;
+    uint32_t m = 1u << (bi % 8);
+    if (bp->data[bi / 8] & m) {
+        bp->data[bi / 8] &= ~m;
+        bmark_dirty(bp);
+        if (bmap_ready) {
+            bmap_free[map]++;
+        }
+    }
+    brelse(bp);
+}
+
+// The first run of free blocks at or after from, cut off at limit. Works a
+// word at a time and skips bitmap blocks the summary says are full; a run
+// spanning whole free bitmap blocks skips those unread too.
+int bmap_next_run(uint32_t from, uint32_t limit, uint32_t *start_out,
+                  uint32_t *len_out) {
+    if (limit > sb.nblocks) {
+        limit = sb.nblocks;
+    }
+    uint32_t b = from;
+    uint32_t start = 0;
+    int in_run = 0;
+    while (b < limit) {
+        uint32_t map = b / BPB;
+        int count = bmap_count(map);
+        if (count == 0) {
+            if (in_run) {
+                break;
+            }
+            b = (map + 1) * BPB;
+            continue;
+        }
+        if (count == BPB && b % BPB == 0) {
+            if (!in_run) {
+                start = b;
+                in_run = 1;
+            }
+            b += BPB;
+            continue;
+        }
+
+        struct buf *bp = bread(1 + NSUPER + map);
+        const uint64_t *w = (const uint64_t *)bp->data;
+        uint32_t end = (map + 1) * BPB;
+        if (end > limit) {
+            end = limit;
+        }
+        int done = 0;
+        while (b < end) {
+            uint32_t shift = b % 64;
+            uint32_t avail = 64 - shift;
+            uint64_t mask = avail == 64 ? ~0ULL : (1ULL << avail) - 1;
+            uint64_t used = (w[(b % BPB) / 64] >> shift) & mask;
+            if (!in_run) {
+                uint64_t free = ~used & mask;
+                if (free == 0) {
+                    b += avail;
+                    continue;
+                }
+                uint32_t skip = ctz64(free);
+                b += skip;
+                avail -= skip;
+                used >>= skip;
+                start = b;
+                in_run = 1;
+            }
+            if (used == 0) {
+                b += avail;
+                continue;
+            }
+            b += ctz64(used);
+            done = 1;
+            break;
+        }
+        brelse(bp);
+        if (done) {
+            break;
+        }
+    }
+    if (!in_run || start >= limit) {
+        return -1;
+    }
+    if (b > limit) {
+        b = limit;
+    }
+    *start_out = start;
+    *len_out = b - start;
+    return 0;
+}
+
+// The highest free block below limit.
+static int bmap_last_free(uint32_t limit, uint32_t *out) {
+    uint32_t b = limit;
+    while (b > 0) {
+        uint32_t map = (b - 1) / BPB;
+        if (bmap_count(map) == 0) {
+            b = map * BPB;
+            continue;
+        }
+        struct buf *bp = bread(1 + NSUPER + map);
+        const uint64_t *w = (const uint64_t *)bp->data;
+        uint32_t base = map * BPB;
+        while (b > base) {
+            uint32_t top = (b - 1) % 64; // Highest bit to look at
+            uint64_t mask = top == 63 ? ~0ULL : (1ULL << (top + 1)) - 1;
+            uint64_t free = ~w[(b - 1 - base) / 64] & mask;
+            if (free != 0) {
+                *out = b - 1 - top + fls64(free);
+                brelse(bp);
+                return 0;
+            }
+            b -= top + 1;
+        }
+        brelse(bp);
+    }
+    return -1;
 }
 
 uint8_t brefcnt_get(uint32_t blockno) {
@@ -99,7 +366,7 @@ void brefcnt_inc(uint32_t blockno) {
 
     if (bp->data[idx] < 255) {
         bp->data[idx]++;
-        bwrite(bp);
+        bmark_dirty(bp);
     }
     brelse(bp);
 }
@@ -116,23 +383,55 @@ void brefcnt_dec(uint32_t blockno) {
 
     if (bp->data[idx] > 0) {
         bp->data[idx]--;
-        bwrite(bp);
+        bmark_dirty(bp);
 
         if (bp->data[idx] == 0) {
             brelse(bp);
-            uint32_t bmap_block = 1 + NSUPER + blockno / (BSIZE * 8);
-            bp = bread(bmap_block);
-            uint32_t bi = blockno % (BSIZE * 8);
-            bp->data[bi / 8] &= ~(1 << (bi % 8));
-            bwrite(bp);
+            bmap_clear(blockno);
+            extent_note_free(blockno);
+            return;
         }
     }
     brelse(bp);
 }
 
-uint32_t balloc(void) {
-    struct buf *bp;
+// Take blockno, already known free, straight from the bitmap.
+static uint32_t balloc_take(uint32_t blockno) {
+    if (bmap_set(blockno) < 0) {
+        return 0;
+    }
+    extent_note_alloc(blockno);
+
+    uint32_t refcnt_block = 1 + NSUPER + sb.nbitmap +
+                            (blockno / REFCNTS_PER_BLOCK);
+    struct buf *bp = bread(refcnt_block);
+    bp->data[blockno % REFCNTS_PER_BLOCK] = 1;
+    bmark_dirty(bp);
+    brelse(bp);
 
+    bp = bread(blockno);
+    memzero(bp->data, BSIZE);
+    bmark_dirty(bp);
+    brelse(bp);
+    return blockno;
+}
+
+// Claim blockno for a tree log being replayed: the log may name blocks
+// the last commit's bitmap still shows free. Blocks already allocated are
+// taken as they are.
+void breserve(uint32_t blockno) {
+    if (blockno < sb.data_start || blockno >= sb.nblocks) {
+        return;
+    }
+    if (bmap_is_free(blockno) && bmap_set(blockno) == 0) {
+        extent_note_alloc(blockno);
+    }
+    if (brefcnt_get(blockno) == 0) {
+        brefcnt_inc(blockno);
+    }
+}
+
+uint32_t balloc(void) {
     if (sb.extent_root != 0) {
         struct extent ex;
         if (extent_alloc_meta(1, &ex) == 0) {
@@ -140,73 +439,14 @@ uint32_t balloc(void) {
         }
     }
 
-    if (extent_meta_active()) {
-        uint32_t blocks_per_map = BSIZE * 8;
-        int64_t last_map = (sb.nblocks - 1) / blocks_per_map;
-        for (int64_t map = last_map; map >= 0; map--) {
-            uint32_t bmap_block = 1 + NSUPER + (uint32_t)map;
-            bp = bread(bmap_block);
-            int64_t limit = blocks_per_map - 1;
-            if (map == last_map) {
-                limit = (sb.nblocks - 1) - (map * blocks_per_map);
-            }
-            for (int64_t bi = limit; bi >= 0; bi--) {
-                uint32_t m = 1u << (bi % 8);
-                if ((bp->data[bi / 8] & m) == 0) {
-                    bp->data[bi / 8] |= m;
-                    bwrite(bp);
-                    brelse(bp);
-
-                    uint32_t blockno = (uint32_t)(map * blocks_per_map + bi);
-                    uint32_t refcnt_block = 1 + NSUPER + sb.nbitmap +
-                                            (blockno / REFCNTS_PER_BLOCK);
-                    bp = bread(refcnt_block);
-                    bp->data[blockno % REFCNTS_PER_BLOCK] = 1;
-                    bwrite(bp);
-                    brelse(bp);
-
-                    bp = bread(blockno);
-                    memzero(bp->data, BSIZE);
-                    bwrite(bp);
-                    brelse(bp);
-
-                    return blockno;
-                }
-            }
-            brelse(bp);
-        }
+    uint32_t blockno = 0;
+    if (extent_meta_active() && bmap_last_free(sb.nblocks, &blockno) == 0) {
+        return balloc_take(blockno);
     }
 
-    for (uint32_t b = 0; b < sb.nblocks; b += BSIZE * 8) {
-        uint32_t bmap_block = 1 + NSUPER + b / (BSIZE * 8);
-        bp = bread(bmap_block);
-
-        for (uint32_t bi = 0; bi < BSIZE * 8 && b + bi < sb.nblocks; bi++) {
-            uint32_t m = 1 << (bi % 8);
-
-            if ((bp->data[bi / 8] & m) == 0) {
-                bp->data[bi / 8] |= m;
-                bwrite(bp);
-                brelse(bp);
-
-                uint32_t blockno = b + bi;
-
-                uint32_t refcnt_block = 1 + NSUPER + sb.nbitmap +
-                                        (blockno / REFCNTS_PER_BLOCK);
-                bp = bread(refcnt_block);
-                bp->data[blockno % REFCNTS_PER_BLOCK] = 1;
-                bwrite(bp);
-                brelse(bp);
-
-                bp = bread(blockno);
-                memzero(bp->data, BSIZE);
-                bwrite(bp);
-                brelse(bp);
-
-                return blockno;
-            }
-        }
-        brelse(bp);
+    uint32_t len = 0;
+    if (bmap_next_run(0, sb.nblocks, &blockno, &len) == 0) {
+        return balloc_take(blockno);
     }
 
     kprintf("fs: out of disk space\n");
@@ -222,6 +462,91 @@ void bfree(uint32_t blockno) {
     brefcnt_dec(blockno);
 }
 
+// Clear the bitmap bits of [start, end), which lies in one bitmap block.
+static void bmap_clear_run(uint32_t start, uint32_t end) {
+    uint32_t map = start / BPB;
+    struct buf *bp = bread(1 + NSUPER + map);
+    uint32_t cleared = 0;
+    for (uint32_t b = start; b < end; b++) {
+        uint32_t bi = b % BPB;
+        uint8_t m = 1u << (bi % 8);
+        if (bp->data[bi / 8] & m) {
+            bp->data[bi / 8] &= ~m;
+            cleared++;
+        }
+    }
+    if (cleared != 0) {
+        bmark_dirty(bp);
+        if (bmap_ready) {
+            bmap_free[map] += cleared;
+        }
+    }
+    brelse(bp);
+}
+
+// A run of blocks whose last reference just went.
+static void bfree_run(uint32_t start, uint32_t len) {
+    for (uint32_t b = start; b < start + len; ) {
+        uint32_t end = (b / BPB + 1) * BPB;
+        if (end > start + len) {
+            end = start + len;
+        }
+        bmap_clear_run(b, end);
+        b = end;
+    }
+    extent_note_free_run(start, len);
+}
+
+// bfree for every block of [start, start + len), reading each refcount
+// and bitmap block once rather than once per block.
+void bfree_range(uint32_t start, uint32_t len) {
+    uint32_t end = start + len;
+    if (end > sb.nblocks || end < start) {
+        panic("bfree_range: block out of range");
+    }
+    if (start < sb.data_start) {
+        start = sb.data_start;
+    }
+
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t b = start; b < end; ) {
+        uint32_t rend = (b / REFCNTS_PER_BLOCK + 1) * REFCNTS_PER_BLOCK;
+        if (rend > end) {
+            rend = end;
+        }
+        struct buf *bp = bread(1 + NSUPER + sb.nbitmap +
+                               (b / REFCNTS_PER_BLOCK));
+        int dirty = 0;
+        for (; b < rend; b++) {
+            uint8_t *refs = &bp->data[b % REFCNTS_PER_BLOCK];
+            if (*refs == 0) {
+                continue;
+            }
+            dirty = 1;
+            if (--*refs != 0) {
+                continue;
+            }
+            if (run_len != 0 && run_start + run_len == b) {
+                run_len++;
+                continue;
+            }
+            if (run_len != 0) {
+                bfree_run(run_start, run_len);
+            }
+            run_start = b;
+            run_len = 1;
+        }
+        if (dirty) {
+            bmark_dirty(bp);
+        }
+        brelse(bp);
+    }
+    if (run_len != 0) {
+        bfree_run(run_start, run_len);
+    }
+}
+
 #define NINODE 50 // Maximum number of cached inodes
 
 static struct {
@@ -7,6 +7,11 @@
 #include <kernel/string.h>
 #include <kernel/buf.h>
 #include <kernel/sched.h>
+#include <kernel/kalloc.h>
+#include <kernel/syscall.h>
+#include <kernel/txn.h>
+#include <kernel/tree_log.h>
+#include <mmu.h>
 
 static uint64_t fs_item_key(uint32_t ino, uint16_t type, uint32_t sub) {
     return ((uint64_t)ino << 32) |
@@ -15,19 +20,31 @@ static uint64_t fs_item_key(uint32_t ino, uint16_t type, uint32_t sub) {
 }
 
 static uint32_t fs_tree_next_ino = 0;
+static uint64_t fs_tree_gen = 1; // Bumped by every fs tree update
 
-static uint16_t name_hash16(const char *name) {
+static uint32_t name_hash(const char *name) {
     uint32_t h = 2166136261u;
     for (int i = 0; name[i]; i++) {
         h ^= (uint8_t)name[i];
         h *= 16777619u;
     }
-    return (uint16_t)(h ^ (h >> 16));
+    return h;
 }
 
-static uint64_t dirent_key(uint32_t parent_ino, const char *name) {
-    uint16_t h = name_hash16(name);
-    return fs_item_key(parent_ino, FS_ITEM_DIRENT, h);
+// Entries are keyed by a 24-bit name hash and a slot number below it, so
+// names whose hashes collide sit side by side in up to DIRENT_SLOTS
+// items. Entries from before this keep the old 16-bit hash as their key.
+#define DIRENT_SLOT_BITS 4
+#define DIRENT_SLOTS (1u << DIRENT_SLOT_BITS)
+
+static uint64_t dirent_key(uint32_t parent_ino, uint32_t hash, uint32_t slot) {
+    return fs_item_key(parent_ino, FS_ITEM_DIRENT,
+                       ((hash & 0xffffff) << DIRENT_SLOT_BITS) | slot);
+}
+
+static uint64_t dirent_key_legacy(uint32_t parent_ino, const char *name) {
+    uint32_t h = name_hash(name);
+    return fs_item_key(parent_ino, FS_ITEM_DIRENT, (uint16_t)(h ^ (h >> 16)));
 }
 
 static uint64_t dirent_pack(uint32_t ino, uint32_t name_block) {
@@ -39,6 +56,35 @@ static void dirent_unpack(uint64_t v, uint32_t *ino, uint32_t *name_block) {
     if (name_block) *name_block = (uint32_t)(v >> 32);
 }
 
+// Copy an entry's name to out. Names are stored in the item's payload;
+// entries written before that keep theirs in a block of its own.
+static int dirent_name(uint64_t val, const uint8_t *data, uint32_t dlen,
+                       char *out, uint32_t out_len) {
+    uint32_t name_block = 0;
+    dirent_unpack(val, 0, &name_block);
+    if (name_block == 0 && dlen == 0) {
+        return -1;
+    }
+    if (out == 0 || out_len == 0) {
+        return 0;
+    }
+    struct buf *bp = 0;
+    if (name_block) {
+        bp = bread(name_block);
+        data = bp->data;
+        dlen = BSIZE;
+    }
+    uint32_t i = 0;
+    for (; i + 1 < out_len && i < dlen && data[i]; i++) {
+        out[i] = (char)data[i];
+    }
+    out[i] = 0;
+    if (bp) {
+        brelse(bp);
+    }
+    return 0;
+}
+
 static uint64_t extent_key(uint32_t ino, uint64_t file_off) {
     uint64_t block = file_off / BSIZE;
     return fs_item_key(ino, FS_ITEM_EXTENT, (uint32_t)block);
@@ -51,13 +97,21 @@ static void extent_key_unpack(uint64_t key, uint32_t *ino, uint16_t *type,
     if (block) *block = (uint32_t)(key & 0x0fffffff);
 }
 
+// The top bit of an extent's length marks blocks reserved by fallocate but
+// never written; they read as zeros.
+#define FS_EXTENT_UNWRITTEN 0x80000000u
+
 static uint64_t extent_pack(uint32_t start, uint32_t len) {
     return ((uint64_t)start << 32) | (uint64_t)len;
 }
 
 static void extent_unpack(uint64_t v, uint32_t *start, uint32_t *len) {
     if (start) *start = (uint32_t)(v >> 32);
-    if (len) *len = (uint32_t)(v & 0xffffffffu);
+    if (len) *len = (uint32_t)(v & ~FS_EXTENT_UNWRITTEN & 0xffffffffu);
+}
+
+static uint32_t extent_flags(uint64_t v) {
+    return (uint32_t)v & FS_EXTENT_UNWRITTEN;
 }
 
 static uint64_t extent_ref_pack(uint32_t len, uint32_t refs) {
@@ -86,12 +140,209 @@ static void inode_unpack(uint64_t v, uint16_t *type, uint64_t *size) {
     if (size) *size = s;
 }
 
+// Delayed allocation: writes into holes are held in these pages instead of
+// getting extents right away. Writeback gives each contiguous run of
+// buffered blocks one extent; every transaction close writes all of them
+// back, so a commit holds the data written before it.
+#define DELALLOC_PAGES 64
+#define DELALLOC_FILES 16
+#define DELALLOC_BLOCKS (PGSIZE / BSIZE) // File blocks per page
+
+// Entries belong to the subvolume current when they were written; other
+// subvolumes never see them.
+struct delalloc_page {
+    uint32_t ino; // 0: free
+    uint64_t subvol;
+    uint32_t fblock; // First file block, a multiple of DELALLOC_BLOCKS
+    uint32_t valid; // Bit i: block fblock + i is buffered
+    uint8_t *data;
+};
+
+struct delalloc_file {
+    uint32_t ino; // 0: free
+    uint64_t subvol;
+    uint16_t type;
+    uint64_t size; // Includes buffered writes
+};
+
+static struct delalloc_page delalloc_pages[DELALLOC_PAGES];
+static struct delalloc_file delalloc_files[DELALLOC_FILES];
+
+static struct delalloc_file *delalloc_file_find(uint32_t ino) {
+    for (int i = 0; i < DELALLOC_FILES; i++) {
+        if (delalloc_files[i].ino == ino && ino != 0 &&
+            delalloc_files[i].subvol == tree_subvol_current()) {
+            return &delalloc_files[i];
+        }
+    }
+    return 0;
+}
+
+static struct delalloc_page *delalloc_page_find(uint32_t ino, uint32_t fblock) {
+    uint32_t base = fblock - fblock % DELALLOC_BLOCKS;
+    for (int i = 0; i < DELALLOC_PAGES; i++) {
+        if (delalloc_pages[i].ino == ino && ino != 0 &&
+            delalloc_pages[i].subvol == tree_subvol_current() &&
+            delalloc_pages[i].fblock == base) {
+            return &delalloc_pages[i];
+        }
+    }
+    return 0;
+}
+
+// The buffered copy of file block fblock, or 0.
+static uint8_t *delalloc_block(uint32_t ino, uint32_t fblock) {
+    struct delalloc_page *pg = delalloc_page_find(ino, fblock);
+    uint32_t i = fblock % DELALLOC_BLOCKS;
+    if (pg == 0 || !(pg->valid & (1u << i))) {
+        return 0;
+    }
+    return pg->data + i * BSIZE;
+}
+
+// Drop buffered blocks from fblock on.
+static void delalloc_discard(uint32_t ino, uint32_t fblock) {
+    for (int i = 0; i < DELALLOC_PAGES; i++) {
+        struct delalloc_page *pg = &delalloc_pages[i];
+        if (pg->ino != ino || ino == 0 ||
+            pg->subvol != tree_subvol_current()) {
+            continue;
+        }
+        for (uint32_t b = 0; b < DELALLOC_BLOCKS; b++) {
+            if (pg->fblock + b >= fblock) {
+                pg->valid &= ~(1u << b);
+            }
+        }
+        if (pg->valid == 0) {
+            kfree(pg->data);
+            pg->data = 0;
+            pg->ino = 0;
+        }
+    }
+}
+
+static void delalloc_release(uint32_t ino) {
+    delalloc_discard(ino, 0);
+    struct delalloc_file *df = delalloc_file_find(ino);
+    if (df) {
+        df->ino = 0;
+    }
+}
+
+// Dentry cache: recent name lookups, so path walks resolve from memory.
+// Entries are keyed by subvolume, parent and name, one per hash slot; a
+// newer entry simply takes the slot over. ino 0 records that the name is
+// absent. The entry with an empty name holds a directory's parent.
+#define DCACHE_SIZE 256
+#define DCACHE_NAME 32 // Longer names are never cached
+
+struct dcache_entry {
+    uint64_t subvol; // 0: free
+    uint32_t parent;
+    uint32_t ino;
+    char name[DCACHE_NAME];
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+
+static struct dcache_entry *dcache_slot(uint32_t parent, const char *name) {
+    uint32_t len = 0;
+    while (name[len] && len < DCACHE_NAME) {
+        len++;
+    }
+    if (len == DCACHE_NAME) {
+        return 0;
+    }
+    uint32_t h = name_hash(name) ^ (parent * 2654435761u) ^
+                 (uint32_t)tree_subvol_current() * 40503u;
+    return &dcache[h % DCACHE_SIZE];
+}
+
+// 1 and *ino_out set on a hit, 0 on a miss.
+static int dcache_get(uint32_t parent, const char *name, uint32_t *ino_out) {
+    struct dcache_entry *de = dcache_slot(parent, name);
+    if (de == 0 || de->subvol != tree_subvol_current() ||
+        de->parent != parent || strncmp(de->name, name, DCACHE_NAME) != 0) {
+        return 0;
+    }
+    *ino_out = de->ino;
+    return 1;
+}
+
+static void dcache_set(uint32_t parent, const char *name, uint32_t ino) {
+    struct dcache_entry *de = dcache_slot(parent, name);
+    if (de == 0) {
+        return;
+    }
+    de->subvol = tree_subvol_current();
+    de->parent = parent;
+    de->ino = ino;
+    uint32_t i = 0;
+    for (; name[i]; i++) {
+        de->name[i] = name[i];
+    }
+    de->name[i] = 0;
+}
+
+static void dcache_flush(void) {
+    memzero(dcache, sizeof(dcache));
+}
+
+// Inode cache: type and size of recently used inodes, one per hash slot
+// like the dentry cache. A write that grows a file only updates its entry
+// and marks it dirty; dirty entries reach the tree when the transaction
+// closes, on writeback, or when their slot is taken. Each entry also
+// keeps the last extent or hole looked up, good until the tree changes.
+#define ICACHE_SIZE 64
+
+struct icache_entry {
+    uint32_t ino; // 0: free
+    uint64_t subvol;
+    uint16_t type;
+    uint64_t size;
+    int dirty; // size is newer than the inode item
+    uint64_t map_gen; // fs_tree_gen the mapping was read at; 0: none
+    uint32_t map_fblock;
+    uint32_t map_blocks;
+    uint32_t map_start; // 0: a hole
+    uint32_t map_flags;
+};
+
+static struct icache_entry icache[ICACHE_SIZE];
+
+static struct icache_entry *icache_slot(uint32_t ino) {
+    uint32_t h = (ino * 2654435761u) ^
+                 (uint32_t)tree_subvol_current() * 40503u;
+    return &icache[h % ICACHE_SIZE];
+}
+
+static struct icache_entry *icache_find(uint32_t ino) {
+    struct icache_entry *ie = icache_slot(ino);
+    if (ie->ino != ino || ino == 0 ||
+        ie->subvol != tree_subvol_current()) {
+        return 0;
+    }
+    return ie;
+}
+
+// Point the root tree at a new fs root. The change goes out with the
+// open transaction's commit. A root rewritten in place needs no update.
 static int fs_tree_update_fs_root(uint32_t new_root) {
+    fs_tree_gen++;
+    uint64_t subvol = tree_subvol_current();
+    uint64_t cur = 0;
+    uint64_t cur_subvol = 0;
+    if (btree_lookup(sb.root_tree, ROOT_ITEM_FS_ROOT, &cur) == 0 &&
+        cur == new_root &&
+        btree_lookup(sb.root_tree, ROOT_ITEM_SUBVOL_BASE + subvol,
+                     &cur_subvol) == 0 && cur_subvol == new_root) {
+        return 0;
+    }
+
     uint32_t root = sb.root_tree;
     if (btree_insert(root, ROOT_ITEM_FS_ROOT, new_root, &root) < 0) {
         return -1;
     }
-    uint64_t subvol = tree_subvol_current();
     if (subvol != 0) {
         if (btree_insert(root, ROOT_ITEM_SUBVOL_BASE + subvol, new_root,
                          &root) < 0) {
@@ -99,7 +350,7 @@ static int fs_tree_update_fs_root(uint32_t new_root) {
         }
     }
     sb.root_tree = root;
-    writesb();
+    txn_dirty();
     return 0;
 }
 
@@ -116,10 +367,19 @@ int fs_tree_set_parent(uint32_t ino, uint32_t parent) {
     if (fs_tree_update_fs_root(new_root) < 0) {
         return -1;
     }
+    dcache_set(ino, "", parent);
     return 0;
 }
 
 int fs_tree_get_parent(uint32_t ino, uint32_t *parent_out) {
+    uint32_t parent = 0;
+    if (dcache_get(ino, "", &parent)) {
+        if (parent == 0) {
+            return -1;
+        }
+        if (parent_out) *parent_out = parent;
+        return 0;
+    }
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
@@ -129,10 +389,27 @@ int fs_tree_get_parent(uint32_t ino, uint32_t *parent_out) {
                      &val) < 0) {
         return -1;
     }
+    dcache_set(ino, "", (uint32_t)val);
     if (parent_out) *parent_out = (uint32_t)val;
     return 0;
 }
 
+static int fs_tree_delete_item(uint64_t key) {
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint32_t new_root = 0;
+    if (btree_delete((uint32_t)fs_root, key, &new_root) < 0) {
+        return -1;
+    }
+    if (new_root == (uint32_t)fs_root) {
+        fs_tree_gen++;
+        return 0;
+    }
+    return fs_tree_update_fs_root(new_root);
+}
+
 void fs_tree_init(void) {
     tree_init();
     if (sb.root_tree == 0) {
@@ -149,6 +426,55 @@ void fs_tree_init(void) {
     }
 }
 
+// The extent ref tree counts references per block: one item per run of
+// blocks with the same count, keyed by the run's first block. File extent
+// items may map any part of a run, so a shared extent is split block by
+// block as its owners diverge. Blocks without an item predate the tree.
+
+// Cut the run straddling blk, if any, so that one starts there.
+static int extent_ref_cut(uint32_t *ref_root, uint32_t blk) {
+    uint64_t key = 0;
+    uint64_t val = 0;
+    if (blk == 0 || btree_lookup_le(*ref_root, blk - 1, &key, &val) < 0) {
+        return 0;
+    }
+    uint32_t len = 0;
+    uint32_t refs = 0;
+    extent_ref_unpack(val, &len, &refs);
+    if (key + len <= blk) {
+        return 0;
+    }
+    uint32_t head = blk - (uint32_t)key;
+    if (btree_insert(*ref_root, key, extent_ref_pack(head, refs),
+                     ref_root) < 0 ||
+        btree_insert(*ref_root, blk, extent_ref_pack(len - head, refs),
+                     ref_root) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// A run of blk..blk+len-1 gaining its first references: extend the run
+// before it when that ends at blk with the same count.
+static int extent_ref_add_run(uint32_t *ref_root, uint32_t blk, uint32_t len,
+                              uint32_t refs) {
+    uint64_t key = 0;
+    uint64_t val = 0;
+    uint32_t prev_len = 0;
+    uint32_t prev_refs = 0;
+    if (blk != 0 && btree_lookup_le(*ref_root, blk - 1, &key, &val) == 0) {
+        extent_ref_unpack(val, &prev_len, &prev_refs);
+        if (key + prev_len == blk && prev_refs == refs) {
+            return btree_insert(*ref_root, key,
+                                extent_ref_pack(prev_len + len, refs),
+                                ref_root);
+        }
+    }
+    return btree_insert(*ref_root, blk, extent_ref_pack(len, refs), ref_root);
+}
+
+// Add delta to the count of every block in start..start+len-1. Blocks
+// whose count drops to zero are freed with the next commit.
 static int extent_ref_update_root(uint32_t root, uint32_t start, uint32_t len,
                                   int delta, uint32_t *out_root) {
     uint64_t ref_root = 0;
@@ -167,32 +493,43 @@ static int extent_ref_update_root(uint32_t root, uint32_t start, uint32_t len,
         }
     }
 
-    uint64_t val = 0;
-    uint32_t cur_len = len;
-    uint32_t refs = 0;
-    if (btree_lookup((uint32_t)ref_root, start, &val) == 0 && val != 0) {
-        extent_ref_unpack(val, &cur_len, &refs);
-        if (cur_len != len) {
-            return -1;
-        }
-    }
-
-    int64_t new_refs = (int64_t)refs + delta;
-    if (new_refs < 0) {
+    uint32_t ref = (uint32_t)ref_root;
+    uint32_t end = start + len;
+    if (extent_ref_cut(&ref, start) < 0 || extent_ref_cut(&ref, end) < 0) {
         return -1;
     }
+    for (uint32_t b = start; b < end; ) {
+        uint64_t key = 0;
+        uint64_t val = 0;
+        uint32_t run = end - b;
+        uint32_t refs = 0;
+        if (btree_lookup_ge(ref, b, &key, &val) == 0 && key < end) {
+            if (key > b) {
+                run = (uint32_t)key - b;
+            } else {
+                extent_ref_unpack(val, &run, &refs);
+            }
+        }
 
-    uint64_t new_val = 0;
-    if (new_refs > 0) {
-        new_val = extent_ref_pack(len, (uint32_t)new_refs);
-    }
-
-    uint32_t new_ref_root = 0;
-    if (btree_insert((uint32_t)ref_root, start, new_val, &new_ref_root) < 0) {
-        return -1;
+        int64_t new_refs = (int64_t)refs + delta;
+        int rc = 0;
+        if (new_refs < 0 || (refs == 0 && delta < 0)) {
+            return -1;
+        } else if (refs == 0) {
+            rc = extent_ref_add_run(&ref, b, run, (uint32_t)new_refs);
+        } else if (new_refs == 0) {
+            rc = btree_delete(ref, b, &ref);
+            extent_free(b, run);
+        } else {
+            rc = btree_insert(ref, b, extent_ref_pack(run, (uint32_t)new_refs),
+                              &ref);
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        b += run;
     }
-    if (btree_insert(root, ROOT_ITEM_EXTENT_REF_ROOT,
-                     new_ref_root, &root) < 0) {
+    if (btree_insert(root, ROOT_ITEM_EXTENT_REF_ROOT, ref, &root) < 0) {
         return -1;
     }
 
@@ -202,6 +539,7 @@ static int extent_ref_update_root(uint32_t root, uint32_t start, uint32_t len,
     return 0;
 }
 
+// The highest count among blocks start..start+len-1.
 static int extent_ref_get(uint32_t root, uint32_t start, uint32_t len,
                           uint32_t *refs_out) {
     uint64_t ref_root = 0;
@@ -210,18 +548,94 @@ static int extent_ref_get(uint32_t root, uint32_t start, uint32_t len,
         if (refs_out) *refs_out = 1;
         return 0;
     }
+    uint32_t max = 0;
+    uint32_t b = start;
+    uint64_t key = 0;
     uint64_t val = 0;
-    uint32_t cur_len = len;
+    uint32_t run = 0;
     uint32_t refs = 0;
-    if (btree_lookup((uint32_t)ref_root, start, &val) == 0 && val != 0) {
-        extent_ref_unpack(val, &cur_len, &refs);
-        if (cur_len != len) {
-            return -1;
+    if (btree_lookup_le((uint32_t)ref_root, start, &key, &val) == 0) {
+        extent_ref_unpack(val, &run, &refs);
+        if (key + run > start) {
+            max = refs;
+            b = (uint32_t)key + run;
+        }
+    }
+    while (b < start + len &&
+           btree_lookup_ge((uint32_t)ref_root, b, &key, &val) == 0 &&
+           key < start + len) {
+        extent_ref_unpack(val, &run, &refs);
+        if (refs > max) {
+            max = refs;
         }
-        if (refs_out) *refs_out = refs;
+        b = (uint32_t)key + run;
+    }
+    if (refs_out) *refs_out = max ? max : 1;
+    return 0;
+}
+
+static int icache_writeback(struct icache_entry *ie);
+
+// Take ino's slot. A dirty entry holding it is written back first only
+// when writeback is allowed; otherwise the slot is left alone and 0 is
+// returned. Callers in the middle of building a new fs root must not
+// write back: that publishes a root of its own, which theirs then
+// overwrites, losing the evicted size.
+static struct icache_entry *icache_claim(uint32_t ino, int writeback) {
+    struct icache_entry *ie = icache_slot(ino);
+    if (ie->ino == ino && ie->subvol == tree_subvol_current()) {
+        return ie;
+    }
+    if (ie->dirty && (!writeback || icache_writeback(ie) < 0)) {
         return 0;
     }
-    if (refs_out) *refs_out = 1;
+    ie->map_gen = 0;
+    ie->ino = ino;
+    ie->subvol = tree_subvol_current();
+    return ie;
+}
+
+// Record an inode as the tree holds it, unless its slot holds another
+// inode's deferred size.
+static void icache_fill(uint32_t ino, uint16_t type, uint64_t size) {
+    struct icache_entry *ie = icache_claim(ino, 0);
+    if (ie) {
+        ie->type = type;
+        ie->size = size;
+        ie->dirty = 0;
+    }
+}
+
+// A new size for the tree to pick up later. Called once a write has
+// published its root, so an evicted entry may be written back here.
+static int icache_defer(uint32_t ino, uint16_t type, uint64_t size) {
+    struct icache_entry *ie = icache_claim(ino, 1);
+    if (ie == 0) {
+        return -1;
+    }
+    ie->type = type;
+    ie->size = size;
+    ie->dirty = 1;
+    txn_dirty();
+    return 0;
+}
+
+static void icache_drop(uint32_t ino) {
+    struct icache_entry *ie = icache_find(ino);
+    if (ie) {
+        ie->ino = 0;
+        ie->dirty = 0;
+    }
+}
+
+// Insert ino's inode item into the tree being built at *root.
+static int fs_tree_inode_put(uint32_t *root, uint32_t ino, uint16_t type,
+                             uint64_t size) {
+    if (btree_insert(*root, fs_item_key(ino, FS_ITEM_INODE, 0),
+                     inode_pack(type, size), root) < 0) {
+        return -1;
+    }
+    icache_fill(ino, type, size);
     return 0;
 }
 
@@ -231,9 +645,8 @@ int fs_tree_set_inode(uint32_t ino, uint16_t type, uint64_t size) {
         return -1;
     }
 
-    uint32_t new_root = 0;
-    if (btree_insert((uint32_t)fs_root, fs_item_key(ino, FS_ITEM_INODE, 0),
-                     inode_pack(type, size), &new_root) < 0) {
+    uint32_t new_root = (uint32_t)fs_root;
+    if (fs_tree_inode_put(&new_root, ino, type, size) < 0) {
         return -1;
     }
 
@@ -243,20 +656,112 @@ int fs_tree_set_inode(uint32_t ino, uint16_t type, uint64_t size) {
     return 0;
 }
 
-int fs_tree_get_inode(uint32_t ino, uint16_t *type_out, uint64_t *size_out) {
-    uint64_t fs_root = 0;
-    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+// Write a dirty entry to its own subvolume's tree.
+static int icache_writeback(struct icache_entry *ie) {
+    if (!ie->dirty) {
+        return 0;
+    }
+    uint64_t prev = tree_subvol_current();
+    if (ie->subvol != prev && tree_subvol_set_current(ie->subvol) < 0) {
         return -1;
     }
+    ie->dirty = 0;
+    int rc = fs_tree_set_inode(ie->ino, ie->type, ie->size);
+    if (rc < 0) {
+        ie->dirty = 1;
+    }
+    tree_subvol_set_current(prev);
+    return rc;
+}
+
+static int fs_tree_get_inode_in(uint32_t fs_root, uint32_t ino,
+                                uint16_t *type_out, uint64_t *size_out) {
     uint64_t val = 0;
-    if (btree_lookup((uint32_t)fs_root, fs_item_key(ino, FS_ITEM_INODE, 0),
-                     &val) < 0) {
+    if (btree_lookup(fs_root, fs_item_key(ino, FS_ITEM_INODE, 0), &val) < 0) {
         return -1;
     }
     inode_unpack(val, type_out, size_out);
     return 0;
 }
 
+int fs_tree_get_inode(uint32_t ino, uint16_t *type_out, uint64_t *size_out) {
+    struct icache_entry *ie = icache_find(ino);
+    if (ie) {
+        if (type_out) *type_out = ie->type;
+        if (size_out) *size_out = ie->size;
+    } else {
+        uint64_t fs_root = 0;
+        uint16_t type = 0;
+        uint64_t size = 0;
+        if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0 ||
+            fs_tree_get_inode_in((uint32_t)fs_root, ino, &type, &size) < 0) {
+            return -1;
+        }
+        icache_fill(ino, type, size);
+        if (type_out) *type_out = type;
+        if (size_out) *size_out = size;
+    }
+    struct delalloc_file *df = delalloc_file_find(ino);
+    if (df && size_out) {
+        *size_out = df->size;
+    }
+    return 0;
+}
+
+// Small files keep their data in the fs tree, next to the inode item, as
+// FS_ITEM_INLINE items of up to BTREE_ITEM_MAX bytes each. A file is
+// either inline or has extents, never both, and is only inline while its
+// size is at most FS_INLINE_MAX.
+#define FS_INLINE_MAX (4 * BTREE_ITEM_MAX)
+
+static uint64_t inline_key(uint32_t ino, uint32_t chunk) {
+    return fs_item_key(ino, FS_ITEM_INLINE, chunk);
+}
+
+// Copy bytes from..to-1 of ino's inline data to buf. Fails when the file
+// keeps its data in extents.
+static int fs_tree_inline_get(uint32_t fs_root, uint32_t ino, uint32_t from,
+                              uint32_t to, uint8_t *buf) {
+    uint8_t data[BTREE_ITEM_MAX];
+    for (uint32_t at = from; at < to; ) {
+        uint32_t len = 0;
+        if (btree_lookup_item(fs_root, inline_key(ino, at / BTREE_ITEM_MAX),
+                              0, data, sizeof(data), &len) < 0) {
+            return -1;
+        }
+        uint32_t boff = at % BTREE_ITEM_MAX;
+        uint32_t chunk = BTREE_ITEM_MAX - boff;
+        if (chunk > to - at) chunk = to - at;
+        if (boff + chunk > len) {
+            return -1;
+        }
+        memmove(buf + (at - from), data + boff, chunk);
+        at += chunk;
+    }
+    return 0;
+}
+
+// Make data[0..len-1] ino's inline data, rewriting only the items from
+// byte from on; the ones before it already hold those bytes.
+static int fs_tree_inline_put(uint32_t *fs_root, uint32_t ino,
+                              const uint8_t *data, uint32_t len,
+                              uint32_t from) {
+    uint32_t chunks = (len + BTREE_ITEM_MAX - 1) / BTREE_ITEM_MAX;
+    if (btree_delete_range(*fs_root, inline_key(ino, chunks),
+                           inline_key(ino, 0x0fffffff), 0, 0, fs_root) < 0) {
+        return -1;
+    }
+    for (uint32_t c = from / BTREE_ITEM_MAX; c < chunks; c++) {
+        uint32_t at = c * BTREE_ITEM_MAX;
+        uint32_t n = len - at < BTREE_ITEM_MAX ? len - at : BTREE_ITEM_MAX;
+        if (btree_insert_item(*fs_root, inline_key(ino, c), n, data + at, n,
+                              fs_root) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int fs_tree_root_ensure(void) {
     uint16_t type = 0;
     uint64_t size = 0;
@@ -393,7 +898,7 @@ int fs_tree_create_file_at(uint32_t start, const char *path, uint32_t *ino_out)
 
     ino = fs_tree_next_ino++;
     sb.fs_next_ino = fs_tree_next_ino;
-    writesb();
+    txn_dirty();
     if (fs_tree_set_inode(ino, T_FILE, 0) < 0) return -1;
     if (fs_tree_dir_add(parent, name, ino) < 0) return -1;
     if (fs_tree_set_parent(ino, parent) < 0) return -1;
@@ -432,7 +937,7 @@ int fs_tree_create_dir_at(uint32_t start, const char *path) {
 
     ino = fs_tree_next_ino++;
     sb.fs_next_ino = fs_tree_next_ino;
-    writesb();
+    txn_dirty();
     if (fs_tree_set_inode(ino, T_DIR, 0) < 0) return -1;
     if (fs_tree_dir_add(parent, name, ino) < 0) return -1;
     if (fs_tree_set_parent(ino, parent) < 0) return -1;
@@ -443,92 +948,152 @@ int fs_tree_create_dir(const char *path) {
     return fs_tree_create_dir_at(1, path);
 }
 
+// Find the entry of parent_ino called name: one seek to its hash, then a
+// look at each entry sharing it. free_out, if set, receives the first
+// unused slot of that hash, or 0 when all are taken; it is set even when
+// name is not found.
+static int fs_tree_dirent_lookup(uint32_t fs_root, uint32_t parent_ino,
+                                 const char *name, uint64_t *key_out,
+                                 uint64_t *val_out, uint64_t *free_out) {
+    uint32_t hash = name_hash(name);
+    uint64_t first = dirent_key(parent_ino, hash, 0);
+    uint64_t last = dirent_key(parent_ino, hash, DIRENT_SLOTS - 1);
+    uint64_t next = first;
+    char found[BTREE_ITEM_MAX + 1];
+    if (free_out) *free_out = 0;
+
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, fs_root, first); rc == 0;
+         rc = btree_cursor_next(&cur)) {
+        uint64_t key = 0;
+        uint64_t val = 0;
+        if (btree_cursor_get(&cur, &key, &val) < 0 || key > last) {
+            break;
+        }
+        if (free_out && *free_out == 0 && key != next) {
+            *free_out = next;
+        }
+        next = key + 1;
+        uint32_t dlen = 0;
+        const uint8_t *data = btree_cursor_data(&cur, &dlen);
+        if (dirent_name(val, data, dlen, found, sizeof(found)) == 0 &&
+            strncmp(found, name, sizeof(found)) == 0) {
+            if (key_out) *key_out = key;
+            if (val_out) *val_out = val;
+            return 0;
+        }
+    }
+    if (free_out && *free_out == 0 && next <= last) {
+        *free_out = next;
+    }
+
+    uint64_t key = dirent_key_legacy(parent_ino, name);
+    uint64_t val = 0;
+    uint8_t data[BTREE_ITEM_MAX];
+    uint32_t dlen = 0;
+    if (btree_lookup_item(fs_root, key, &val, data, sizeof(data),
+                          &dlen) < 0 ||
+        dirent_name(val, data, dlen, found, sizeof(found)) < 0 ||
+        strncmp(found, name, sizeof(found)) != 0) {
+        return -1;
+    }
+    if (key_out) *key_out = key;
+    if (val_out) *val_out = val;
+    return 0;
+}
+
 static int fs_tree_dir_remove(uint32_t parent_ino, const char *name) {
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
     }
 
+    uint64_t key = 0;
     uint64_t val = 0;
-    if (btree_lookup((uint32_t)fs_root, dirent_key(parent_ino, name), &val) < 0) {
+    if (fs_tree_dirent_lookup((uint32_t)fs_root, parent_ino, name, &key, &val,
+                              0) < 0) {
         return -1;
     }
 
+    // Older entries keep their name in a block of their own.
     uint32_t name_block = 0;
     dirent_unpack(val, 0, &name_block);
     if (name_block) {
         extent_free(name_block, 1);
-        if (extent_commit() < 0) {
-            return -1;
-        }
-    }
-
-    uint32_t new_root = 0;
-    uint64_t key = dirent_key(parent_ino, name);
-    if (btree_insert((uint32_t)fs_root, key, 0, &new_root) < 0) {
-        return -1;
     }
 
-    if (fs_tree_update_fs_root(new_root) < 0) {
+    if (fs_tree_delete_item(key) < 0) {
         return -1;
     }
+    dcache_set(parent_ino, name, 0);
     return 0;
 }
 
 int fs_tree_dir_add(uint32_t parent_ino, const char *name, uint32_t ino) {
+    // The name goes in the entry itself.
+    uint32_t len = 0;
+    while (name[len] && len <= BTREE_ITEM_MAX) {
+        len++;
+    }
+    if (len == 0 || len > BTREE_ITEM_MAX) {
+        return -1;
+    }
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
     }
 
-    struct extent ex;
-    if (extent_alloc(1, &ex) < 0) {
+    // An existing entry of that name is replaced, else the name takes the
+    // first free slot of its hash.
+    uint64_t key = 0;
+    uint64_t val = 0;
+    uint64_t slot = 0;
+    uint32_t name_block = 0;
+    if (fs_tree_dirent_lookup((uint32_t)fs_root, parent_ino, name, &key,
+                              &val, &slot) == 0) {
+        dirent_unpack(val, 0, &name_block);
+        if (name_block) {
+            extent_free(name_block, 1);
+        }
+    } else if (slot != 0) {
+        key = slot;
+    } else {
+        kprintf("fs_tree: too many names share the hash of %s\n", name);
         return -1;
     }
-    struct buf *bp = bread(ex.start);
-    memzero(bp->data, BSIZE);
-    uint32_t i = 0;
-    for (; i + 1 < BSIZE && name[i]; i++) {
-        bp->data[i] = (uint8_t)name[i];
-    }
-    bp->data[i] = 0;
-    bwrite(bp);
-    brelse(bp);
 
     uint32_t new_root = 0;
-    uint64_t key = dirent_key(parent_ino, name);
-    if (btree_insert((uint32_t)fs_root, key, dirent_pack(ino, ex.start),
-                     &new_root) < 0) {
+    if (btree_insert_item((uint32_t)fs_root, key, dirent_pack(ino, 0), name,
+                          len, &new_root) < 0) {
         return -1;
     }
 
     if (fs_tree_update_fs_root(new_root) < 0) {
         return -1;
     }
+    dcache_set(parent_ino, name, ino);
     return 0;
 }
 
-int fs_tree_dir_find_name(uint32_t parent_ino, uint32_t child_ino,
-                           char *name_out, uint32_t name_len) {
-    uint64_t fs_root = 0;
-    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
-        return -1;
-    }
-
+// The entry of parent_ino in the tree at fs_root that names child_ino.
+static int fs_tree_dirent_find(uint32_t fs_root, uint32_t parent_ino,
+                               uint32_t child_ino, uint64_t *key_out,
+                               uint64_t *val_out) {
     uint64_t base = fs_item_key(parent_ino, FS_ITEM_DIRENT, 0);
     uint64_t limit = fs_item_key(parent_ino, FS_ITEM_DIRENT, 0x0fffffff);
-    uint64_t cursor = base;
 
-    for (;;) {
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, fs_root, base); ;
+         rc = btree_cursor_next(&cur)) {
         uint64_t found_key = 0;
         uint64_t val = 0;
-        if (btree_lookup_ge((uint32_t)fs_root, cursor, &found_key, &val) < 0) {
+        if (rc < 0) {
             return -1;
         }
+        btree_cursor_get(&cur, &found_key, &val);
         if (found_key > limit) {
             return -1;
         }
-        cursor = found_key + 1;
 
         uint32_t key_ino = 0;
         uint16_t key_type = 0;
@@ -537,55 +1102,62 @@ int fs_tree_dir_find_name(uint32_t parent_ino, uint32_t child_ino,
         if (key_ino != parent_ino || key_type != FS_ITEM_DIRENT) {
             continue;
         }
-        if (val == 0) {
-            continue;
-        }
 
         uint32_t ino = 0;
-        uint32_t name_block = 0;
-        dirent_unpack(val, &ino, &name_block);
-        if (ino != child_ino || name_block == 0) {
+        uint32_t dlen = 0;
+        const uint8_t *data = btree_cursor_data(&cur, &dlen);
+        dirent_unpack(val, &ino, 0);
+        if (ino != child_ino || dirent_name(val, data, dlen, 0, 0) < 0) {
             continue;
         }
-
-        struct buf *bp = bread(name_block);
-        if (name_out && name_len > 0) {
-            uint32_t i;
-            for (i = 0; i + 1 < name_len && i < BSIZE; i++) {
-                name_out[i] = (char)bp->data[i];
-                if (bp->data[i] == 0) break;
-            }
-            if (i + 1 >= name_len) {
-                name_out[name_len - 1] = 0;
-            }
-        }
-        brelse(bp);
+        if (key_out) *key_out = found_key;
+        if (val_out) *val_out = val;
         return 0;
     }
 }
 
-int fs_tree_dir_lookup(uint32_t parent_ino, const char *name, uint32_t *ino_out) {
+int fs_tree_dir_find_name(uint32_t parent_ino, uint32_t child_ino,
+                           char *name_out, uint32_t name_len) {
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
     }
+
+    uint64_t key = 0;
     uint64_t val = 0;
-    if (btree_lookup((uint32_t)fs_root, dirent_key(parent_ino, name), &val) < 0) {
+    uint8_t data[BTREE_ITEM_MAX];
+    uint32_t dlen = 0;
+    if (fs_tree_dirent_find((uint32_t)fs_root, parent_ino, child_ino, &key,
+                            0) < 0 ||
+        btree_lookup_item((uint32_t)fs_root, key, &val, data, sizeof(data),
+                          &dlen) < 0) {
         return -1;
     }
+    return dirent_name(val, data, dlen, name_out, name_len);
+}
 
+int fs_tree_dir_lookup(uint32_t parent_ino, const char *name, uint32_t *ino_out) {
     uint32_t ino = 0;
-    uint32_t name_block = 0;
-    dirent_unpack(val, &ino, &name_block);
-    if (name_block == 0) return -1;
-
-    struct buf *bp = bread(name_block);
-    int match = (strncmp((const char *)bp->data, name, BSIZE) == 0);
-    brelse(bp);
-    if (!match) {
+    if (dcache_get(parent_ino, name, &ino)) {
+        if (ino == 0) {
+            return -1;
+        }
+        if (ino_out) *ino_out = ino;
+        return 0;
+    }
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
     }
-
+    uint64_t val = 0;
+    if (fs_tree_dirent_lookup((uint32_t)fs_root, parent_ino, name, 0, &val,
+                              0) < 0) {
+        dcache_set(parent_ino, name, 0);
+        return -1;
+    }
+    dirent_unpack(val, &ino, 0);
+    dcache_set(parent_ino, name, ino);
+
     if (ino_out) {
         *ino_out = ino;
     }
@@ -600,18 +1172,19 @@ static int fs_tree_dir_empty(uint32_t ino) {
 
     uint64_t base = fs_item_key(ino, FS_ITEM_DIRENT, 0);
     uint64_t limit = fs_item_key(ino, FS_ITEM_DIRENT, 0x0fffffff);
-    uint64_t cursor = base;
 
-    for (;;) {
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, (uint32_t)fs_root, base); ;
+         rc = btree_cursor_next(&cur)) {
         uint64_t found_key = 0;
         uint64_t val = 0;
-        if (btree_lookup_ge((uint32_t)fs_root, cursor, &found_key, &val) < 0) {
+        if (rc < 0) {
             return 1;
         }
+        btree_cursor_get(&cur, &found_key, &val);
         if (found_key > limit) {
             return 1;
         }
-        cursor = found_key + 1;
 
         uint32_t key_ino = 0;
         uint16_t key_type = 0;
@@ -620,64 +1193,46 @@ static int fs_tree_dir_empty(uint32_t ino) {
         if (key_ino != ino || key_type != FS_ITEM_DIRENT) {
             continue;
         }
-        if (val == 0) {
-            continue;
-        }
         return 0;
     }
 }
 
+// Range delete callback: release one file extent. arg is the root tree
+// being updated with the extent ref changes; blocks other files still
+// map stay.
+static int fs_tree_release_extent(uint64_t key, uint64_t val, void *arg) {
+    (void)key;
+    uint32_t *root = (uint32_t *)arg;
+    uint32_t start = 0, len = 0;
+    extent_unpack(val, &start, &len);
+    return extent_ref_update_root(*root, start, len, -1, root);
+}
+
+// Drop a file's data: its extents, or its inline items.
 static int fs_tree_drop_extents(uint32_t ino) {
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
     }
 
-    uint64_t base = fs_item_key(ino, FS_ITEM_EXTENT, 0);
-    uint64_t limit = fs_item_key(ino, FS_ITEM_EXTENT, 0x0fffffff);
-    uint64_t cursor = base;
-    uint32_t new_root = (uint32_t)fs_root;
-
+    uint32_t new_root = 0;
     uint32_t root = sb.root_tree;
-    for (;;) {
-        uint64_t found_key = 0;
-        uint64_t val = 0;
-        if (btree_lookup_ge(new_root, cursor, &found_key, &val) < 0) {
-            break;
-        }
-        if (found_key > limit) {
-            break;
-        }
-        cursor = found_key + 1;
-
-        uint32_t key_ino = 0;
-        uint16_t key_type = 0;
-        uint32_t key_block = 0;
-        extent_key_unpack(found_key, &key_ino, &key_type, &key_block);
-        if (key_ino != ino || key_type != FS_ITEM_EXTENT) {
-            continue;
-        }
-        if (val == 0) {
-            continue;
-        }
-
-        uint32_t start = 0, len = 0;
-        extent_unpack(val, &start, &len);
-        if (extent_ref_update_root(root, start, len, -1, &root) < 0) {
-            return -1;
-        }
-        extent_free(start, len);
-
-        if (btree_insert(new_root, found_key, 0, &new_root) < 0) {
-            return -1;
-        }
+    if (btree_delete_range((uint32_t)fs_root,
+                           fs_item_key(ino, FS_ITEM_EXTENT, 0),
+                           fs_item_key(ino, FS_ITEM_EXTENT, 0x0fffffff),
+                           fs_tree_release_extent, &root, &new_root) < 0 ||
+        fs_tree_inline_put(&new_root, ino, 0, 0, 0) < 0) {
+        return -1;
     }
+    sb.root_tree = root;
     if (fs_tree_update_fs_root(new_root) < 0) {
         return -1;
     }
-    return extent_commit();
+    return 0;
 }
 
+static void fs_tree_log_forget(uint32_t parent, uint32_t ino);
+
 int fs_tree_unlink_path_at(uint32_t start, const char *path) {
     uint32_t parent = 0;
     char name[32];
@@ -707,15 +1262,19 @@ int fs_tree_unlink_path_at(uint32_t start, const char *path) {
     }
 
     if (type == T_FILE) {
+        delalloc_release(ino);
         if (fs_tree_drop_extents(ino) < 0) {
             return -1;
         }
     }
 
-    if (fs_tree_set_inode(ino, T_UNUSED, 0) < 0) {
+    if (fs_tree_delete_item(fs_item_key(ino, FS_ITEM_INODE, 0)) < 0) {
         return -1;
     }
-    fs_tree_set_parent(ino, 0);
+    icache_drop(ino);
+    fs_tree_delete_item(fs_item_key(ino, FS_ITEM_PARENT, 0));
+    dcache_set(ino, "", 0);
+    fs_tree_log_forget(parent, ino);
 
     return 0;
 }
@@ -759,27 +1318,25 @@ int fs_tree_rename_path(const char *oldpath, const char *newpath) {
     return fs_tree_rename_path_at(1, oldpath, newpath);
 }
 
-int fs_tree_readdir(uint32_t parent_ino, uint64_t *cookie,
-                    char *name_out, uint32_t name_len, uint32_t *ino_out) {
-    uint64_t fs_root = 0;
-    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
-        return -1;
-    }
-
+static int fs_tree_readdir_in(uint32_t fs_root, uint32_t parent_ino,
+                              uint64_t *cookie, char *name_out,
+                              uint32_t name_len, uint32_t *ino_out) {
     uint64_t base = fs_item_key(parent_ino, FS_ITEM_DIRENT, 0);
     uint64_t limit = fs_item_key(parent_ino, FS_ITEM_DIRENT, 0x0fffffff);
-    uint64_t cursor = (cookie && *cookie > base) ? *cookie : base;
+    uint64_t pos = (cookie && *cookie > base) ? *cookie : base;
 
-    for (;;) {
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, fs_root, pos); ;
+         rc = btree_cursor_next(&cur)) {
         uint64_t found_key = 0;
         uint64_t val = 0;
-        if (btree_lookup_ge((uint32_t)fs_root, cursor, &found_key, &val) < 0) {
+        if (rc < 0) {
             return -1;
         }
+        btree_cursor_get(&cur, &found_key, &val);
         if (found_key > limit) {
             return -1;
         }
-        cursor = found_key + 1;
 
         uint32_t key_ino = 0;
         uint16_t key_type = 0;
@@ -788,36 +1345,33 @@ int fs_tree_readdir(uint32_t parent_ino, uint64_t *cookie,
         if (key_ino != parent_ino || key_type != FS_ITEM_DIRENT) {
             continue;
         }
-        if (val == 0) {
-            continue;
-        }
 
         uint32_t ino = 0;
-        uint32_t name_block = 0;
-        dirent_unpack(val, &ino, &name_block);
-        if (name_block == 0) {
+        uint32_t dlen = 0;
+        const uint8_t *data = btree_cursor_data(&cur, &dlen);
+        dirent_unpack(val, &ino, 0);
+        if (dirent_name(val, data, dlen, name_out, name_len) < 0) {
             continue;
         }
 
-        struct buf *bp = bread(name_block);
-        if (name_out && name_len > 0) {
-            uint32_t i;
-            for (i = 0; i + 1 < name_len && i < BSIZE; i++) {
-                name_out[i] = (char)bp->data[i];
-                if (bp->data[i] == 0) break;
-            }
-            if (i + 1 >= name_len) {
-                name_out[name_len - 1] = 0;
-            }
-        }
-        brelse(bp);
-
         if (ino_out) *ino_out = ino;
-        if (cookie) *cookie = cursor;
+        if (cookie) *cookie = found_key + 1;
         return 0;
     }
 }
 
+int fs_tree_readdir(uint32_t parent_ino, uint64_t *cookie,
+                    char *name_out, uint32_t name_len, uint32_t *ino_out) {
+    struct tree_snapshot snap;
+    if (tree_read_begin_open(&snap) < 0) {
+        return -1;
+    }
+    int r = fs_tree_readdir_in(snap.fs_root, parent_ino, cookie, name_out,
+                               name_len, ino_out);
+    tree_read_end(&snap);
+    return r;
+}
+
 int fs_tree_readdir_path_at(uint32_t start, const char *path, uint64_t *cookie,
                             char *name_out, uint32_t name_len,
                             uint32_t *ino_out) {
@@ -835,6 +1389,10 @@ int fs_tree_clone_path_at(uint32_t start, const char *src, const char *dst) {
         return -1;
     }
 
+    if (fs_tree_writeback(src_ino) < 0) {
+        return -1;
+    }
+
     uint16_t src_type = 0;
     uint64_t src_size = 0;
     if (fs_tree_get_inode(src_ino, &src_type, &src_size) < 0 ||
@@ -854,33 +1412,45 @@ int fs_tree_clone_path_at(uint32_t start, const char *src, const char *dst) {
         return -1;
     }
 
+    // Extents are shared; inline data is copied along with the items.
     uint64_t base = fs_item_key(src_ino, FS_ITEM_EXTENT, 0);
-    uint64_t limit = fs_item_key(src_ino, FS_ITEM_EXTENT, 0x0fffffff);
-    uint64_t cursor = base;
+    uint64_t limit = inline_key(src_ino, 0x0fffffff);
 
     uint32_t new_root = (uint32_t)fs_root;
     uint32_t root = sb.root_tree;
 
+    // The cursor walks the tree the inserts below copy from: keep them
+    // from rewriting its nodes in place.
+    btree_reader_enter();
+    int err = 0;
     uint32_t iter = 0;
-    for (;;) {
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, (uint32_t)fs_root, base); !err;
+         rc = btree_cursor_next(&cur)) {
         uint64_t found_key = 0;
         uint64_t val = 0;
-        if (btree_lookup_ge((uint32_t)fs_root, cursor, &found_key, &val) < 0) {
+        if (rc < 0) {
             break;
         }
+        btree_cursor_get(&cur, &found_key, &val);
         if (found_key > limit) {
             break;
         }
-        cursor = found_key + 1;
 
         uint32_t key_ino = 0;
         uint16_t key_type = 0;
         uint32_t key_block = 0;
         extent_key_unpack(found_key, &key_ino, &key_type, &key_block);
-        if (key_ino != src_ino || key_type != FS_ITEM_EXTENT) {
+        if (key_ino == src_ino && key_type == FS_ITEM_INLINE) {
+            uint32_t dlen = 0;
+            const uint8_t *data = btree_cursor_data(&cur, &dlen);
+            if (btree_insert_item(new_root, inline_key(dst_ino, key_block),
+                                  val, data, dlen, &new_root) < 0) {
+                err = 1;
+            }
             continue;
         }
-        if (val == 0) {
+        if (key_ino != src_ino || key_type != FS_ITEM_EXTENT) {
             continue;
         }
 
@@ -890,20 +1460,21 @@ int fs_tree_clone_path_at(uint32_t start, const char *src, const char *dst) {
         kprintf("fs_tree_clone: extent key_block=%u start=%u len=%u\n",
                 key_block, start_blk, len);
         if (btree_insert(new_root, extent_key(dst_ino, (uint64_t)key_block * BSIZE),
-                         val, &new_root) < 0) {
-            return -1;
-        }
-        if (extent_ref_update_root(root, start_blk, len, 1, &root) < 0) {
-            return -1;
+                         val, &new_root) < 0 ||
+            extent_ref_update_root(root, start_blk, len, 1, &root) < 0) {
+            err = 1;
         }
         if (++iter > 1000000) {
             kprintf("fs_tree_clone: abort loop\n");
-            return -1;
+            err = 1;
         }
     }
+    btree_reader_exit();
+    if (err) {
+        return -1;
+    }
 
-    if (btree_insert(new_root, fs_item_key(dst_ino, FS_ITEM_INODE, 0),
-                     inode_pack(src_type, src_size), &new_root) < 0) {
+    if (fs_tree_inode_put(&new_root, dst_ino, src_type, src_size) < 0) {
         return -1;
     }
     sb.root_tree = root;
@@ -914,7 +1485,9 @@ int fs_tree_clone_path_at(uint32_t start, const char *src, const char *dst) {
     return 0;
 }
 
-int fs_tree_extent_add(uint32_t ino, uint64_t file_off, uint32_t start, uint32_t len) {
+static int fs_tree_extent_insert(uint32_t ino, uint64_t file_off,
+                                 uint32_t start, uint32_t len,
+                                 uint32_t flags) {
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
@@ -922,7 +1495,7 @@ int fs_tree_extent_add(uint32_t ino, uint64_t file_off, uint32_t start, uint32_t
 
     uint32_t new_root = 0;
     if (btree_insert((uint32_t)fs_root, extent_key(ino, file_off),
-                     extent_pack(start, len), &new_root) < 0) {
+                     extent_pack(start, len | flags), &new_root) < 0) {
         return -1;
     }
 
@@ -937,6 +1510,10 @@ int fs_tree_extent_add(uint32_t ino, uint64_t file_off, uint32_t start, uint32_t
     return 0;
 }
 
+int fs_tree_extent_add(uint32_t ino, uint64_t file_off, uint32_t start, uint32_t len) {
+    return fs_tree_extent_insert(ino, file_off, start, len, 0);
+}
+
 int fs_tree_extent_lookup(uint32_t ino, uint64_t file_off,
                           uint32_t *start_out, uint32_t *len_out) {
     uint64_t fs_root = 0;
@@ -951,18 +1528,14 @@ int fs_tree_extent_lookup(uint32_t ino, uint64_t file_off,
     return 0;
 }
 
-static int fs_tree_extent_find(uint32_t ino, uint64_t file_off,
-                               uint32_t *start_out, uint32_t *len_out,
-                               uint64_t *ext_off_out) {
-    uint64_t fs_root = 0;
-    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
-        return -1;
-    }
-
+static int fs_tree_extent_find(uint32_t fs_root, uint32_t ino,
+                               uint64_t file_off, uint32_t *start_out,
+                               uint32_t *len_out, uint64_t *ext_off_out,
+                               uint32_t *flags_out) {
     uint64_t key = extent_key(ino, file_off);
     uint64_t found_key = 0;
     uint64_t val = 0;
-    if (btree_lookup_le((uint32_t)fs_root, key, &found_key, &val) < 0) {
+    if (btree_lookup_le(fs_root, key, &found_key, &val) < 0) {
         return -1;
     }
 
@@ -985,201 +1558,1108 @@ static int fs_tree_extent_find(uint32_t ino, uint64_t file_off,
     if (start_out) *start_out = start;
     if (len_out) *len_out = len;
     if (ext_off_out) *ext_off_out = ext_off;
+    if (flags_out) *flags_out = extent_flags(val);
     return 0;
 }
 
-int fs_tree_truncate(uint32_t ino, uint64_t newsize) {
-    uint16_t type = 0;
-    uint64_t size = 0;
-    if (fs_tree_get_inode(ino, &type, &size) < 0) {
+// The file's last extent that starts before file_off.
+static int fs_tree_extent_prev(uint32_t fs_root, uint32_t ino,
+                               uint64_t file_off, uint64_t *key_out,
+                               uint32_t *start_out, uint32_t *len_out,
+                               uint64_t *ext_off_out, uint32_t *flags_out) {
+    if (file_off < BSIZE) {
         return -1;
     }
-    if (type != T_FILE) {
+    uint64_t found_key = 0;
+    uint64_t val = 0;
+    if (btree_lookup_le(fs_root, extent_key(ino, file_off - BSIZE),
+                        &found_key, &val) < 0) {
         return -1;
     }
-    if (newsize > size) {
+
+    uint32_t key_ino = 0;
+    uint16_t key_type = 0;
+    uint32_t key_block = 0;
+    extent_key_unpack(found_key, &key_ino, &key_type, &key_block);
+    if (key_ino != ino || key_type != FS_ITEM_EXTENT) {
         return -1;
     }
-    if (newsize == size) {
-        return 0;
+    if (key_out) *key_out = found_key;
+    extent_unpack(val, start_out, len_out);
+    if (ext_off_out) *ext_off_out = (uint64_t)key_block * (uint64_t)BSIZE;
+    if (flags_out) *flags_out = extent_flags(val);
+    return 0;
+}
+
+// Extend the extent item at key in place to new_len blocks; the blocks
+// added are this file's alone.
+static int fs_tree_extent_grow(uint32_t fs_root, uint64_t key, uint32_t start,
+                               uint32_t len, uint32_t new_len, uint32_t flags) {
+    uint32_t root = sb.root_tree;
+    if (extent_ref_update_root(root, start + len, new_len - len, 1,
+                               &root) < 0) {
+        return -1;
+    }
+
+    uint32_t new_root = 0;
+    if (btree_insert(fs_root, key, extent_pack(start, new_len | flags),
+                     &new_root) < 0) {
+        return -1;
+    }
+    sb.root_tree = root;
+    return fs_tree_update_fs_root(new_root);
+}
+
+// Give file blocks fblock..fblock+blocks-1 a new extent, aiming just past
+// the file's previous extent; when that works out and the two agree on
+// flags, grow the extent instead of adding another item. Returns the
+// extent now covering fblock.
+static int fs_tree_extent_place(uint32_t ino, uint32_t fblock, uint32_t blocks,
+                                uint32_t flags, uint32_t *start_out,
+                                uint32_t *len_out, uint64_t *ext_off_out) {
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint64_t ext_off = (uint64_t)fblock * BSIZE;
+    uint64_t prev_key = 0;
+    uint64_t prev_off = 0;
+    uint32_t start = 0, len = 0;
+    uint32_t prev_flags = 0;
+    uint32_t goal = 0;
+    if (fs_tree_extent_prev((uint32_t)fs_root, ino, ext_off, &prev_key,
+                            &start, &len, &prev_off, &prev_flags) == 0) {
+        goal = start + len;
+    }
+
+    struct extent ex;
+    if (extent_alloc_near(goal, blocks, &ex) < 0) {
+        return -1;
+    }
+    if (goal != 0 && ex.start == goal && prev_flags == flags &&
+        prev_off + (uint64_t)len * BSIZE == ext_off &&
+        fs_tree_extent_grow((uint32_t)fs_root, prev_key, start, len,
+                            len + ex.len, flags) == 0) {
+        len += ex.len;
+        ext_off = prev_off;
+    } else {
+        if (fs_tree_extent_insert(ino, ext_off, ex.start, ex.len, flags) < 0) {
+            return -1;
+        }
+        start = ex.start;
+        len = ex.len;
+    }
+
+    if (start_out) *start_out = start;
+    if (len_out) *len_out = len;
+    if (ext_off_out) *ext_off_out = ext_off;
+    return 0;
+}
+
+// Move the len bytes of an inline file into a block of its own, for a
+// file about to outgrow its items.
+static int fs_tree_inline_convert(uint32_t ino, const uint8_t *data,
+                                  uint32_t len) {
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint32_t new_root = (uint32_t)fs_root;
+    if (fs_tree_inline_put(&new_root, ino, 0, 0, 0) < 0 ||
+        fs_tree_update_fs_root(new_root) < 0) {
+        return -1;
+    }
+    uint32_t start = 0;
+    if (fs_tree_extent_place(ino, 0, 1, 0, &start, 0, 0) < 0) {
+        return -1;
     }
+    struct buf *bp = bread(start);
+    memzero(bp->data, BSIZE);
+    memmove(bp->data, data, len);
+    bwrite(bp);
+    brelse(bp);
+    return 0;
+}
 
+// Split the extent item covering file block fblock so that one starts
+// there. Block counts are unchanged: the halves map the same blocks.
+static int fs_tree_extent_split(uint32_t ino, uint32_t fblock) {
     uint64_t fs_root = 0;
     if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
         return -1;
     }
+    uint32_t start = 0, len = 0, flags = 0;
+    uint64_t ext_off = 0;
+    if (fs_tree_extent_find((uint32_t)fs_root, ino, (uint64_t)fblock * BSIZE,
+                            &start, &len, &ext_off, &flags) < 0 ||
+        ext_off == (uint64_t)fblock * BSIZE) {
+        return 0;
+    }
 
+    uint32_t head = fblock - (uint32_t)(ext_off / BSIZE);
     uint32_t new_root = (uint32_t)fs_root;
-    uint32_t root = sb.root_tree;
-    uint64_t base = fs_item_key(ino, FS_ITEM_EXTENT, 0);
-    uint64_t limit = fs_item_key(ino, FS_ITEM_EXTENT, 0x0fffffff);
-    uint64_t cursor = base;
+    if (btree_insert(new_root, extent_key(ino, ext_off),
+                     extent_pack(start, head | flags), &new_root) < 0 ||
+        btree_insert(new_root, extent_key(ino, (uint64_t)fblock * BSIZE),
+                     extent_pack(start + head, (len - head) | flags),
+                     &new_root) < 0) {
+        return -1;
+    }
+    return fs_tree_update_fs_root(new_root);
+}
 
-    for (;;) {
-        uint64_t found_key = 0;
-        uint64_t val = 0;
-        if (btree_lookup_ge(new_root, cursor, &found_key, &val) < 0) {
-            break;
-        }
-        if (found_key > limit) {
-            break;
+// Mark file blocks fblock..fblock+n-1 of an unwritten extent as written.
+// The written part joins the extent before it when the two are adjacent
+// on disk, so a preallocated file filled front to back stays one extent.
+static int fs_tree_extent_convert(uint32_t ino, uint32_t fblock, uint32_t n) {
+    if (fs_tree_extent_split(ino, fblock) < 0 ||
+        fs_tree_extent_split(ino, fblock + n) < 0) {
+        return -1;
+    }
+
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint64_t ext_off = (uint64_t)fblock * BSIZE;
+    uint32_t start = 0, len = 0;
+    if (fs_tree_extent_find((uint32_t)fs_root, ino, ext_off, &start, &len,
+                            0, 0) < 0) {
+        return -1;
+    }
+
+    uint64_t prev_key = 0;
+    uint64_t prev_off = 0;
+    uint32_t prev_start = 0, prev_len = 0, prev_flags = 0;
+    uint32_t new_root = (uint32_t)fs_root;
+    if (fs_tree_extent_prev(new_root, ino, ext_off, &prev_key, &prev_start,
+                            &prev_len, &prev_off, &prev_flags) == 0 &&
+        prev_flags == 0 && prev_start + prev_len == start &&
+        prev_off + (uint64_t)prev_len * BSIZE == ext_off) {
+        if (btree_delete(new_root, extent_key(ino, ext_off), &new_root) < 0 ||
+            btree_insert(new_root, prev_key,
+                         extent_pack(prev_start, prev_len + len),
+                         &new_root) < 0) {
+            return -1;
         }
-        cursor = found_key + 1;
+    } else if (btree_insert(new_root, extent_key(ino, ext_off),
+                            extent_pack(start, len), &new_root) < 0) {
+        return -1;
+    }
+    return fs_tree_update_fs_root(new_root);
+}
 
-        uint32_t key_ino = 0;
-        uint16_t key_type = 0;
-        uint32_t key_block = 0;
-        extent_key_unpack(found_key, &key_ino, &key_type, &key_block);
-        if (key_ino != ino || key_type != FS_ITEM_EXTENT) {
-            continue;
+// The first block at or after fblock, up to limit, that some extent of the
+// file covers.
+static uint32_t fs_tree_hole_end(uint32_t fs_root, uint32_t ino,
+                                 uint32_t fblock, uint32_t limit) {
+    uint64_t found_key = 0;
+    if (btree_lookup_ge(fs_root, extent_key(ino, (uint64_t)fblock * BSIZE),
+                        &found_key, 0) < 0) {
+        return limit;
+    }
+    uint32_t key_ino = 0;
+    uint16_t key_type = 0;
+    uint32_t key_block = 0;
+    extent_key_unpack(found_key, &key_ino, &key_type, &key_block);
+    if (key_ino != ino || key_type != FS_ITEM_EXTENT || key_block > limit) {
+        return limit;
+    }
+    return key_block;
+}
+
+// fs_tree_extent_find for the read and write loops, through the mapping
+// cached with ino's inode: sequential I/O looks each extent or hole up
+// once. fs_root must be the tree as of gen; the cache is only used while
+// gen is current.
+static int fs_tree_extent_map(uint32_t fs_root, uint64_t gen, uint32_t ino,
+                              uint64_t file_off, uint32_t *start_out,
+                              uint32_t *len_out, uint64_t *ext_off_out,
+                              uint32_t *flags_out) {
+    struct icache_entry *ie = gen == fs_tree_gen ? icache_find(ino) : 0;
+    uint32_t fblock = (uint32_t)(file_off / BSIZE);
+    if (ie == 0 || ie->map_gen != gen || fblock < ie->map_fblock ||
+        fblock - ie->map_fblock >= ie->map_blocks) {
+        uint32_t start = 0, len = 0, flags = 0;
+        uint64_t ext_off = 0;
+        int rc = fs_tree_extent_find(fs_root, ino, file_off, &start, &len,
+                                     &ext_off, &flags);
+        if (ie == 0) {
+            if (start_out) *start_out = start;
+            if (len_out) *len_out = len;
+            if (ext_off_out) *ext_off_out = ext_off;
+            if (flags_out) *flags_out = flags;
+            return rc;
         }
-        if (val == 0) {
-            continue;
+        ie->map_gen = gen;
+        if (rc == 0) {
+            ie->map_fblock = (uint32_t)(ext_off / BSIZE);
+            ie->map_blocks = len;
+            ie->map_start = start;
+            ie->map_flags = flags;
+        } else {
+            ie->map_fblock = fblock;
+            ie->map_blocks = fs_tree_hole_end(fs_root, ino, fblock,
+                                              0x0fffffff) - fblock;
+            ie->map_start = 0;
         }
+    }
+    if (ie->map_start == 0) {
+        return -1;
+    }
+    if (start_out) *start_out = ie->map_start;
+    if (len_out) *len_out = ie->map_blocks;
+    if (ext_off_out) *ext_off_out = (uint64_t)ie->map_fblock * BSIZE;
+    if (flags_out) *flags_out = ie->map_flags;
+    return 0;
+}
 
-        uint64_t ext_off = (uint64_t)key_block * (uint64_t)BSIZE;
-        uint32_t start = 0, len = 0;
-        extent_unpack(val, &start, &len);
-        uint64_t ext_end = ext_off + (uint64_t)len * (uint64_t)BSIZE;
-
-        if (ext_off >= newsize) {
-            if (extent_ref_update_root(root, start, len, -1, &root) < 0) {
-                return -1;
+// Buffer n bytes at pos, all within one hole block. Fails when no page can
+// be had, leaving the caller to allocate directly.
+static int delalloc_write(uint32_t ino, uint16_t type, uint64_t size,
+                          uint64_t pos, const uint8_t *src, uint32_t n) {
+    uint32_t fblock = (uint32_t)(pos / BSIZE);
+    struct delalloc_page *pg = delalloc_page_find(ino, fblock);
+    if (pg == 0) {
+        for (int pass = 0; pass < 2 && pg == 0; pass++) {
+            for (int i = 0; i < DELALLOC_PAGES; i++) {
+                if (delalloc_pages[i].ino == 0) {
+                    pg = &delalloc_pages[i];
+                    break;
+                }
             }
-            extent_free(start, len);
-            if (btree_insert(new_root, found_key, 0, &new_root) < 0) {
+            if (pg == 0 && (pass > 0 || fs_tree_writeback(0) < 0)) {
                 return -1;
             }
-            continue;
         }
-
-        if (ext_end > newsize) {
-            uint64_t keep_bytes = newsize - ext_off;
-            uint32_t keep_len = (uint32_t)((keep_bytes + BSIZE - 1) / BSIZE);
-            if (keep_len == 0) {
-                keep_len = 1;
+        pg->data = kalloc();
+        if (pg->data == 0) {
+            return -1;
+        }
+        pg->ino = ino;
+        pg->subvol = tree_subvol_current();
+        pg->fblock = fblock - fblock % DELALLOC_BLOCKS;
+        pg->valid = 0;
+    }
+
+    struct delalloc_file *df = delalloc_file_find(ino);
+    if (df == 0) {
+        struct delalloc_file *victim = 0;
+        for (int i = 0; i < DELALLOC_FILES && df == 0; i++) {
+            if (delalloc_files[i].ino == 0) {
+                df = &delalloc_files[i];
+            } else if (delalloc_files[i].subvol == tree_subvol_current()) {
+                victim = &delalloc_files[i];
             }
-            if (keep_len < len) {
-                uint32_t tail_start = start + keep_len;
-                uint32_t tail_len = len - keep_len;
-                if (extent_ref_update_root(root, tail_start, tail_len, -1, &root) < 0) {
-                    return -1;
-                }
-                extent_free(tail_start, tail_len);
+        }
+        // Make room by writing back some other file.
+        if (df == 0 && victim && fs_tree_writeback(victim->ino) == 0) {
+            df = victim;
+        }
+        if (df == 0) {
+            delalloc_discard(ino, 0);
+            return -1;
+        }
+        df->ino = ino;
+        df->subvol = tree_subvol_current();
+        df->type = type;
+        df->size = size;
+    }
 
-                if (btree_insert(new_root, found_key,
-                                 extent_pack(start, keep_len),
-                                 &new_root) < 0) {
-                    return -1;
-                }
-            }
+    uint32_t i = fblock % DELALLOC_BLOCKS;
+    uint8_t *blk = pg->data + i * BSIZE;
+    if (!(pg->valid & (1u << i))) {
+        memzero(blk, BSIZE);
+        pg->valid |= 1u << i;
+    }
+    memmove(blk + pos % BSIZE, src, n);
+    txn_dirty(); // The next commit writes it back
+    return 0;
+}
 
-            uint32_t tail_off = (uint32_t)(keep_bytes % BSIZE);
-            if (tail_off != 0) {
-                uint32_t blockno = start + keep_len - 1;
-                struct buf *bp = bread(blockno);
-                memzero(bp->data + tail_off, BSIZE - tail_off);
-                bwrite(bp);
-                brelse(bp);
+// The lowest buffered block of ino at or after fblock.
+static int delalloc_next(uint32_t ino, uint32_t fblock, uint32_t *out) {
+    int found = 0;
+    for (int i = 0; i < DELALLOC_PAGES; i++) {
+        struct delalloc_page *pg = &delalloc_pages[i];
+        if (pg->ino != ino || pg->subvol != tree_subvol_current()) {
+            continue;
+        }
+        for (uint32_t b = 0; b < DELALLOC_BLOCKS; b++) {
+            uint32_t fb = pg->fblock + b;
+            if ((pg->valid & (1u << b)) && fb >= fblock &&
+                (!found || fb < *out)) {
+                *out = fb;
+                found = 1;
             }
         }
     }
+    return found ? 0 : -1;
+}
 
-    if (btree_insert(new_root, fs_item_key(ino, FS_ITEM_INODE, 0),
-                     inode_pack(type, newsize), &new_root) < 0) {
-        return -1;
+// A small file with nothing on disk yet goes inline. Returns 1 if it did.
+static int delalloc_writeback_inline(struct delalloc_file *df) {
+    uint32_t ino = df->ino;
+    uint8_t *first = delalloc_block(ino, 0);
+    uint64_t fs_root = 0;
+    if (first == 0 || df->size > FS_INLINE_MAX ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0 ||
+        fs_tree_hole_end((uint32_t)fs_root, ino, 0, 0x10000000) !=
+            0x10000000) {
+        return 0;
     }
-    sb.root_tree = root;
-    if (fs_tree_update_fs_root(new_root) < 0) {
+    uint32_t new_root = (uint32_t)fs_root;
+    uint64_t size = df->size;
+    uint16_t type = df->type;
+    if (fs_tree_inline_put(&new_root, ino, first, (uint32_t)size, 0) < 0 ||
+        fs_tree_inode_put(&new_root, ino, type, size) < 0) {
         return -1;
     }
-    return extent_commit();
+    delalloc_release(ino);
+    return fs_tree_update_fs_root(new_root) < 0 ? -1 : 1;
 }
 
-int fs_tree_file_write(uint32_t ino, uint64_t off, const void *src, uint32_t n) {
-    if (n == 0) return 0;
+static int delalloc_writeback_file(struct delalloc_file *df) {
+    uint32_t ino = df->ino;
+    uint32_t fblock = 0;
+    int r = delalloc_writeback_inline(df);
+    if (r != 0) {
+        return r < 0 ? -1 : 0;
+    }
+    while (delalloc_next(ino, fblock, &fblock) == 0) {
+        uint32_t run = 1;
+        while (delalloc_block(ino, fblock + run)) {
+            run++;
+        }
 
-    uint16_t type = 0;
-    uint64_t size = 0;
-    if (fs_tree_get_inode(ino, &type, &size) < 0) {
-        size = 0;
-        type = T_FILE;
-    }
-    if (type != T_FILE) {
-        return -1;
-    }
-    kprintf("fs_tree_file_write: ino=%u off=%u n=%u size=%u\n",
-            ino, (unsigned)off, n, (unsigned)size);
-
-    uint32_t start = 0, len = 0;
-    uint64_t ext_off = 0;
-
-    uint64_t pos = off;
-    uint32_t remaining = n;
-    const uint8_t *p = (const uint8_t *)src;
-
-    while (remaining > 0) {
-        if (fs_tree_extent_find(ino, pos, &start, &len, &ext_off) < 0) {
-            struct extent ex;
-            uint32_t blocks = (remaining + BSIZE - 1) / BSIZE;
-            kprintf("fs_tree_file_write: alloc blocks=%u pos=%u\n",
-                    blocks, (unsigned)pos);
-            if (extent_alloc(blocks, &ex) < 0) {
-                return -1;
+        uint64_t fs_root = 0;
+        if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+            return -1;
+        }
+        uint32_t want = run;
+        uint32_t start = 0, len = 0, flags = 0;
+        uint64_t ext_off = 0;
+        if (fs_tree_extent_find((uint32_t)fs_root, ino,
+                                (uint64_t)fblock * BSIZE, &start, &len,
+                                &ext_off, &flags) == 0) {
+            // Blocks reserved by fallocate: write in place.
+            uint32_t end = (uint32_t)(ext_off / BSIZE) + len;
+            if (want > end - fblock) {
+                want = end - fblock;
             }
-            if (fs_tree_extent_add(ino, pos, ex.start, ex.len) < 0) {
+            if (flags && fs_tree_extent_convert(ino, fblock, want) < 0) {
                 return -1;
             }
-            start = ex.start;
-            len = ex.len;
-            ext_off = pos - (pos % BSIZE);
         } else {
-            uint32_t refs = 1;
-            if (extent_ref_get(sb.root_tree, start, len, &refs) < 0) {
-                return -1;
-            }
-            if (refs > 1) {
-                struct extent ex;
-                if (extent_alloc(len, &ex) < 0) {
+            // One extent for the run if free space allows, else halves.
+            uint32_t end = fs_tree_hole_end((uint32_t)fs_root, ino, fblock,
+                                            fblock + run);
+            want = end - fblock;
+            while (fs_tree_extent_place(ino, fblock, want, 0, &start, &len,
+                                        &ext_off) < 0) {
+                if (want == 1) {
                     return -1;
                 }
-                for (uint32_t i = 0; i < len; i++) {
-                    struct buf *bp_old = bread(start + i);
-                    struct buf *bp_new = bread(ex.start + i);
-                    memmove(bp_new->data, bp_old->data, BSIZE);
-                    bwrite(bp_new);
-                    brelse(bp_new);
-                    brelse(bp_old);
-                }
+                want /= 2;
+            }
+        }
+
+        uint32_t blockno = start + fblock - (uint32_t)(ext_off / BSIZE);
+        for (uint32_t i = 0; i < want; i++) {
+            struct buf *bp = bread(blockno + i);
+            memmove(bp->data, delalloc_block(ino, fblock + i), BSIZE);
+            bwrite(bp);
+            brelse(bp);
+        }
+        fblock += want;
+    }
+
+    uint64_t size = df->size;
+    uint16_t type = df->type;
+    delalloc_release(ino);
+    return fs_tree_set_inode(ino, type, size);
+}
+
+// Write back ino in the current subvolume, or with ino 0 every file of
+// every subvolume: txn_close does that so a commit carries all data
+// written before it, not just the metadata.
+int fs_tree_writeback(uint32_t ino) {
+    uint64_t cur = tree_subvol_current();
+    for (int i = 0; i < DELALLOC_FILES; i++) {
+        struct delalloc_file *df = &delalloc_files[i];
+        if (df->ino == 0 ||
+            (ino != 0 && (df->ino != ino || df->subvol != cur))) {
+            continue;
+        }
+        int rc = -1;
+        if (df->subvol == cur || tree_subvol_set_current(df->subvol) == 0) {
+            rc = delalloc_writeback_file(df);
+            tree_subvol_set_current(cur);
+        }
+        if (rc < 0) {
+            kprintf("fs_tree: writeback of ino %u failed\n", df->ino);
+            return -1;
+        }
+    }
+    for (int i = 0; i < ICACHE_SIZE; i++) {
+        struct icache_entry *ie = &icache[i];
+        if (ie->ino == 0 ||
+            (ino != 0 && (ie->ino != ino || ie->subvol != cur))) {
+            continue;
+        }
+        if (icache_writeback(ie) < 0) {
+            kprintf("fs_tree: inode %u update failed\n", ie->ino);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Zero the written blocks in [from, to), which lies within one block.
+// Holes and unwritten blocks read as zeros already.
+static int fs_tree_zero_range(uint32_t ino, uint64_t size, uint64_t from,
+                              uint64_t to) {
+    static const uint8_t zeros[BSIZE];
+    if (to > size) {
+        to = size;
+    }
+    if (from >= to) {
+        return 0;
+    }
+    uint64_t fs_root = 0;
+    uint32_t flags = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    if (fs_tree_extent_find((uint32_t)fs_root, ino, from, 0, 0, 0,
+                            &flags) < 0 || flags) {
+        return 0;
+    }
+    return fs_tree_file_write(ino, from, zeros, (uint32_t)(to - from)) < 0
+               ? -1 : 0;
+}
 
-                uint64_t fs_root = 0;
-                if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+int fs_tree_truncate(uint32_t ino, uint64_t newsize) {
+    // Buffered blocks past the new end never need an extent.
+    delalloc_discard(ino, (uint32_t)((newsize + BSIZE - 1) / BSIZE));
+    if (fs_tree_writeback(ino) < 0) {
+        return -1;
+    }
+
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (fs_tree_get_inode(ino, &type, &size) < 0) {
+        return -1;
+    }
+    if (type != T_FILE) {
+        return -1;
+    }
+    if (newsize > size) {
+        return -1;
+    }
+    if (newsize == size) {
+        return 0;
+    }
+
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    // An inline file only rewrites the item the new end falls in.
+    uint8_t data[FS_INLINE_MAX];
+    if (size <= FS_INLINE_MAX &&
+        fs_tree_inline_get((uint32_t)fs_root, ino, 0, (uint32_t)size,
+                           data) == 0) {
+        uint32_t new_root = (uint32_t)fs_root;
+        if (fs_tree_inline_put(&new_root, ino, data, (uint32_t)newsize,
+                               (uint32_t)newsize) < 0 ||
+            fs_tree_inode_put(&new_root, ino, type, newsize) < 0) {
+            return -1;
+        }
+        return fs_tree_update_fs_root(new_root);
+    }
+
+    // Zero the kept block's tail through the write path, which copies it
+    // first if another file shares it.
+    if (fs_tree_zero_range(ino, size, newsize,
+                           (newsize + BSIZE - 1) / BSIZE * BSIZE) < 0 ||
+        fs_tree_writeback(ino) < 0 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+
+    // Extents starting at or past the new end go in one range delete.
+    uint32_t cut = (uint32_t)((newsize + BSIZE - 1) / BSIZE);
+    uint32_t new_root = (uint32_t)fs_root;
+    uint32_t root = sb.root_tree;
+    if (btree_delete_range(new_root, fs_item_key(ino, FS_ITEM_EXTENT, cut),
+                           fs_item_key(ino, FS_ITEM_EXTENT, 0x0fffffff),
+                           fs_tree_release_extent, &root, &new_root) < 0) {
+        return -1;
+    }
+
+    // At most one remaining extent straddles the new end.
+    uint64_t found_key = 0;
+    uint64_t val = 0;
+    if (cut > 0 &&
+        btree_lookup_le(new_root, fs_item_key(ino, FS_ITEM_EXTENT, cut - 1),
+                        &found_key, &val) == 0) {
+        uint32_t key_ino = 0;
+        uint16_t key_type = 0;
+        uint32_t key_block = 0;
+        extent_key_unpack(found_key, &key_ino, &key_type, &key_block);
+
+        uint64_t ext_off = (uint64_t)key_block * (uint64_t)BSIZE;
+        uint32_t start = 0, len = 0;
+        extent_unpack(val, &start, &len);
+        uint64_t ext_end = ext_off + (uint64_t)len * (uint64_t)BSIZE;
+
+        if (key_ino == ino && key_type == FS_ITEM_EXTENT && ext_end > newsize) {
+            uint64_t keep_bytes = newsize - ext_off;
+            uint32_t keep_len = (uint32_t)((keep_bytes + BSIZE - 1) / BSIZE);
+            if (keep_len == 0) {
+                keep_len = 1;
+            }
+            // The tail's blocks go unless another file still maps them.
+            if (keep_len < len) {
+                if (extent_ref_update_root(root, start + keep_len,
+                                           len - keep_len, -1, &root) < 0) {
                     return -1;
                 }
-                uint32_t new_root = (uint32_t)fs_root;
-                if (btree_insert(new_root, extent_key(ino, ext_off),
-                                 extent_pack(ex.start, ex.len),
+                if (btree_insert(new_root, found_key,
+                                 extent_pack(start, keep_len |
+                                             extent_flags(val)),
                                  &new_root) < 0) {
                     return -1;
                 }
+            }
+
+        }
+    }
+
+    if (fs_tree_inode_put(&new_root, ino, type, newsize) < 0) {
+        return -1;
+    }
+    sb.root_tree = root;
+    if (fs_tree_update_fs_root(new_root) < 0) {
+        return -1;
+    }
+    return 0;
+}
 
-                uint32_t root = sb.root_tree;
-                if (extent_ref_update_root(root, ex.start, ex.len, 1, &root) < 0) {
+static int fs_tree_punch(uint32_t ino, uint64_t size, uint64_t off,
+                         uint64_t end) {
+    uint32_t first = (uint32_t)((off + BSIZE - 1) / BSIZE);
+    uint32_t last = (uint32_t)(end / BSIZE);
+    if (first > last) {
+        return fs_tree_zero_range(ino, size, off, end);
+    }
+    if (fs_tree_zero_range(ino, size, off, (uint64_t)first * BSIZE) < 0 ||
+        fs_tree_zero_range(ino, size, (uint64_t)last * BSIZE, end) < 0) {
+        return -1;
+    }
+    if (first == last) {
+        return 0;
+    }
+
+    // Whole blocks go with their extents; straddling extents are split at
+    // the edges first.
+    if (fs_tree_extent_split(ino, first) < 0 ||
+        fs_tree_extent_split(ino, last) < 0) {
+        return -1;
+    }
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint32_t new_root = (uint32_t)fs_root;
+    uint32_t root = sb.root_tree;
+    if (btree_delete_range(new_root, fs_item_key(ino, FS_ITEM_EXTENT, first),
+                           fs_item_key(ino, FS_ITEM_EXTENT, last - 1),
+                           fs_tree_release_extent, &root, &new_root) < 0) {
+        return -1;
+    }
+    sb.root_tree = root;
+    if (fs_tree_update_fs_root(new_root) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reserve, grow or punch [off, off + len) of a file; mode takes the
+// FALLOC_* flags. Reserved blocks are unwritten: they read as zeros and
+// later writes fill them without allocating.
+int fs_tree_fallocate(uint32_t ino, int mode, uint64_t off, uint64_t len) {
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (len == 0 || off + len < off ||
+        fs_tree_get_inode(ino, &type, &size) < 0 || type != T_FILE) {
+        return -1;
+    }
+    // Buffered blocks must have their extents before the range changes,
+    // and inline data needs a block of its own.
+    if (fs_tree_writeback(ino) < 0) {
+        return -1;
+    }
+    uint64_t fs_root = 0;
+    uint8_t data[FS_INLINE_MAX];
+    if (size != 0 && size <= FS_INLINE_MAX &&
+        tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) == 0 &&
+        fs_tree_inline_get((uint32_t)fs_root, ino, 0, (uint32_t)size,
+                           data) == 0 &&
+        fs_tree_inline_convert(ino, data, (uint32_t)size) < 0) {
+        return -1;
+    }
+
+    uint64_t end = off + len;
+    if (mode & FALLOC_PUNCH_HOLE) {
+        return fs_tree_punch(ino, size, off, end);
+    }
+
+    if (!(mode & FALLOC_NO_ALLOC)) {
+        uint32_t fblock = (uint32_t)(off / BSIZE);
+        uint32_t last = (uint32_t)((end + BSIZE - 1) / BSIZE);
+        while (fblock < last) {
+            if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+                return -1;
+            }
+            uint32_t start = 0, ext_len = 0;
+            uint64_t ext_off = 0;
+            if (fs_tree_extent_find((uint32_t)fs_root, ino,
+                                    (uint64_t)fblock * BSIZE, &start,
+                                    &ext_len, &ext_off, 0) == 0) {
+                fblock = (uint32_t)(ext_off / BSIZE) + ext_len;
+                continue;
+            }
+
+            // Each hole gets one extent if free space allows, else halves.
+            uint32_t want = fs_tree_hole_end((uint32_t)fs_root, ino, fblock,
+                                             last) - fblock;
+            while (fs_tree_extent_place(ino, fblock, want, FS_EXTENT_UNWRITTEN,
+                                        0, 0, 0) < 0) {
+                if (want == 1) {
                     return -1;
                 }
-                if (extent_ref_update_root(root, start, len, -1, &root) < 0) {
-                    return -1;
+                want /= 2;
+            }
+            fblock += want;
+        }
+    }
+
+    if (!(mode & FALLOC_KEEP_SIZE) && end > size &&
+        fs_tree_set_inode(ino, type, end) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+#define DEFRAG_MAX_BLOCKS 256 // Largest extent defrag builds
+#define DEFRAG_MAX_DEPTH 16
+
+// Whether some other subvolume maps blocks of ino's range starting at
+// file block fblock onto start..start+len-1. Snapshots share extents
+// without taking refs on them, so the blocks are theirs as well.
+static int fs_tree_extent_in_snapshot(uint32_t ino, uint32_t fblock,
+                                      uint32_t start, uint32_t len) {
+    uint64_t next = 0;
+    if (tree_root_get(ROOT_ITEM_SUBVOL_NEXT, &next) < 0) {
+        return 0;
+    }
+    uint64_t end_key = extent_key(ino, (uint64_t)(fblock + len) * BSIZE);
+    for (uint64_t id = 1; id < next; id++) {
+        uint64_t root = 0;
+        if (id == tree_subvol_current() || tree_subvol_get(id, &root) < 0) {
+            continue;
+        }
+        struct btree_cursor cur;
+        int rc = btree_cursor_seek_le(&cur, (uint32_t)root,
+                                      extent_key(ino, (uint64_t)fblock * BSIZE));
+        if (rc < 0) {
+            rc = btree_cursor_seek(&cur, (uint32_t)root, extent_key(ino, 0));
+        }
+        for (; rc == 0; rc = btree_cursor_next(&cur)) {
+            uint64_t key = 0;
+            uint64_t val = 0;
+            btree_cursor_get(&cur, &key, &val);
+            if (key >= end_key) {
+                break;
+            }
+            uint32_t key_ino = 0;
+            uint16_t key_type = 0;
+            uint32_t key_block = 0;
+            extent_key_unpack(key, &key_ino, &key_type, &key_block);
+            if (key_ino != ino || key_type != FS_ITEM_EXTENT) {
+                continue;
+            }
+            uint32_t s = 0, l = 0;
+            extent_unpack(val, &s, &l);
+            if (s < start + len && start < s + l) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Drop this file's reference on an extent it no longer maps, freeing the
+// blocks with the last one. Blocks a snapshot still maps keep the ref,
+// which from here on stands for the snapshot's use.
+static int fs_tree_extent_unref(uint32_t *root, uint32_t ino, uint32_t fblock,
+                                uint32_t start, uint32_t len) {
+    if (fs_tree_extent_in_snapshot(ino, fblock, start, len)) {
+        return 0;
+    }
+    return extent_ref_update_root(*root, start, len, -1, root);
+}
+
+// Whether defrag may move the extent of ino at fblock.
+static int fs_tree_defrag_movable(uint32_t ino, uint32_t fblock,
+                                  uint32_t start, uint32_t len,
+                                  uint32_t flags, int mode) {
+    if (flags) {
+        return 0; // Unwritten: nothing to gather
+    }
+    if (!(mode & DEFRAG_KEEP_SHARED)) {
+        return 1;
+    }
+    uint32_t refs = 1;
+    if (extent_ref_get(sb.root_tree, start, len, &refs) < 0 || refs > 1) {
+        return 0;
+    }
+    return !fs_tree_extent_in_snapshot(ino, fblock, start, len);
+}
+
+// Rewrite runs of adjacent, scattered extents of a file into one extent
+// each, until *moved reaches budget (0: no limit).
+static int fs_tree_defrag_file(uint32_t ino, int mode, uint32_t budget,
+                               uint32_t *moved) {
+    if (fs_tree_writeback(ino) < 0) {
+        return -1;
+    }
+
+    uint32_t fblock = 0;
+    while (budget == 0 || *moved < budget) {
+        uint64_t fs_root = 0;
+        if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+            return -1;
+        }
+        uint64_t key = 0;
+        if (btree_lookup_ge((uint32_t)fs_root,
+                            extent_key(ino, (uint64_t)fblock * BSIZE),
+                            &key, 0) < 0) {
+            break;
+        }
+        uint32_t key_ino = 0;
+        uint16_t key_type = 0;
+        uint32_t first = 0;
+        extent_key_unpack(key, &key_ino, &key_type, &first);
+        if (key_ino != ino || key_type != FS_ITEM_EXTENT) {
+            break;
+        }
+
+        // Gather the movable extents that follow on from first without a
+        // hole, and count the places where the disk layout jumps.
+        uint32_t total = 0;
+        uint32_t n = 0;
+        uint32_t jumps = 0;
+        uint32_t prev_end = 0;
+        uint32_t cur = first;
+        for (;;) {
+            uint64_t val = 0;
+            if (btree_lookup((uint32_t)fs_root,
+                             extent_key(ino, (uint64_t)cur * BSIZE),
+                             &val) < 0) {
+                break;
+            }
+            uint32_t start = 0, len = 0;
+            extent_unpack(val, &start, &len);
+            if (total + len > DEFRAG_MAX_BLOCKS ||
+                !fs_tree_defrag_movable(ino, cur, start, len,
+                                        extent_flags(val), mode)) {
+                if (n == 0) {
+                    cur += len; // Step over it
                 }
-                sb.root_tree = root;
-                if (fs_tree_update_fs_root(new_root) < 0) {
-                    return -1;
+                break;
+            }
+            if (n > 0 && start != prev_end) {
+                jumps++;
+            }
+            prev_end = start + len;
+            total += len;
+            n++;
+            cur += len;
+        }
+        fblock = cur;
+        if (jumps == 0) {
+            continue;
+        }
+
+        uint32_t goal = 0;
+        uint32_t prev_start = 0, prev_len = 0;
+        if (fs_tree_extent_prev((uint32_t)fs_root, ino,
+                                (uint64_t)first * BSIZE, 0, &prev_start,
+                                &prev_len, 0, 0) == 0) {
+            goal = prev_start + prev_len;
+        }
+        struct extent ex;
+        if (extent_alloc_near(goal, total, &ex) < 0) {
+            continue; // No room for it in one piece
+        }
+
+        uint32_t new_root = (uint32_t)fs_root;
+        uint32_t root = sb.root_tree;
+        for (uint32_t b = first; b < first + total; ) {
+            uint64_t val = 0;
+            if (btree_lookup(new_root, extent_key(ino, (uint64_t)b * BSIZE),
+                             &val) < 0) {
+                return -1;
+            }
+            uint32_t start = 0, len = 0;
+            extent_unpack(val, &start, &len);
+            for (uint32_t i = 0; i < len; i++) {
+                struct buf *bp_old = bread(start + i);
+                struct buf *bp_new = bread(ex.start + (b - first) + i);
+                memmove(bp_new->data, bp_old->data, BSIZE);
+                bwrite(bp_new);
+                brelse(bp_new);
+                brelse(bp_old);
+            }
+            if ((b != first &&
+                 btree_delete(new_root, extent_key(ino, (uint64_t)b * BSIZE),
+                              &new_root) < 0) ||
+                fs_tree_extent_unref(&root, ino, b, start, len) < 0) {
+                return -1;
+            }
+            b += len;
+        }
+        if (btree_insert(new_root, extent_key(ino, (uint64_t)first * BSIZE),
+                         extent_pack(ex.start, ex.len), &new_root) < 0 ||
+            extent_ref_update_root(root, ex.start, ex.len, 1, &root) < 0) {
+            return -1;
+        }
+        sb.root_tree = root;
+        if (fs_tree_update_fs_root(new_root) < 0) {
+            return -1;
+        }
+        *moved += total;
+    }
+    return 0;
+}
+
+static int fs_tree_defrag_ino(uint32_t ino, int mode, uint32_t budget,
+                              uint32_t *moved, int depth) {
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (fs_tree_get_inode(ino, &type, &size) < 0) {
+        return -1;
+    }
+    if (type == T_FILE) {
+        return fs_tree_defrag_file(ino, mode, budget, moved);
+    }
+    if (type != T_DIR || depth >= DEFRAG_MAX_DEPTH) {
+        return 0;
+    }
+
+    uint64_t cookie = 0;
+    uint32_t child = 0;
+    while ((budget == 0 || *moved < budget) &&
+           fs_tree_readdir(ino, &cookie, 0, 0, &child) == 0) {
+        if (fs_tree_defrag_ino(child, mode, budget, moved, depth + 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Gather the scattered extents of a file, or of every file under a
+// directory, into fewer and larger ones. mode takes the DEFRAG_* flags.
+// Stops after moving about budget blocks (0: no limit) so a caller can
+// spread the work out; returns the number of blocks moved.
+int fs_tree_defrag(uint32_t ino, int mode, uint32_t budget) {
+    uint32_t moved = 0;
+    if (fs_tree_defrag_ino(ino, mode, budget, &moved, 0) < 0) {
+        return -1;
+    }
+    return (int)moved;
+}
+
+// Give file blocks from fblock on, up to n of them within one extent,
+// blocks of their own in place of shared ones. Bytes from..to are about
+// to be overwritten, so only blocks the write covers partly are copied.
+// Returns the extent now covering fblock, which may be shorter than n
+// when free space is scattered.
+static int fs_tree_extent_cow(uint32_t ino, uint32_t fblock, uint32_t n,
+                              uint64_t from, uint64_t to, uint32_t *start_out,
+                              uint32_t *len_out, uint64_t *ext_off_out) {
+    struct extent ex;
+    while (extent_alloc(n, &ex) < 0) {
+        if (n == 1) {
+            return -1;
+        }
+        n /= 2;
+    }
+    if (fs_tree_extent_split(ino, fblock) < 0 ||
+        fs_tree_extent_split(ino, fblock + n) < 0) {
+        extent_free(ex.start, ex.len);
+        return -1;
+    }
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint64_t ext_off = (uint64_t)fblock * BSIZE;
+    uint32_t start = 0, len = 0, flags = 0;
+    if (fs_tree_extent_find((uint32_t)fs_root, ino, ext_off, &start, &len, 0,
+                            &flags) < 0 || len != n) {
+        return -1;
+    }
+
+    // Unwritten blocks have nothing worth copying.
+    for (uint32_t i = 0; i < n && !flags; i++) {
+        uint64_t lo = ext_off + (uint64_t)i * BSIZE;
+        if (from <= lo && lo + BSIZE <= to) {
+            continue;
+        }
+        struct buf *bp_old = bread(start + i);
+        struct buf *bp_new = bread(ex.start + i);
+        memmove(bp_new->data, bp_old->data, BSIZE);
+        bwrite(bp_new);
+        brelse(bp_new);
+        brelse(bp_old);
+    }
+
+    uint32_t new_root = (uint32_t)fs_root;
+    uint32_t root = sb.root_tree;
+    if (btree_insert(new_root, extent_key(ino, ext_off),
+                     extent_pack(ex.start, ex.len | flags), &new_root) < 0 ||
+        extent_ref_update_root(root, ex.start, ex.len, 1, &root) < 0 ||
+        extent_ref_update_root(root, start, len, -1, &root) < 0) {
+        return -1;
+    }
+    sb.root_tree = root;
+    if (fs_tree_update_fs_root(new_root) < 0) {
+        return -1;
+    }
+    if (start_out) *start_out = ex.start;
+    if (len_out) *len_out = ex.len;
+    if (ext_off_out) *ext_off_out = ext_off;
+    return 0;
+}
+
+// Write to an inline file in place. Returns 1 when done and 0 when the
+// file has extents, or has just been given one because the write would
+// outgrow its items.
+static int fs_tree_inline_write(uint32_t ino, uint16_t type, uint64_t size,
+                                uint64_t off, const void *src, uint32_t n) {
+    uint64_t fs_root = 0;
+    uint8_t data[FS_INLINE_MAX];
+    if (size == 0 || size > FS_INLINE_MAX ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0 ||
+        fs_tree_inline_get((uint32_t)fs_root, ino, 0, (uint32_t)size,
+                           data) < 0) {
+        return 0;
+    }
+    if (off + n > FS_INLINE_MAX) {
+        return fs_tree_inline_convert(ino, data, (uint32_t)size) < 0 ? -1 : 0;
+    }
+
+    uint32_t from = (uint32_t)(off < size ? off : size);
+    uint32_t end = (uint32_t)(off + n > size ? off + n : size);
+    memzero(data + size, end - size);
+    memmove(data + off, src, n);
+    uint32_t new_root = (uint32_t)fs_root;
+    if (fs_tree_inline_put(&new_root, ino, data, end, from) < 0 ||
+        (end != size &&
+         fs_tree_inode_put(&new_root, ino, type, end) < 0)) {
+        return -1;
+    }
+    return fs_tree_update_fs_root(new_root) < 0 ? -1 : 1;
+}
+
+int fs_tree_file_write(uint32_t ino, uint64_t off, const void *src, uint32_t n) {
+    if (n == 0) return 0;
+
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (fs_tree_get_inode(ino, &type, &size) < 0) {
+        size = 0;
+        type = T_FILE;
+        // Readers look the inode up before any buffered data.
+        if (fs_tree_set_inode(ino, type, 0) < 0) {
+            return -1;
+        }
+    }
+    if (type != T_FILE) {
+        return -1;
+    }
+    kprintf("fs_tree_file_write: ino=%u off=%u n=%u size=%u\n",
+            ino, (unsigned)off, n, (unsigned)size);
+    int r = fs_tree_inline_write(ino, type, size, off, src, n);
+    if (r != 0) {
+        return r < 0 ? -1 : (int)n;
+    }
+
+    uint32_t start = 0, len = 0;
+    uint64_t ext_off = 0;
+
+    uint64_t pos = off;
+    uint32_t remaining = n;
+    const uint8_t *p = (const uint8_t *)src;
+
+    while (remaining > 0) {
+        uint64_t fs_root = 0;
+        if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+            return -1;
+        }
+        uint32_t flags = 0;
+        int mapped = fs_tree_extent_map((uint32_t)fs_root, fs_tree_gen, ino,
+                                        pos, &start, &len, &ext_off,
+                                        &flags) == 0;
+        if (mapped) {
+            uint32_t fblock = (uint32_t)(pos / BSIZE);
+            uint32_t idx = fblock - (uint32_t)(ext_off / BSIZE);
+            uint32_t refs = 1;
+            if (extent_ref_get(sb.root_tree, start + idx, 1, &refs) < 0) {
+                return -1;
+            }
+            if (refs > 1) {
+                // Copy only the blocks this write reaches; the rest of
+                // the extent stays shared.
+                uint32_t last = (uint32_t)((pos + remaining - 1) / BSIZE);
+                uint32_t n = len - idx;
+                if (n > last - fblock + 1) {
+                    n = last - fblock + 1;
                 }
-                if (extent_commit() < 0) {
+                if (fs_tree_extent_cow(ino, fblock, n, pos, pos + remaining,
+                                       &start, &len, &ext_off) < 0) {
                     return -1;
                 }
+            }
+        }
+        if (!mapped || flags) {
+            uint32_t boff = pos % BSIZE;
+            uint32_t chunk = BSIZE - boff;
+            if (chunk > remaining) chunk = remaining;
+            if (delalloc_write(ino, type, size, pos, p, chunk) == 0) {
+                remaining -= chunk;
+                p += chunk;
+                pos += chunk;
+                continue;
+            }
 
-                start = ex.start;
-                len = ex.len;
+            // No page to buffer in: allocate for the rest of the write
+            // now, or mark the reserved block written.
+            uint32_t fblock = (uint32_t)(pos / BSIZE);
+            if (flags) {
+                if (fs_tree_extent_convert(ino, fblock, 1) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            uint32_t blocks = (remaining + BSIZE - 1) / BSIZE;
+            if (fs_tree_extent_place(ino, fblock, blocks, 0, &start, &len,
+                                     &ext_off) < 0) {
+                return -1;
             }
         }
         uint64_t blk_index = (pos - ext_off) / BSIZE;
@@ -1201,43 +2681,82 @@ int fs_tree_file_write(uint32_t ino, uint64_t off, const void *src, uint32_t n)
         pos += chunk;
     }
 
+    // The inode item catches up when the transaction closes.
     if (off + n > size) {
-        fs_tree_set_inode(ino, type, off + n);
+        struct delalloc_file *df = delalloc_file_find(ino);
+        if (df) {
+            df->size = off + n;
+        } else if (icache_defer(ino, type, off + n) < 0) {
+            return -1;
+        }
     }
     return (int)n;
 }
 
-int fs_tree_file_read(uint32_t ino, uint64_t off, void *dst, uint32_t n) {
-    if (n == 0) return 0;
-
+static int fs_tree_file_read_in(uint32_t fs_root, uint64_t gen, uint32_t ino,
+                                uint64_t off, void *dst, uint32_t n) {
+    // A deferred size lives only in the inode cache, so that comes first.
     uint16_t type = 0;
     uint64_t size = 0;
-    if (fs_tree_get_inode(ino, &type, &size) < 0) {
+    struct icache_entry *ie = icache_find(ino);
+    if (ie) {
+        type = ie->type;
+        size = ie->size;
+    } else if (fs_tree_get_inode_in(fs_root, ino, &type, &size) < 0) {
         return -1;
     }
     if (type != T_FILE) {
         return -1;
     }
+    struct delalloc_file *df = delalloc_file_find(ino);
+    if (df) {
+        size = df->size;
+    }
     if (off >= size) return 0;
     if (off + n > size) {
         n = (uint32_t)(size - off);
     }
+    if (size <= FS_INLINE_MAX &&
+        fs_tree_inline_get(fs_root, ino, (uint32_t)off, (uint32_t)(off + n),
+                           dst) == 0) {
+        return (int)n;
+    }
 
     uint64_t pos = off;
     uint32_t remaining = n;
     uint8_t *p = (uint8_t *)dst;
 
     while (remaining > 0) {
-        uint32_t start = 0, len = 0;
+        uint32_t start = 0, len = 0, flags = 0;
         uint64_t ext_off = 0;
-        if (fs_tree_extent_find(ino, pos, &start, &len, &ext_off) < 0) {
-            uint64_t fs_root = 0;
+        int mapped = fs_tree_extent_map(fs_root, gen, ino, pos, &start, &len,
+                                        &ext_off, &flags) == 0;
+        if (!mapped || flags) {
+            uint8_t *buffered = delalloc_block(ino, (uint32_t)(pos / BSIZE));
+            if (buffered || flags) {
+                uint32_t boff = pos % BSIZE;
+                uint32_t chunk = BSIZE - boff;
+                if (chunk > remaining) chunk = remaining;
+                if (buffered) {
+                    memmove(p, buffered + boff, chunk);
+                } else {
+                    memzero(p, chunk);
+                }
+                remaining -= chunk;
+                p += chunk;
+                pos += chunk;
+                continue;
+            }
+
             uint64_t key = extent_key(ino, pos);
             uint64_t found_key = 0;
             uint64_t val = 0;
             uint32_t chunk = remaining;
-            if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) == 0 &&
-                btree_lookup_ge((uint32_t)fs_root, key, &found_key, &val) == 0) {
+            // Buffered blocks can sit anywhere in the hole.
+            if (df && chunk > BSIZE - pos % BSIZE) {
+                chunk = BSIZE - pos % BSIZE;
+            }
+            if (btree_lookup_ge(fs_root, key, &found_key, &val) == 0) {
                 uint32_t key_ino = 0;
                 uint16_t key_type = 0;
                 uint32_t key_block = 0;
@@ -1279,3 +2798,329 @@ int fs_tree_file_read(uint32_t ino, uint64_t off, void *dst, uint32_t n) {
 
     return (int)n;
 }
+
+// Reads run against a pinned snapshot, so a concurrent writer can replace
+// the extents being read without freeing the tree nodes under us. It is
+// the open transaction's: a read sees every write before it.
+int fs_tree_file_read(uint32_t ino, uint64_t off, void *dst, uint32_t n) {
+    if (n == 0) return 0;
+
+    struct tree_snapshot snap;
+    if (tree_read_begin_open(&snap) < 0) {
+        return -1;
+    }
+    uint64_t gen = fs_tree_gen; // The pinned tree is the current one
+    int r = fs_tree_file_read_in(snap.fs_root, gen, ino, off, dst, n);
+    tree_read_end(&snap);
+    return r;
+}
+
+// Drop ino's items from a log tree: its inode item and data and, with
+// parent set, its parent item and the entries of parent naming it.
+static int fs_tree_log_drop(uint32_t *log, uint32_t ino, uint32_t parent) {
+    uint32_t root = *log;
+    uint64_t inode_key = fs_item_key(ino, FS_ITEM_INODE, 0);
+    if (btree_delete_range(root, inode_key, inode_key, 0, 0, &root) < 0 ||
+        btree_delete_range(root, fs_item_key(ino, FS_ITEM_EXTENT, 0),
+                           fs_item_key(ino, FS_ITEM_EXTENT, 0x0fffffff),
+                           0, 0, &root) < 0 ||
+        fs_tree_inline_put(&root, ino, 0, 0, 0) < 0) {
+        return -1;
+    }
+    if (parent != 0) {
+        uint64_t parent_key = fs_item_key(ino, FS_ITEM_PARENT, 0);
+        uint64_t key = 0;
+        if (btree_delete_range(root, parent_key, parent_key, 0, 0,
+                               &root) < 0) {
+            return -1;
+        }
+        while (fs_tree_dirent_find(root, parent, ino, &key, 0) == 0) {
+            if (btree_delete(root, key, &root) < 0) {
+                return -1;
+            }
+        }
+    }
+    *log = root;
+    return 0;
+}
+
+// Copy ino's inode item and data items into a log tree and, unless
+// datasync, its parent item and the entry naming it.
+static int fs_tree_log_inode(uint32_t fs_root, uint32_t *log, uint32_t ino,
+                             int datasync) {
+    uint64_t inode_key = fs_item_key(ino, FS_ITEM_INODE, 0);
+    uint64_t parent_key = fs_item_key(ino, FS_ITEM_PARENT, 0);
+    uint64_t val = 0;
+    uint64_t parent = 0;
+    if (btree_lookup(fs_root, inode_key, &val) < 0 ||
+        (!datasync && btree_lookup(fs_root, parent_key, &parent) < 0)) {
+        return -1;
+    }
+
+    uint32_t root = *log;
+    if (fs_tree_log_drop(&root, ino, (uint32_t)parent) < 0 ||
+        btree_insert(root, inode_key, val, &root) < 0) {
+        return -1;
+    }
+
+    // Extents, then inline items, which carry their data with them.
+    uint64_t limit = inline_key(ino, 0x0fffffff);
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, fs_root,
+                                    fs_item_key(ino, FS_ITEM_EXTENT, 0));
+         rc == 0; rc = btree_cursor_next(&cur)) {
+        uint64_t key = 0;
+        if (btree_cursor_get(&cur, &key, &val) < 0 || key > limit) {
+            break;
+        }
+        uint16_t type = 0;
+        extent_key_unpack(key, 0, &type, 0);
+        uint32_t len = 0;
+        const uint8_t *data = btree_cursor_data(&cur, &len);
+        if (type != FS_ITEM_PARENT &&
+            btree_insert_item(root, key, val, data, len, &root) < 0) {
+            return -1;
+        }
+    }
+
+    if (!datasync) {
+        uint64_t key = 0;
+        if (btree_insert(root, parent_key, parent, &root) < 0) {
+            return -1;
+        }
+        uint8_t name[BTREE_ITEM_MAX];
+        uint32_t len = 0;
+        if (parent != ino &&
+            fs_tree_dirent_find(fs_root, (uint32_t)parent, ino, &key,
+                                0) == 0 &&
+            (btree_lookup_item(fs_root, key, &val, name, sizeof(name),
+                               &len) < 0 ||
+             btree_insert_item(root, key, val, name, len, &root) < 0)) {
+            return -1;
+        }
+    }
+    *log = root;
+    return 0;
+}
+
+// Make ino durable without committing: its data goes out, then its items
+// are copied into the subvolume's log tree and that is written. fdatasync
+// leaves out the name. Falls back on a full commit.
+int fs_tree_fsync(uint32_t ino, int datasync) {
+    // The log sits on the last commit; let one in flight land first.
+    if (txn_wait() < 0 || fs_tree_writeback(ino) < 0) {
+        return -1;
+    }
+    struct txn t;
+    txn_stat(&t);
+    if (!t.dirty) {
+        return 0; // The last commit has it all
+    }
+
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint64_t subvol = tree_subvol_current();
+    tree_log_update_begin();
+    uint32_t log = tree_log_root(subvol);
+    uint32_t fresh = 0;
+    int rc = 0;
+    if (log == 0) {
+        rc = btree_create_empty(0, &log);
+        fresh = log;
+    }
+    if (rc == 0) {
+        rc = fs_tree_log_inode((uint32_t)fs_root, &log, ino, datasync);
+    }
+    // The name only resolves if the directories above it exist after
+    // replay: log the ones created since the last commit too.
+    for (uint32_t cur = ino; rc == 0 && !datasync; ) {
+        uint32_t parent = 0;
+        if (fs_tree_get_parent(cur, &parent) < 0 || parent == cur ||
+            parent < sb_committed.fs_next_ino) {
+            break;
+        }
+        rc = fs_tree_log_inode((uint32_t)fs_root, &log, parent, 0);
+        cur = parent;
+    }
+    if (rc < 0 && fresh != 0) {
+        bfree(fresh);
+    }
+    if (tree_log_update_end(subvol, log, rc) < 0 || tree_log_sync() < 0) {
+        return txn_commit();
+    }
+    return 0;
+}
+
+// An unlinked file must not come back from an earlier fsync's log.
+static void fs_tree_log_forget(uint32_t parent, uint32_t ino) {
+    uint64_t subvol = tree_subvol_current();
+    uint32_t log = tree_log_root(subvol);
+    if (log == 0) {
+        return;
+    }
+    tree_log_update_begin();
+    int rc = fs_tree_log_drop(&log, ino, parent);
+    tree_log_update_end(subvol, log, rc);
+}
+
+static int fs_tree_log_replay_inode(uint32_t log, uint32_t ino, uint64_t val) {
+    uint64_t lo = fs_item_key(ino, FS_ITEM_EXTENT, 0);
+    uint64_t hi = fs_item_key(ino, FS_ITEM_EXTENT, 0x0fffffff);
+
+    // The logged extents take their references before the committed ones
+    // drop theirs, so only blocks the log no longer maps are freed.
+    uint32_t root = sb.root_tree;
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, log, lo); rc == 0;
+         rc = btree_cursor_next(&cur)) {
+        uint64_t key = 0;
+        uint64_t ext = 0;
+        if (btree_cursor_get(&cur, &key, &ext) < 0 || key > hi) {
+            break;
+        }
+        uint32_t start = 0, len = 0;
+        extent_unpack(ext, &start, &len);
+        for (uint32_t i = 0; i < len; i++) {
+            breserve(start + i);
+        }
+        if (extent_ref_update_root(root, start, len, 1, &root) < 0) {
+            return -1;
+        }
+    }
+
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint32_t new_root = 0;
+    if (btree_delete_range((uint32_t)fs_root, lo, hi, fs_tree_release_extent,
+                           &root, &new_root) < 0 ||
+        fs_tree_inline_put(&new_root, ino, 0, 0, 0) < 0) {
+        return -1;
+    }
+    for (int rc = btree_cursor_seek(&cur, log, lo); rc == 0;
+         rc = btree_cursor_next(&cur)) {
+        uint64_t key = 0;
+        uint64_t ext = 0;
+        if (btree_cursor_get(&cur, &key, &ext) < 0 ||
+            key > inline_key(ino, 0x0fffffff)) {
+            break;
+        }
+        uint16_t type = 0;
+        extent_key_unpack(key, 0, &type, 0);
+        uint32_t len = 0;
+        const uint8_t *data = btree_cursor_data(&cur, &len);
+        if (type != FS_ITEM_PARENT &&
+            btree_insert_item(new_root, key, ext, data, len, &new_root) < 0) {
+            return -1;
+        }
+    }
+    sb.root_tree = root;
+    if (fs_tree_update_fs_root(new_root) < 0) {
+        return -1;
+    }
+
+    if (sb.fs_next_ino <= ino) {
+        sb.fs_next_ino = ino + 1;
+    }
+    if (fs_tree_next_ino != 0 && fs_tree_next_ino <= ino) {
+        fs_tree_next_ino = ino + 1;
+    }
+    uint16_t type = 0;
+    uint64_t size = 0;
+    inode_unpack(val, &type, &size);
+    return fs_tree_set_inode(ino, type, size);
+}
+
+// A logged entry. The file may have been renamed since the commit, in
+// which case its old entry goes. The entry is placed by name rather than
+// by its logged key, whose slot may hold another name by now.
+static int fs_tree_log_replay_dirent(uint64_t key, uint64_t val,
+                                     const uint8_t *name, uint32_t len) {
+    uint32_t parent = 0;
+    uint32_t ino = 0;
+    uint32_t name_block = 0;
+    char want[BTREE_ITEM_MAX + 1];
+    extent_key_unpack(key, &parent, 0, 0);
+    dirent_unpack(val, &ino, &name_block);
+    if (dirent_name(val, name, len, want, sizeof(want)) < 0) {
+        return -1;
+    }
+    if (name_block) {
+        breserve(name_block);
+    }
+
+    uint64_t fs_root = 0;
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+        return -1;
+    }
+    uint64_t old = 0;
+    uint64_t slot = 0;
+    uint32_t old_block = 0;
+    if (fs_tree_dirent_lookup((uint32_t)fs_root, parent, want, &key, &old,
+                              &slot) == 0) {
+        dirent_unpack(old, 0, &old_block);
+        if (old_block && old_block != name_block) {
+            extent_free(old_block, 1);
+        }
+    } else if (slot != 0) {
+        key = slot;
+    } else {
+        return -1;
+    }
+
+    uint64_t old_key = 0;
+    if (fs_tree_dirent_find((uint32_t)fs_root, parent, ino, &old_key,
+                            &old) == 0 && old_key != key) {
+        dirent_unpack(old, 0, &old_block);
+        if (old_block) {
+            extent_free(old_block, 1);
+        }
+        if (fs_tree_delete_item(old_key) < 0 ||
+            tree_root_get(ROOT_ITEM_FS_ROOT, &fs_root) < 0) {
+            return -1;
+        }
+    }
+
+    uint32_t new_root = 0;
+    if (btree_insert_item((uint32_t)fs_root, key, val, name, len,
+                          &new_root) < 0) {
+        return -1;
+    }
+    return fs_tree_update_fs_root(new_root);
+}
+
+// Apply one subvolume's log tree on top of the last commit. The tree may
+// no longer match what the dentry cache saw, so the cache starts over.
+int fs_tree_log_replay(uint64_t subvol, uint32_t log) {
+    uint64_t prev = tree_subvol_current();
+    if (tree_subvol_set_current(subvol) < 0) {
+        return -1;
+    }
+    dcache_flush();
+    int rc = 0;
+    struct btree_cursor cur;
+    for (int r = btree_cursor_seek(&cur, log, 0); r == 0 && rc == 0;
+         r = btree_cursor_next(&cur)) {
+        uint64_t key = 0;
+        uint64_t val = 0;
+        uint32_t ino = 0;
+        uint16_t type = 0;
+        btree_cursor_get(&cur, &key, &val);
+        extent_key_unpack(key, &ino, &type, 0);
+        if (type == FS_ITEM_INODE) {
+            rc = fs_tree_log_replay_inode(log, ino, val);
+        } else if (type == FS_ITEM_DIRENT) {
+            uint32_t len = 0;
+            const uint8_t *name = btree_cursor_data(&cur, &len);
+            rc = fs_tree_log_replay_dirent(key, val, name, len);
+        } else if (type == FS_ITEM_PARENT) {
+            rc = fs_tree_set_parent(ino, (uint32_t)val);
+        }
+    }
+    tree_subvol_set_current(prev);
+    dcache_flush();
+    return rc;
+}
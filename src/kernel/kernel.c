@@ -9,6 +9,8 @@
 #include <kernel/extent.h>
 #include <kernel/tree.h>
 #include <kernel/fs_tree.h>
+#include <kernel/txn.h>
+#include <kernel/tree_log.h>
 #include "kernel/sched.h"
 #include "kernel/kalloc.h"
 #include "kernel/vm.h"
@@ -374,6 +376,198 @@ static void test_btree(void) {
     kprintf("btree: OK\n");
 }
 
+static void test_btree_delete(void) {
+    kprintf("btree: testing delete...\n");
+
+    uint32_t root = 0;
+    for (uint64_t k = 1; k <= 40; k++) {
+        if (btree_insert(root, k, k * 10, &root) < 0) {
+            kprintf("btree: FAIL - delete setup\n");
+            return;
+        }
+    }
+
+    // Remove every other key, forcing borrows and merges
+    for (uint64_t k = 2; k <= 40; k += 2) {
+        if (btree_delete(root, k, &root) < 0) {
+            kprintf("btree: FAIL - delete\n");
+            return;
+        }
+    }
+
+    uint64_t out = 0;
+    if (btree_lookup(root, 4, &out) == 0 ||
+        btree_lookup(root, 5, &out) < 0 || out != 50) {
+        kprintf("btree: FAIL - lookup after delete\n");
+        return;
+    }
+
+    for (uint64_t k = 1; k <= 40; k += 2) {
+        if (btree_delete(root, k, &root) < 0) {
+            kprintf("btree: FAIL - delete all\n");
+            return;
+        }
+    }
+
+    uint64_t found = 0;
+    if (btree_lookup_ge(root, 0, &found, &out) == 0) {
+        kprintf("btree: FAIL - tree not empty\n");
+        return;
+    }
+
+    // A root over a chain of single-child nodes collapses to the leaf
+    // below, and every node of the chain is released.
+    uint32_t leaf = 0;
+    if (btree_insert(0, 1, 10, &leaf) < 0 ||
+        btree_insert(leaf, 2, 20, &leaf) < 0) {
+        kprintf("btree: FAIL - chain setup\n");
+        return;
+    }
+    uint32_t chain[2];
+    root = leaf;
+    for (int l = 0; l < 2; l++) {
+        struct btree_node node;
+        memzero(&node, sizeof(node));
+        chain[l] = balloc();
+        if (chain[l] == 0) {
+            kprintf("btree: FAIL - chain alloc\n");
+            return;
+        }
+        node.hdr.magic = BTREE_MAGIC;
+        node.hdr.type = BTREE_TYPE_NODE;
+        node.hdr.logical = chain[l];
+        node.hdr.generation = sb.generation + 1;
+        node.hdr.level = (uint16_t)(l + 1);
+        node.children[0] = root;
+        node.hdr.checksum = btree_node_checksum(&node);
+        struct buf *bp = bread(chain[l]);
+        memmove(bp->data, &node, sizeof(node));
+        bwrite(bp);
+        brelse(bp);
+        root = chain[l];
+    }
+    if (btree_delete(root, 1, &root) < 0 || root != leaf ||
+        btree_lookup(root, 2, &out) < 0 || out != 20 ||
+        brefcnt_get(chain[0]) != 0 || brefcnt_get(chain[1]) != 0) {
+        kprintf("btree: FAIL - delete collapsing a chain\n");
+        return;
+    }
+
+    kprintf("btree: delete OK\n");
+}
+
+static int test_range_count(uint64_t key, uint64_t value, void *arg) {
+    (void)key;
+    (void)value;
+    (*(int *)arg)++;
+    return 0;
+}
+
+static void test_btree_delete_range(void) {
+    kprintf("btree: testing range delete...\n");
+
+    uint32_t root = 0;
+    for (uint64_t k = 1; k <= 60; k++) {
+        if (btree_insert(root, k, k * 10, &root) < 0) {
+            kprintf("btree: FAIL - range setup\n");
+            return;
+        }
+    }
+
+    int removed = 0;
+    if (btree_delete_range(root, 11, 50, test_range_count, &removed,
+                           &root) < 0 || removed != 40) {
+        kprintf("btree: FAIL - range delete\n");
+        return;
+    }
+
+    uint64_t out = 0;
+    if (btree_lookup(root, 30, &out) == 0 ||
+        btree_lookup(root, 10, &out) < 0 || out != 100 ||
+        btree_lookup(root, 51, &out) < 0 || out != 510) {
+        kprintf("btree: FAIL - lookup after range delete\n");
+        return;
+    }
+
+    kprintf("btree: range delete OK\n");
+}
+
+static void test_btree_cursor(void) {
+    kprintf("btree: testing cursor...\n");
+
+    uint32_t root = 0;
+    for (uint64_t k = 2; k <= 60; k += 2) {
+        if (btree_insert(root, k, k + 1, &root) < 0) {
+            kprintf("btree: FAIL - cursor setup\n");
+            return;
+        }
+    }
+
+    struct btree_cursor cur;
+    uint64_t key = 0, val = 0, expect = 8;
+    int rc;
+    for (rc = btree_cursor_seek(&cur, root, 7); rc == 0;
+         rc = btree_cursor_next(&cur)) {
+        btree_cursor_get(&cur, &key, &val);
+        if (key != expect || val != key + 1) {
+            kprintf("btree: FAIL - cursor next\n");
+            return;
+        }
+        expect += 2;
+    }
+    if (expect != 62) {
+        kprintf("btree: FAIL - cursor end\n");
+        return;
+    }
+
+    if (btree_cursor_seek_le(&cur, root, 33) < 0 ||
+        btree_cursor_prev(&cur) < 0 ||
+        btree_cursor_get(&cur, &key, &val) < 0 || key != 30) {
+        kprintf("btree: FAIL - cursor prev\n");
+        return;
+    }
+
+    kprintf("btree: cursor OK\n");
+}
+
+static void test_btree_items(void) {
+    kprintf("btree: testing payload items...\n");
+
+    // Enough 40-byte items to split leaves by bytes rather than count
+    uint8_t buf[BTREE_ITEM_MAX];
+    uint32_t root = 0;
+    for (uint64_t k = 1; k <= 24; k++) {
+        for (uint32_t j = 0; j < sizeof(buf); j++) buf[j] = (uint8_t)k;
+        if (btree_insert_item(root, k, k * 10, buf, 40, &root) < 0) {
+            kprintf("btree: FAIL - item insert\n");
+            return;
+        }
+    }
+
+    // Shrink one payload and delete a run so leaves rebalance by bytes
+    if (btree_insert_item(root, 12, 120, buf, 8, &root) < 0 ||
+        btree_delete(root, 13, &root) < 0 ||
+        btree_delete(root, 14, &root) < 0) {
+        kprintf("btree: FAIL - item update\n");
+        return;
+    }
+
+    uint64_t val = 0;
+    uint32_t len = 0;
+    if (btree_lookup_item(root, 12, &val, buf, sizeof(buf), &len) < 0 ||
+        val != 120 || len != 8 || btree_lookup(root, 13, &val) == 0) {
+        kprintf("btree: FAIL - item lookup\n");
+        return;
+    }
+    if (btree_lookup_item(root, 20, &val, buf, sizeof(buf), &len) < 0 ||
+        len != 40 || buf[0] != 20 || buf[39] != 20) {
+        kprintf("btree: FAIL - item payload\n");
+        return;
+    }
+
+    kprintf("btree: payload items OK\n");
+}
+
 static void test_btree_persist(void) {
     kprintf("btree: testing persistence...\n");
 
@@ -424,13 +618,210 @@ static void test_extent_alloc(void) {
         return;
     }
 
+    // The commit folds the freed run back into the free-space tree
+    struct btree_cursor cur;
+    uint64_t k = 0, v = 0;
+    if (btree_cursor_seek_le(&cur, sb.extent_root, e1.start) < 0 ||
+        btree_cursor_get(&cur, &k, &v) < 0 ||
+        k + v < (uint64_t)e1.start + e1.len) {
+        kprintf("extent: FAIL - freed run not in tree\n");
+        return;
+    }
+
     struct extent e2;
     if (extent_alloc(8, &e2) < 0) {
         kprintf("extent: FAIL - realloc\n");
         return;
     }
 
-    kprintf("extent: OK (alloc %u len %u)\n", e2.start, e2.len);
+    struct extent_stats st;
+    extent_stats(&st);
+    if (st.free_extents == 0 || st.largest > st.free_blocks) {
+        kprintf("extent: FAIL - stats\n");
+        return;
+    }
+
+    kprintf("extent: OK (alloc %u len %u, %u free in %u extents)\n",
+            e2.start, e2.len, st.free_blocks, st.free_extents);
+}
+
+static void test_bmap(void) {
+    kprintf("fs: testing bitmap scans...\n");
+
+    // A run longer than a bitmap word, allocated, then freed around one
+    // block that stays in use.
+    struct extent e;
+    uint32_t start = 0, len = 0;
+    if (extent_commit() < 0 || extent_alloc(130, &e) < 0 ||
+        bmap_is_free(e.start) || bmap_is_free(e.start + 129) ||
+        bmap_next_run(e.start, e.start + 130, &start, &len) == 0) {
+        kprintf("fs: FAIL - bitmap setup\n");
+        return;
+    }
+    extent_free(e.start, 70);
+    extent_free(e.start + 71, 59);
+    if (extent_commit() < 0 ||
+        bmap_next_run(e.start, e.start + 130, &start, &len) < 0 ||
+        start != e.start || len != 70 ||
+        bmap_next_run(e.start + 70, e.start + 130, &start, &len) < 0 ||
+        start != e.start + 71 || len != 59 ||
+        bmap_is_free(e.start + 70) || !bmap_is_free(e.start + 71)) {
+        kprintf("fs: FAIL - bitmap runs\n");
+        return;
+    }
+
+    // The run joins up once the last block goes, and the scan stops at
+    // its limit.
+    extent_free(e.start + 70, 1);
+    if (extent_commit() < 0 ||
+        bmap_next_run(e.start, e.start + 130, &start, &len) < 0 ||
+        start != e.start || len != 130 ||
+        bmap_next_run(e.start + 3, e.start + 5, &start, &len) < 0 ||
+        start != e.start + 3 || len != 2) {
+        kprintf("fs: FAIL - bitmap run after free\n");
+        return;
+    }
+
+    // The commit's sync reads the run back from the bitmap into the tree.
+    struct btree_cursor cur;
+    uint64_t k = 0, v = 0;
+    if (btree_cursor_seek_le(&cur, sb.extent_root, e.start) < 0 ||
+        btree_cursor_get(&cur, &k, &v) < 0 ||
+        k + v < (uint64_t)e.start + 130) {
+        kprintf("fs: FAIL - bitmap run not in tree\n");
+        return;
+    }
+
+    kprintf("fs: bitmap scans OK\n");
+}
+
+// Whether the free-space tree holds blk.
+static int test_extent_tree_has(uint32_t blk) {
+    struct btree_cursor cur;
+    uint64_t k = 0, v = 0;
+    return btree_cursor_seek_le(&cur, sb.extent_root, blk) == 0 &&
+           btree_cursor_get(&cur, &k, &v) == 0 && k + v > blk;
+}
+
+static void test_extent_meta(void) {
+    kprintf("extent: testing metadata chunks...\n");
+
+    // Tree nodes come from a chunk carved off the end of the disk, which
+    // the free-space tree no longer holds.
+    uint32_t a = balloc();
+    uint32_t b = balloc();
+    if (a == 0 || b == 0 || a < sb.nblocks / 2 || b < sb.nblocks / 2 ||
+        test_extent_tree_has(a) || test_extent_tree_has(b)) {
+        kprintf("extent: FAIL - meta alloc\n");
+        return;
+    }
+
+    // A node freed inside a chunk stays with it: file data cannot have
+    // it, and later nodes take it back.
+    struct extent e;
+    bfree(b);
+    if (extent_commit() < 0 || !bmap_is_free(b) ||
+        test_extent_tree_has(b) || extent_alloc(1, &e) < 0 || e.start == b) {
+        kprintf("extent: FAIL - freed node left its chunk\n");
+        return;
+    }
+    extent_free(e.start, 1);
+
+    static uint32_t held[1024];
+    uint32_t n = 0;
+    while (n < 1024 && (n == 0 || held[n - 1] != b)) {
+        held[n] = balloc();
+        if (held[n++] == 0) {
+            kprintf("extent: FAIL - meta refill\n");
+            return;
+        }
+    }
+    if (held[n - 1] != b) {
+        kprintf("extent: FAIL - freed node not reused\n");
+        return;
+    }
+
+    // A chunk whose nodes are all freed goes back to the free-space tree
+    // at commit, unless it is the one in use. Three chunks' worth of
+    // nodes fills at least one chunk with nothing else.
+    uint32_t chunk = sb.nblocks / 256;
+    if (chunk < 16) chunk = 16;
+    if (chunk > 256) chunk = 256;
+    while (n < 1024 && n < 3 * chunk) {
+        held[n] = balloc();
+        if (held[n++] == 0) {
+            kprintf("extent: FAIL - meta refill\n");
+            return;
+        }
+    }
+    bfree(a);
+    for (uint32_t i = 0; i < n; i++) {
+        bfree(held[i]);
+    }
+    if (extent_commit() < 0) {
+        kprintf("extent: FAIL - meta commit\n");
+        return;
+    }
+    uint32_t back = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        back += test_extent_tree_has(held[i]) ? 1 : 0;
+    }
+    if (back < chunk) {
+        kprintf("extent: FAIL - empty chunk kept\n");
+        return;
+    }
+
+    kprintf("extent: metadata chunks OK\n");
+}
+
+static void test_extent_deferred(void) {
+    kprintf("extent: testing deferred frees...\n");
+
+    struct extent e;
+    if (extent_commit() < 0 || extent_alloc(1200, &e) < 0) {
+        kprintf("extent: FAIL - deferred setup\n");
+        return;
+    }
+
+    // Blocks freed one at a time in order join the run before them, and
+    // stay allocated until the commit.
+    uint32_t before = extent_deferred_blocks();
+    uint32_t runs = extent_deferred_runs();
+    for (uint32_t i = 0; i < 8; i++) {
+        extent_free(e.start + i, 1);
+    }
+    if (extent_deferred_blocks() != before + 8 ||
+        extent_deferred_runs() > runs + 1 || bmap_is_free(e.start)) {
+        kprintf("extent: FAIL - deferred append\n");
+        return;
+    }
+
+    // Every other block, then the ones in between: more runs than one
+    // page of the list holds. Only block 8 joins the run before it.
+    for (uint32_t i = 8; i < 1200; i += 2) {
+        extent_free(e.start + i, 1);
+    }
+    for (uint32_t i = 9; i < 1200; i += 2) {
+        extent_free(e.start + i, 1);
+    }
+    if (extent_deferred_blocks() != before + 1200 ||
+        extent_deferred_runs() > runs + 1192) {
+        kprintf("extent: FAIL - deferred list growth\n");
+        return;
+    }
+
+    // The commit frees them all, merged back into one range.
+    uint32_t start = 0, len = 0;
+    if (extent_commit() < 0 || extent_deferred_blocks() != 0 ||
+        bmap_next_run(e.start, e.start + 1200, &start, &len) < 0 ||
+        start != e.start || len != 1200 ||
+        !test_extent_tree_has(e.start) ||
+        !test_extent_tree_has(e.start + 1199)) {
+        kprintf("extent: FAIL - deferred apply\n");
+        return;
+    }
+
+    kprintf("extent: deferred frees OK\n");
 }
 
 static void test_root_tree(void) {
@@ -465,6 +856,122 @@ static void test_root_tree(void) {
             (unsigned)ext_root, (unsigned)fs_root);
 }
 
+static void test_tree_reclaim(void) {
+    kprintf("tree: testing node reclaim...\n");
+
+    uint32_t shared = 0;
+    for (uint64_t k = 1; k <= 30; k++) {
+        if (btree_insert(shared, k, k, &shared) < 0) {
+            kprintf("tree: FAIL - reclaim setup\n");
+            return;
+        }
+    }
+    if (extent_commit() < 0) {
+        kprintf("tree: FAIL - reclaim commit\n");
+        return;
+    }
+
+    // A shared root survives the copy. An exclusive one is rewritten in
+    // place until it is committed, and freed once replaced after that.
+    uint32_t copy = 0;
+    uint32_t again = 0;
+    uint32_t next = 0;
+    brefcnt_inc(shared);
+    if (btree_insert(shared, 100, 100, &copy) < 0 ||
+        brefcnt_get(shared) != 1 ||
+        btree_insert(copy, 101, 101, &again) < 0 || again != copy ||
+        extent_commit() < 0 ||
+        btree_insert(copy, 102, 102, &next) < 0 || next == copy ||
+        tree_reclaim(&sb_committed) < 1 || brefcnt_get(copy) != 0) {
+        kprintf("tree: FAIL - reclaim\n");
+        return;
+    }
+
+    uint64_t out = 0;
+    if (btree_lookup(shared, 100, &out) == 0 ||
+        btree_lookup(shared, 30, &out) < 0 ||
+        btree_lookup(next, 100, &out) < 0 ||
+        btree_lookup(next, 15, &out) < 0 || out != 15) {
+        kprintf("tree: FAIL - lookup after reclaim\n");
+        return;
+    }
+
+    // More subvolume roots than fit the fixed array still get reclaimed.
+    for (int i = 0; i < 70; i++) {
+        uint64_t id = 0;
+        if (tree_subvol_create(&id) < 0) {
+            kprintf("tree: FAIL - reclaim subvolumes\n");
+            return;
+        }
+    }
+    copy = next;
+    if (extent_commit() < 0 ||
+        btree_insert(copy, 103, 103, &next) < 0 || next == copy ||
+        tree_reclaim(&sb_committed) < 1 || brefcnt_get(copy) != 0) {
+        kprintf("tree: FAIL - reclaim with many subvolumes\n");
+        return;
+    }
+
+    kprintf("tree: node reclaim OK\n");
+}
+
+static uint64_t test_fs_key(uint32_t ino, uint16_t type, uint32_t sub) {
+    return ((uint64_t)ino << 32) | ((uint64_t)type << 28) | sub;
+}
+
+// What a remount would find for ino: its size and the byte at off, read
+// through the superblock on disk instead of the in-memory trees, buffers
+// and caches.
+static int test_disk_file(uint32_t ino, uint64_t off, uint64_t *size_out,
+                          uint8_t *byte_out) {
+    struct superblock disk;
+    struct buf *bp = bread(1);
+    memmove(&disk, bp->data, sizeof(disk));
+    brelse(bp);
+
+    uint64_t fs_root = 0;
+    uint64_t val = 0;
+    if (btree_lookup(disk.root_tree,
+                     ROOT_ITEM_SUBVOL_BASE + tree_subvol_current(),
+                     &fs_root) < 0 ||
+        btree_lookup((uint32_t)fs_root, test_fs_key(ino, FS_ITEM_INODE, 0),
+                     &val) < 0) {
+        return -1;
+    }
+    *size_out = val & 0x0000FFFFFFFFFFFFULL;
+
+    // Inline data, else the extent covering off.
+    uint8_t data[BTREE_ITEM_MAX];
+    uint32_t dlen = 0;
+    if (btree_lookup_item((uint32_t)fs_root,
+                          test_fs_key(ino, FS_ITEM_INLINE,
+                                      (uint32_t)(off / BTREE_ITEM_MAX)),
+                          &val, data, sizeof(data), &dlen) == 0) {
+        if (off % BTREE_ITEM_MAX >= dlen) {
+            return -1;
+        }
+        *byte_out = data[off % BTREE_ITEM_MAX];
+        return 0;
+    }
+    uint32_t fblock = (uint32_t)(off / BSIZE);
+    uint64_t key = 0;
+    if (btree_lookup_le((uint32_t)fs_root,
+                        test_fs_key(ino, FS_ITEM_EXTENT, fblock), &key,
+                        &val) < 0 ||
+        key < test_fs_key(ino, FS_ITEM_EXTENT, 0)) {
+        return -1;
+    }
+    uint32_t first = (uint32_t)(key & 0x0fffffff);
+    uint32_t len = (uint32_t)val & 0x7fffffffu;
+    if (fblock - first >= len) {
+        return -1;
+    }
+    bp = bread((uint32_t)(val >> 32) + fblock - first);
+    *byte_out = bp->data[off % BSIZE];
+    brelse(bp);
+    return 0;
+}
+
 static void test_fs_tree(void) {
     kprintf("fs_tree: testing fs tree...\n");
 
@@ -491,6 +998,13 @@ static void test_fs_tree(void) {
         kprintf("fs_tree: FAIL - dir lookup\n");
         return;
     }
+    char hname[8];
+    if (fs_tree_dir_find_name(1, 42, hname, sizeof(hname)) < 0 ||
+        strncmp(hname, "hello", sizeof(hname)) != 0 ||
+        fs_tree_dir_lookup(1, "hell", &out_ino) == 0) {
+        kprintf("fs_tree: FAIL - dir name\n");
+        return;
+    }
 
     struct extent ex;
     if (extent_alloc(4, &ex) < 0) {
@@ -550,6 +1064,71 @@ static void test_fs_tree(void) {
         return;
     }
 
+    // Small appends are buffered and written back as one extent.
+    for (uint32_t off = 0; off < BSIZE * 4; off += sizeof(buf)) {
+        if (fs_tree_file_write(101, off, buf, sizeof(buf)) < 0) {
+            kprintf("fs_tree: FAIL - buffered write\n");
+            return;
+        }
+    }
+    if (fs_tree_writeback(101) < 0 ||
+        fs_tree_extent_lookup(101, 0, &start, &len) < 0 || len != 4) {
+        kprintf("fs_tree: FAIL - writeback\n");
+        return;
+    }
+
+    // A commit carries buffered data of files nobody closed or synced.
+    uint8_t pat[100];
+    for (int i = 0; i < (int)sizeof(pat); i++) {
+        pat[i] = (uint8_t)(i * 11 + 3);
+    }
+    uint32_t total = 22 * sizeof(pat); // Into the third block
+    for (uint32_t off = 0; off < total; off += sizeof(pat)) {
+        if (fs_tree_file_write(103, off, pat, sizeof(pat)) < 0) {
+            kprintf("fs_tree: FAIL - buffered write\n");
+            return;
+        }
+    }
+    uint64_t disk_size = 0;
+    uint8_t b0 = 0, b1 = 0;
+    if (txn_commit() < 0 ||
+        test_disk_file(103, 5, &disk_size, &b0) < 0 ||
+        test_disk_file(103, total - 1, &disk_size, &b1) < 0 ||
+        disk_size != total || b0 != pat[5] || b1 != pat[sizeof(pat) - 1] ||
+        fs_tree_truncate(103, 0) < 0) {
+        kprintf("fs_tree: FAIL - buffered data not committed\n");
+        return;
+    }
+
+    // Reserved blocks read as zeros; punched ones lose their extent.
+    if (fs_tree_fallocate(101, 0, BSIZE * 4, BSIZE * 4) < 0 ||
+        fs_tree_file_read(101, BSIZE * 5, buf, sizeof(buf)) != sizeof(buf) ||
+        buf[0] != 0 ||
+        fs_tree_fallocate(101, FALLOC_PUNCH_HOLE, 0, BSIZE * 4) < 0 ||
+        fs_tree_extent_lookup(101, 0, &start, &len) == 0 ||
+        fs_tree_truncate(101, 0) < 0) {
+        kprintf("fs_tree: FAIL - fallocate\n");
+        return;
+    }
+
+    // Two blocks kept apart on disk are gathered into one extent. The
+    // first fills its block so it is not kept inline.
+    struct extent gap;
+    if (fs_tree_file_write(102, BSIZE - sizeof(msg), msg, sizeof(msg)) < 0 ||
+        fs_tree_writeback(102) < 0 ||
+        fs_tree_extent_lookup(102, 0, &start, &len) < 0 ||
+        extent_alloc_near(start + len, 1, &gap) < 0 ||
+        fs_tree_file_write(102, BSIZE, msg2, sizeof(msg2)) < 0 ||
+        fs_tree_writeback(102) < 0 ||
+        fs_tree_defrag(102, 0, 0) != 2 ||
+        fs_tree_extent_lookup(102, 0, &start, &len) < 0 || len != 2 ||
+        fs_tree_file_read(102, BSIZE, buf2, sizeof(msg2)) != sizeof(msg2) ||
+        buf2[0] != msg2[0] || fs_tree_truncate(102, 0) < 0) {
+        kprintf("fs_tree: FAIL - defrag\n");
+        return;
+    }
+    extent_free(gap.start, gap.len);
+
     if (fs_tree_truncate(100, 0) < 0) {
         kprintf("fs_tree: FAIL - truncate\n");
         return;
@@ -595,6 +1174,20 @@ static void test_fs_tree(void) {
         return;
     }
 
+    // These two names share a 24-bit hash; each must keep its entry.
+    uint32_t c1 = 0, c2 = 0, cl = 0;
+    if (fs_tree_create_file("/f28164", &c1) < 0 ||
+        fs_tree_create_file("/f69000", &c2) < 0 ||
+        fs_tree_lookup_path("/f28164", &cl) < 0 || cl != c1 ||
+        fs_tree_lookup_path("/f69000", &cl) < 0 || cl != c2 ||
+        fs_tree_unlink_path("/f28164") < 0 ||
+        fs_tree_lookup_path("/f28164", &cl) == 0 ||
+        fs_tree_lookup_path("/f69000", &cl) < 0 || cl != c2 ||
+        fs_tree_unlink_path("/f69000") < 0) {
+        kprintf("fs_tree: FAIL - dirent hash collision\n");
+        return;
+    }
+
     if (fs_tree_create_file("/a", 0) < 0 ||
         fs_tree_create_file("/b", 0) < 0) {
         kprintf("fs_tree: FAIL - readdir setup\n");
@@ -617,6 +1210,570 @@ static void test_fs_tree(void) {
     kprintf("fs_tree: OK\n");
 }
 
+static void test_fs_tree_reflink(void) {
+    kprintf("fs_tree: testing partial reflink writes...\n");
+
+    uint32_t a = 0, b = 0;
+    uint8_t buf[BSIZE];
+    if (fs_tree_create_file("/rf_a", &a) < 0) {
+        kprintf("fs_tree: FAIL - reflink create\n");
+        return;
+    }
+    for (uint32_t i = 0; i < 4; i++) {
+        for (uint32_t k = 0; k < BSIZE; k++) {
+            buf[k] = (uint8_t)(i + 1);
+        }
+        if (fs_tree_file_write(a, i * BSIZE, buf, BSIZE) != BSIZE) {
+            kprintf("fs_tree: FAIL - reflink write\n");
+            return;
+        }
+    }
+    uint32_t start = 0, len = 0;
+    if (fs_tree_writeback(a) < 0 ||
+        fs_tree_extent_lookup(a, 0, &start, &len) < 0 || len != 4 ||
+        fs_tree_clone_path_at(1, "/rf_a", "/rf_b") < 0 ||
+        fs_tree_lookup_path("/rf_b", &b) < 0) {
+        kprintf("fs_tree: FAIL - reflink clone\n");
+        return;
+    }
+
+    // One byte into block 1 copies that block alone.
+    uint8_t x = 0xee;
+    uint32_t s0 = 0, l0 = 0, s1 = 0, l1 = 0, s2 = 0, l2 = 0;
+    if (fs_tree_file_write(b, BSIZE + 5, &x, 1) != 1 ||
+        fs_tree_extent_lookup(b, 0, &s0, &l0) < 0 ||
+        fs_tree_extent_lookup(b, BSIZE, &s1, &l1) < 0 ||
+        fs_tree_extent_lookup(b, BSIZE * 2, &s2, &l2) < 0 ||
+        s0 != start || l0 != 1 || l1 != 1 ||
+        (s1 >= start && s1 < start + 4) ||
+        s2 != start + 2 || l2 != 2) {
+        kprintf("fs_tree: FAIL - reflink partial copy\n");
+        return;
+    }
+    if (fs_tree_file_read(a, BSIZE + 5, &x, 1) != 1 || x != 2 ||
+        fs_tree_file_read(b, BSIZE + 4, &x, 1) != 1 || x != 2 ||
+        fs_tree_file_read(b, BSIZE + 5, &x, 1) != 1 || x != 0xee) {
+        kprintf("fs_tree: FAIL - reflink data\n");
+        return;
+    }
+
+    // Cutting into a shared block must not zero the other file's copy.
+    if (fs_tree_truncate(b, 10) < 0 ||
+        fs_tree_file_read(a, 20, &x, 1) != 1 || x != 1) {
+        kprintf("fs_tree: FAIL - reflink truncate\n");
+        return;
+    }
+    if (fs_tree_unlink_path("/rf_a") < 0 ||
+        fs_tree_file_read(b, 5, &x, 1) != 1 || x != 1 ||
+        fs_tree_unlink_path("/rf_b") < 0) {
+        kprintf("fs_tree: FAIL - reflink unlink\n");
+        return;
+    }
+
+    kprintf("fs_tree: reflink OK\n");
+}
+
+static void test_fs_tree_inline(void) {
+    kprintf("fs_tree: testing inline data...\n");
+
+    uint32_t ino = 0, copy = 0;
+    uint8_t buf[300];
+    uint8_t rd[300];
+    for (int i = 0; i < 300; i++) {
+        buf[i] = (uint8_t)(i * 7 + 1);
+    }
+    uint32_t start = 0, len = 0;
+    if (fs_tree_create_file("/in_a", &ino) < 0 ||
+        fs_tree_file_write(ino, 0, buf, 100) != 100 ||
+        fs_tree_writeback(ino) < 0 ||
+        fs_tree_extent_lookup(ino, 0, &start, &len) == 0) {
+        kprintf("fs_tree: FAIL - inline write\n");
+        return;
+    }
+
+    // Writes within the limit stay inline; a hole reads back as zeros.
+    uint8_t zero = 0xff;
+    if (fs_tree_file_write(ino, 150, buf + 150, 50) != 50 ||
+        fs_tree_extent_lookup(ino, 0, &start, &len) == 0 ||
+        fs_tree_file_read(ino, 0, rd, 200) != 200 ||
+        fs_tree_file_read(ino, 120, &zero, 1) != 1 || zero != 0 ||
+        rd[99] != buf[99] || rd[199] != buf[199]) {
+        kprintf("fs_tree: FAIL - inline overwrite\n");
+        return;
+    }
+
+    // Truncate trims the items; a clone copies them.
+    if (fs_tree_truncate(ino, 70) < 0 ||
+        fs_tree_clone_path_at(1, "/in_a", "/in_b") < 0 ||
+        fs_tree_lookup_path("/in_b", &copy) < 0 ||
+        fs_tree_file_read(copy, 0, rd, sizeof(rd)) != 70 ||
+        rd[69] != buf[69]) {
+        kprintf("fs_tree: FAIL - inline truncate/clone\n");
+        return;
+    }
+
+    // Growing past the limit moves the data into an extent.
+    if (fs_tree_file_write(copy, 70, buf + 70, 230) != 230 ||
+        fs_tree_writeback(copy) < 0 ||
+        fs_tree_extent_lookup(copy, 0, &start, &len) < 0 ||
+        fs_tree_file_read(copy, 0, rd, sizeof(rd)) != 300 ||
+        rd[0] != buf[0] || rd[69] != buf[69] || rd[299] != buf[299] ||
+        fs_tree_file_read(ino, 0, rd, sizeof(rd)) != 70) {
+        kprintf("fs_tree: FAIL - inline convert\n");
+        return;
+    }
+    if (fs_tree_unlink_path("/in_a") < 0 || fs_tree_unlink_path("/in_b") < 0) {
+        kprintf("fs_tree: FAIL - inline unlink\n");
+        return;
+    }
+
+    kprintf("fs_tree: inline OK\n");
+}
+
+static void test_fs_tree_dcache(void) {
+    kprintf("fs_tree: testing dentry cache...\n");
+
+    uint32_t dir = 0, x = 0, y = 0, ino = 0;
+    if (fs_tree_create_dir("/dc") < 0 ||
+        fs_tree_lookup_path("/dc", &dir) < 0 ||
+        fs_tree_create_file("/dc/x", &x) < 0 ||
+        fs_tree_lookup_path("/dc/x", &ino) < 0 || ino != x ||
+        fs_tree_lookup_path("/dc/../dc/./x", &ino) < 0 || ino != x) {
+        kprintf("fs_tree: FAIL - dcache lookup\n");
+        return;
+    }
+
+    // A cached miss goes away once the name exists.
+    if (fs_tree_lookup_path("/dc/y", &ino) == 0 ||
+        fs_tree_create_file("/dc/y", &y) < 0 ||
+        fs_tree_lookup_path("/dc/y", &ino) < 0 || ino != y) {
+        kprintf("fs_tree: FAIL - dcache negative\n");
+        return;
+    }
+
+    // Rename and unlink update the cached names.
+    if (fs_tree_rename_path("/dc/x", "/dc/z") < 0 ||
+        fs_tree_lookup_path("/dc/x", &ino) == 0 ||
+        fs_tree_lookup_path("/dc/z", &ino) < 0 || ino != x ||
+        fs_tree_unlink_path("/dc/z") < 0 ||
+        fs_tree_lookup_path("/dc/z", &ino) == 0) {
+        kprintf("fs_tree: FAIL - dcache rename/unlink\n");
+        return;
+    }
+
+    // A name created in a snapshot is not seen from the subvolume it was
+    // taken of.
+    uint64_t prev = tree_subvol_current();
+    uint64_t snap = 0;
+    if (fs_tree_writeback(0) < 0 || tree_subvol_create(&snap) < 0 ||
+        tree_subvol_set_current(snap) < 0 ||
+        fs_tree_lookup_path("/dc/y", &ino) < 0 || ino != y ||
+        fs_tree_create_file("/dc/s", &ino) < 0 ||
+        tree_subvol_set_current(prev) < 0 ||
+        fs_tree_lookup_path("/dc/s", &ino) == 0) {
+        tree_subvol_set_current(prev);
+        kprintf("fs_tree: FAIL - dcache subvolume\n");
+        return;
+    }
+
+    if (fs_tree_unlink_path("/dc/y") < 0 || fs_tree_unlink_path("/dc") < 0) {
+        kprintf("fs_tree: FAIL - dcache cleanup\n");
+        return;
+    }
+
+    kprintf("fs_tree: dentry cache OK\n");
+}
+
+static void test_fs_tree_icache(void) {
+    kprintf("fs_tree: testing inode cache...\n");
+
+    uint32_t ino = 0;
+    uint8_t buf[BSIZE];
+    for (int i = 0; i < BSIZE; i++) {
+        buf[i] = (uint8_t)(i * 3 + 1);
+    }
+    if (fs_tree_create_file("/ic", &ino) < 0 ||
+        fs_tree_file_write(ino, 0, buf, 400) != 400 ||
+        fs_tree_writeback(ino) < 0 || txn_commit() < 0) {
+        kprintf("fs_tree: FAIL - icache setup\n");
+        return;
+    }
+
+    // Appends within the written block leave the tree alone until the
+    // transaction closes.
+    uint64_t before = 0, after = 0, size = 0;
+    uint16_t type = 0;
+    uint8_t rd[BSIZE];
+    if (tree_root_get(ROOT_ITEM_FS_ROOT, &before) < 0 ||
+        fs_tree_file_write(ino, 400, buf + 400, 100) != 100 ||
+        fs_tree_file_write(ino, 500, buf + 500, 100) != 100 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &after) < 0 || after != before ||
+        fs_tree_get_inode(ino, &type, &size) < 0 || size != 600 ||
+        fs_tree_file_read(ino, 0, rd, sizeof(rd)) != 600 ||
+        rd[599] != buf[599]) {
+        kprintf("fs_tree: FAIL - icache deferred size\n");
+        return;
+    }
+
+    if (txn_commit() < 0 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &after) < 0 || after == before ||
+        fs_tree_get_inode(ino, &type, &size) < 0 || size != 600) {
+        kprintf("fs_tree: FAIL - icache flush\n");
+        return;
+    }
+
+    if (fs_tree_unlink_path("/ic") < 0 ||
+        fs_tree_get_inode(ino, &type, &size) == 0) {
+        kprintf("fs_tree: FAIL - icache unlink\n");
+        return;
+    }
+
+    // More deferred sizes than slots, then inode updates landing on the
+    // slots they hold: every size must survive, in memory and on disk.
+    for (uint32_t i = 0; i < 80; i++) {
+        if (fs_tree_file_write(2000 + i, 0, buf, 400) != 400 ||
+            fs_tree_writeback(2000 + i) < 0) {
+            kprintf("fs_tree: FAIL - icache fill setup\n");
+            return;
+        }
+    }
+    if (txn_commit() < 0) {
+        kprintf("fs_tree: FAIL - icache fill commit\n");
+        return;
+    }
+    for (uint32_t i = 0; i < 80; i++) {
+        if (fs_tree_file_write(2000 + i, 400, buf, i + 1) != (int)(i + 1)) {
+            kprintf("fs_tree: FAIL - icache fill defer\n");
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < 80; i++) {
+        if (fs_tree_set_inode(3000 + i, T_FILE, 0) < 0) {
+            kprintf("fs_tree: FAIL - icache fill evict\n");
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < 80; i++) {
+        if (fs_tree_get_inode(2000 + i, &type, &size) < 0 ||
+            size != 401 + i) {
+            kprintf("fs_tree: FAIL - icache fill lost size\n");
+            return;
+        }
+    }
+    if (txn_commit() < 0) {
+        kprintf("fs_tree: FAIL - icache fill commit\n");
+        return;
+    }
+    for (uint32_t i = 0; i < 80; i++) {
+        uint8_t last = 0;
+        if (test_disk_file(2000 + i, 400 + i, &size, &last) < 0 ||
+            size != 401 + i || last != buf[i]) {
+            kprintf("fs_tree: FAIL - icache fill lost size on disk\n");
+            return;
+        }
+        if (fs_tree_truncate(2000 + i, 0) < 0) {
+            kprintf("fs_tree: FAIL - icache fill cleanup\n");
+            return;
+        }
+    }
+
+    kprintf("fs_tree: inode cache OK\n");
+}
+
+static void test_fs_tree_extent_map(void) {
+    kprintf("fs_tree: testing extent map cache...\n");
+
+    uint32_t ino = 0, copy = 0;
+    uint8_t buf[BSIZE];
+    uint8_t x = 0;
+    for (int b = 0; b < 4; b++) {
+        memzero(buf, sizeof(buf));
+        buf[0] = (uint8_t)(b + 1);
+        if ((b == 0 && fs_tree_create_file("/em", &ino) < 0) ||
+            fs_tree_file_write(ino, (uint64_t)b * BSIZE, buf,
+                               BSIZE) != BSIZE) {
+            kprintf("fs_tree: FAIL - extent map setup\n");
+            return;
+        }
+    }
+    if (fs_tree_writeback(ino) < 0) {
+        kprintf("fs_tree: FAIL - extent map writeback\n");
+        return;
+    }
+
+    // Sequential reads go through the cached extent.
+    for (int b = 0; b < 4; b++) {
+        if (fs_tree_file_read(ino, (uint64_t)b * BSIZE, &x, 1) != 1 ||
+            x != b + 1) {
+            kprintf("fs_tree: FAIL - extent map read\n");
+            return;
+        }
+    }
+
+    // Breaking sharing moves block 1; the cached extent must not survive.
+    x = 0xee;
+    if (fs_tree_clone_path_at(1, "/em", "/em2") < 0 ||
+        fs_tree_lookup_path("/em2", &copy) < 0 ||
+        fs_tree_file_write(ino, BSIZE, &x, 1) != 1 ||
+        fs_tree_file_read(ino, BSIZE, &x, 1) != 1 || x != 0xee ||
+        fs_tree_file_read(copy, BSIZE, &x, 1) != 1 || x != 2 ||
+        fs_tree_file_read(ino, 2 * BSIZE, &x, 1) != 1 || x != 3) {
+        kprintf("fs_tree: FAIL - extent map after cow\n");
+        return;
+    }
+
+    // Neither must a cached hole or a truncated extent.
+    x = 9;
+    if (fs_tree_truncate(ino, BSIZE + 1) < 0 ||
+        fs_tree_file_write(ino, 3 * BSIZE, &x, 1) != 1 ||
+        fs_tree_file_read(ino, 2 * BSIZE, &x, 1) != 1 || x != 0 ||
+        fs_tree_writeback(ino) < 0 ||
+        fs_tree_file_read(ino, 3 * BSIZE, &x, 1) != 1 || x != 9 ||
+        fs_tree_file_read(ino, 2 * BSIZE, &x, 1) != 1 || x != 0) {
+        kprintf("fs_tree: FAIL - extent map after truncate\n");
+        return;
+    }
+
+    if (fs_tree_unlink_path("/em") < 0 || fs_tree_unlink_path("/em2") < 0) {
+        kprintf("fs_tree: FAIL - extent map unlink\n");
+        return;
+    }
+
+    kprintf("fs_tree: extent map cache OK\n");
+}
+
+static void test_tree_snapshot(void) {
+    kprintf("tree: testing pinned readers...\n");
+
+    struct tree_snapshot snap;
+    if (tree_read_begin(&snap) < 0 || snap.fs_root == 0) {
+        kprintf("tree: FAIL - read begin\n");
+        return;
+    }
+
+    // The replaced root must outlive the commit while it is pinned.
+    uint32_t old = snap.fs_root;
+    uint64_t key = 0;
+    if (fs_tree_set_inode(43, T_FILE, 1) < 0 || extent_commit() < 0 ||
+        brefcnt_get(old) != 1 ||
+        btree_lookup_ge(old, 0, &key, 0) < 0) {
+        tree_read_end(&snap);
+        kprintf("tree: FAIL - pinned root\n");
+        return;
+    }
+
+    tree_read_end(&snap);
+    if (extent_commit() < 0 || brefcnt_get(old) != 0) {
+        kprintf("tree: FAIL - unpinned root kept\n");
+        return;
+    }
+
+    // A snapshot is of the last commit unless it asks for the open
+    // transaction.
+    struct tree_snapshot open;
+    uint64_t val = 0;
+    if (fs_tree_set_inode(44, T_FILE, 1) < 0 ||
+        tree_read_begin(&snap) < 0) {
+        kprintf("tree: FAIL - committed snapshot\n");
+        return;
+    }
+    if (tree_read_begin_open(&open) < 0) {
+        tree_read_end(&snap);
+        kprintf("tree: FAIL - open snapshot\n");
+        return;
+    }
+    int seen = btree_lookup(snap.fs_root, test_fs_key(44, FS_ITEM_INODE, 0),
+                            &val) == 0;
+    int seen_open = btree_lookup(open.fs_root,
+                                 test_fs_key(44, FS_ITEM_INODE, 0), &val) == 0;
+    tree_read_end(&open);
+    tree_read_end(&snap);
+    if (seen || !seen_open || snap.generation != sb_committed.generation ||
+        extent_commit() < 0) {
+        kprintf("tree: FAIL - snapshot of the open transaction\n");
+        return;
+    }
+
+    kprintf("tree: pinned readers OK\n");
+}
+
+static void test_txn(void) {
+    kprintf("txn: testing group commit...\n");
+
+    if (txn_commit() < 0) {
+        kprintf("txn: FAIL - initial commit\n");
+        return;
+    }
+    struct txn before;
+    txn_stat(&before);
+    uint64_t gen = sb.generation;
+
+    // Updates join the open transaction without a superblock write, and
+    // the nodes it wrote are rewritten in place.
+    uint64_t first = 0;
+    uint64_t second = 0;
+    if (fs_tree_set_inode(61, T_FILE, 1) < 0 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &first) < 0 ||
+        fs_tree_set_inode(61, T_FILE, 2) < 0 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &second) < 0) {
+        kprintf("txn: FAIL - update\n");
+        return;
+    }
+    if (sb.generation != gen || first != second) {
+        kprintf("txn: FAIL - update committed or copied\n");
+        return;
+    }
+
+    if (txn_commit() < 0 || sb.generation != gen + 1) {
+        kprintf("txn: FAIL - commit\n");
+        return;
+    }
+    struct txn after;
+    txn_stat(&after);
+    uint64_t size = 0;
+    uint16_t type = 0;
+    if (after.commits != before.commits + 1 ||
+        fs_tree_get_inode(61, &type, &size) < 0 || size != 2) {
+        kprintf("txn: FAIL - after commit\n");
+        return;
+    }
+
+    // Buffered file data opens the transaction and goes out with it, with
+    // the file still open and never synced.
+    uint32_t ino = 0;
+    uint8_t msg[40];
+    for (int i = 0; i < (int)sizeof(msg); i++) {
+        msg[i] = (uint8_t)(i + 0x40);
+    }
+    uint64_t disk_size = 0;
+    uint8_t b = 0;
+    struct txn open;
+    if (fs_tree_create_file("/txw", &ino) < 0 || txn_commit() < 0 ||
+        fs_tree_file_write(ino, 0, msg, sizeof(msg)) != (int)sizeof(msg)) {
+        kprintf("txn: FAIL - buffered write\n");
+        return;
+    }
+    txn_stat(&open);
+    if (!open.dirty || test_disk_file(ino, 0, &disk_size, &b) == 0) {
+        kprintf("txn: FAIL - buffered write outside the transaction\n");
+        return;
+    }
+    if (txn_commit() < 0 || test_disk_file(ino, 39, &disk_size, &b) < 0 ||
+        disk_size != sizeof(msg) || b != msg[39] ||
+        fs_tree_unlink_path("/txw") < 0) {
+        kprintf("txn: FAIL - buffered write not committed\n");
+        return;
+    }
+    txn_stat(&after);
+
+    kprintf("txn: OK (%u commits)\n", (unsigned)after.commits);
+}
+
+static void test_txn_pipeline(void) {
+    kprintf("txn: testing commit pipeline...\n");
+
+    uint64_t closed_root = 0;
+    if (txn_commit() < 0 || fs_tree_set_inode(62, T_FILE, 1) < 0 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &closed_root) < 0) {
+        kprintf("txn: FAIL - pipeline setup\n");
+        return;
+    }
+    uint64_t gen = sb.generation;
+    struct superblock closed;
+    if (extent_commit_begin(&closed) < 0 || closed.generation != gen + 1) {
+        kprintf("txn: FAIL - close\n");
+        return;
+    }
+
+    // The next transaction copies the closed one's nodes rather than
+    // rewriting them under the commit in flight.
+    uint64_t open_root = 0;
+    if (fs_tree_set_inode(62, T_FILE, 2) < 0 ||
+        tree_root_get(ROOT_ITEM_FS_ROOT, &open_root) < 0 ||
+        open_root == closed_root) {
+        kprintf("txn: FAIL - update after close\n");
+        return;
+    }
+
+    // Its commit keeps what the open transaction replaced.
+    while (bflush_closed()) {
+    }
+    if (extent_commit_end(&closed) < 0 ||
+        sb_committed.generation != gen + 1 ||
+        brefcnt_get((uint32_t)closed_root) != 1) {
+        kprintf("txn: FAIL - closed commit\n");
+        return;
+    }
+
+    uint64_t size = 0;
+    uint16_t type = 0;
+    if (txn_commit() < 0 || brefcnt_get((uint32_t)closed_root) != 0 ||
+        fs_tree_get_inode(62, &type, &size) < 0 || size != 2) {
+        kprintf("txn: FAIL - open commit\n");
+        return;
+    }
+
+    kprintf("txn: pipeline OK\n");
+}
+
+static uint32_t test_disk_log_root(void) {
+    struct superblock disk;
+    struct buf *bp = bread(1);
+    memmove(&disk, bp->data, sizeof(disk));
+    brelse(bp);
+    return disk.generation == sb.generation ? disk.log_root : 0;
+}
+
+static void test_tree_log(void) {
+    kprintf("tree_log: testing fsync...\n");
+
+    uint32_t ino = 0;
+    if (txn_commit() < 0 || fs_tree_create_file("/tlog", &ino) < 0) {
+        kprintf("tree_log: FAIL - create\n");
+        return;
+    }
+    uint8_t buf[64];
+    for (int i = 0; i < 64; i++) {
+        buf[i] = (uint8_t)(i * 5);
+    }
+    uint64_t gen = sb.generation;
+    if (fs_tree_file_write(ino, 0, buf, sizeof(buf)) != (int)sizeof(buf) ||
+        fs_tree_fsync(ino, 0) < 0) {
+        kprintf("tree_log: FAIL - fsync\n");
+        return;
+    }
+
+    // The log went out under the last commit's superblock, not a new one.
+    uint32_t log = tree_log_root(tree_subvol_current());
+    if (sb.generation != gen || log == 0 || test_disk_log_root() == 0) {
+        kprintf("tree_log: FAIL - log not written\n");
+        return;
+    }
+
+    // Replaying onto the tree that already holds the changes is a no-op.
+    uint8_t rd[64];
+    if (fs_tree_log_replay(tree_subvol_current(), log) < 0 ||
+        fs_tree_file_read(ino, 0, rd, sizeof(rd)) != (int)sizeof(rd)) {
+        kprintf("tree_log: FAIL - replay\n");
+        return;
+    }
+    for (int i = 0; i < 64; i++) {
+        if (rd[i] != buf[i]) {
+            kprintf("tree_log: FAIL - data after replay\n");
+            return;
+        }
+    }
+
+    if (txn_commit() < 0 || tree_log_root(tree_subvol_current()) != 0 ||
+        test_disk_log_root() != 0) {
+        kprintf("tree_log: FAIL - log kept after commit\n");
+        return;
+    }
+    fs_tree_unlink_path("/tlog");
+
+    kprintf("tree_log: OK\n");
+}
+
 static void install_user_bins(void) {
     fs_tree_init();
     (void)fs_tree_create_dir("/bin");
@@ -642,7 +1799,9 @@ static void install_user_bins(void) {
         }
         fs_tree_truncate(ino, 0);
         fs_tree_file_write(ino, 0, bins[i].data, bins[i].len);
+        fs_tree_writeback(ino);
     }
+    txn_commit();
 }
 
 void kmain(uint64_t hartid, const void *dtb) {
@@ -674,11 +1833,29 @@ void kmain(uint64_t hartid, const void *dtb) {
 
     test_filesystem();
     test_btree();
+    test_btree_delete();
+    test_btree_cursor();
+    test_btree_delete_range();
+    test_btree_items();
     test_btree_persist();
     test_extent_alloc();
+    test_bmap();
+    test_extent_meta();
+    test_extent_deferred();
     test_root_tree();
+    test_tree_reclaim();
     test_fs_tree();
+    test_fs_tree_reflink();
+    test_fs_tree_inline();
+    test_fs_tree_dcache();
+    test_fs_tree_icache();
+    test_fs_tree_extent_map();
+    test_tree_snapshot();
+    test_txn();
+    test_txn_pipeline();
+    test_tree_log();
     install_user_bins();
+    txn_start();
 
 
 
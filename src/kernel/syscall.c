@@ -6,6 +6,7 @@
 #include "kernel/fs.h"
 #include "kernel/fs_tree.h"
 #include "kernel/tree.h"
+#include "kernel/txn.h"
 #include "kernel/vm.h"
 #include "kernel/string.h"
 #include "kernel/kalloc.h"
@@ -522,6 +523,68 @@ void syscall_handler(struct trapframe * tf) {
             break;
         }
 
+        case SYSCALL_FALLOCATE: {
+            struct proc *p = myproc();
+            int fd = (int)tf->a0;
+            int mode = (int)tf->a1;
+            uint64_t off = tf->a2;
+            uint64_t len = tf->a3;
+
+            if (fd < 0 || fd >= NOFILE || !p->ofile[fd] ||
+                p->ofile[fd]->type != FD_TREE || !p->ofile[fd]->writable) {
+                tf->a0 = (uint64_t)-1;
+                break;
+            }
+            if (fs_tree_fallocate(p->ofile[fd]->tree_ino, mode, off, len) < 0) {
+                tf->a0 = (uint64_t)-1;
+                break;
+            }
+            tf->a0 = 0;
+            break;
+        }
+
+        case SYSCALL_FSYNC:
+        case SYSCALL_FDATASYNC: {
+            struct proc *p = myproc();
+            int fd = (int)tf->a0;
+
+            if (fd < 0 || fd >= NOFILE || !p->ofile[fd]) {
+                tf->a0 = (uint64_t)-1;
+                break;
+            }
+            int r = 0;
+            if (p->ofile[fd]->type == FD_TREE) {
+                r = fs_tree_fsync(p->ofile[fd]->tree_ino,
+                                  syscall_num == SYSCALL_FDATASYNC);
+            } else if (p->ofile[fd]->type == FD_INODE) {
+                r = txn_commit();
+            }
+            tf->a0 = (r < 0) ? (uint64_t)-1 : 0;
+            break;
+        }
+
+        case SYSCALL_DEFRAG: {
+            struct proc *p = myproc();
+            uint64_t upath = tf->a0;
+            int mode = (int)tf->a1;
+            uint32_t budget = (uint32_t)tf->a2;
+
+            char path[128];
+            if (copyinstr(p->pagetable, path, upath, sizeof(path)) < 0) {
+                tf->a0 = (uint64_t)-1;
+                break;
+            }
+
+            fs_tree_init();
+            uint32_t ino = 0;
+            int moved = -1;
+            if (fs_tree_lookup_path_at(p->tree_cwd, path, &ino) == 0) {
+                moved = fs_tree_defrag(ino, mode, budget);
+            }
+            tf->a0 = (uint64_t)(int64_t)moved;
+            break;
+        }
+
         case SYSCALL_FSTAT: {
             struct proc *p = myproc();
             int fd = (int)tf->a0;
@@ -678,7 +741,7 @@ void syscall_handler(struct trapframe * tf) {
         case SYSCALL_SNAPSHOT: {
             uint64_t id = 0;
             tree_init();
-            if (tree_subvol_create(&id) < 0) {
+            if (fs_tree_writeback(0) < 0 || tree_subvol_create(&id) < 0) {
                 tf->a0 = (uint64_t)-1;
                 break;
             }
@@ -760,6 +823,8 @@ void syscall_handler(struct trapframe * tf) {
         }
 
     }
-    
+
+    // Syscall boundaries are where the open transaction is consistent.
+    txn_poll();
     metrics_inc_u64(&global_metrics.syscall_exit, 1);
 }
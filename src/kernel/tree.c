@@ -2,7 +2,10 @@
 #include <kernel/btree.h>
 #include <kernel/extent.h>
 #include <kernel/fs.h>
+#include <kernel/kalloc.h>
 #include <kernel/printf.h>
+#include <kernel/txn.h>
+#include <mmu.h>
 
 static uint64_t root_item_key(uint64_t item_type) {
     return item_type;
@@ -13,9 +16,21 @@ static uint64_t subvol_key(uint64_t id) {
 }
 
 static uint64_t current_subvol = 1;
+static int compact_checked = 0;
+
+static int tree_share_refs(void);
 
 void tree_init(void) {
     if (sb.root_tree != 0) {
+        if (!compact_checked) {
+            compact_checked = 1;
+            if (tree_share_refs() < 0) {
+                kprintf("tree: node refcount migration failed\n");
+            }
+            if (tree_compact() < 0) {
+                kprintf("tree: compaction failed\n");
+            }
+        }
         return;
     }
 
@@ -46,14 +61,275 @@ void tree_init(void) {
                      ref_root, &root) < 0 ||
         btree_insert(root, root_item_key(ROOT_ITEM_SUBVOL_NEXT),
                      2, &root) < 0 ||
+        btree_insert(root, root_item_key(ROOT_ITEM_FEATURES),
+                     TREE_FEATURE_NO_TOMBSTONES | TREE_FEATURE_NODE_REFS,
+                     &root) < 0 ||
         btree_insert(root, subvol_key(1), fs_root, &root) < 0) {
         kprintf("tree: root tree insert failed\n");
         return;
     }
 
     sb.root_tree = root;
-    writesb();
+    txn_dirty();
     current_subvol = 1;
+    compact_checked = 1;
+}
+
+// One-time pass for images written before btree_delete existed: strip the
+// zero-valued tombstones from every tree reachable from the root tree.
+int tree_compact(void) {
+    if (sb.root_tree == 0) {
+        return -1;
+    }
+
+    uint64_t features = 0;
+    if (btree_lookup(sb.root_tree, root_item_key(ROOT_ITEM_FEATURES),
+                     &features) < 0) {
+        features = 0;
+    }
+    if (features & TREE_FEATURE_NO_TOMBSTONES) {
+        return 0;
+    }
+
+    uint32_t root = 0;
+    if (btree_compact(sb.root_tree, &root) < 0) {
+        return -1;
+    }
+
+    uint64_t ref_root = 0;
+    if (btree_lookup(root, root_item_key(ROOT_ITEM_EXTENT_REF_ROOT),
+                     &ref_root) == 0) {
+        uint32_t new_ref = 0;
+        if (btree_compact((uint32_t)ref_root, &new_ref) < 0 ||
+            btree_insert(root, root_item_key(ROOT_ITEM_EXTENT_REF_ROOT),
+                         new_ref, &root) < 0) {
+            return -1;
+        }
+    }
+
+    uint64_t next = 2;
+    if (btree_lookup(root, root_item_key(ROOT_ITEM_SUBVOL_NEXT), &next) < 0 ||
+        next == 0) {
+        next = 2;
+    }
+
+    // Shared nodes are copied once per snapshot; their refcounts keep the
+    // originals alive for the snapshots not yet compacted.
+    for (uint64_t id = 1; id < next; id++) {
+        uint64_t fs_root = 0;
+        if (btree_lookup(root, subvol_key(id), &fs_root) < 0) {
+            continue;
+        }
+        uint32_t new_fs = 0;
+        if (btree_compact((uint32_t)fs_root, &new_fs) < 0) {
+            return -1;
+        }
+        if (btree_insert(root, subvol_key(id), new_fs, &root) < 0) {
+            return -1;
+        }
+        if (id == tree_subvol_current() &&
+            btree_insert(root, root_item_key(ROOT_ITEM_FS_ROOT),
+                         new_fs, &root) < 0) {
+            return -1;
+        }
+    }
+
+    if (btree_insert(root, root_item_key(ROOT_ITEM_FEATURES),
+                     features | TREE_FEATURE_NO_TOMBSTONES, &root) < 0) {
+        return -1;
+    }
+
+    sb.root_tree = root;
+    txn_dirty();
+    kprintf("tree: compacted tombstones\n");
+    return 0;
+}
+
+// One-time pass for images written before tree nodes were refcounted:
+// snapshots share subtrees, so give each shared node one reference per
+// extra subvolume that reaches it.
+static int tree_share_refs(void) {
+    uint64_t features = 0;
+    if (btree_lookup(sb.root_tree, root_item_key(ROOT_ITEM_FEATURES),
+                     &features) < 0) {
+        features = 0;
+    }
+    if (features & TREE_FEATURE_NODE_REFS) {
+        return 0;
+    }
+
+    uint32_t npages = (sb.nblocks / 8 + PGSIZE - 1) / PGSIZE;
+    uint8_t *seen = kalloc_n(npages);
+    if (seen == 0) {
+        return -1;
+    }
+
+    int rc = 0;
+    uint64_t next = 2;
+    if (btree_lookup(sb.root_tree, root_item_key(ROOT_ITEM_SUBVOL_NEXT),
+                     &next) < 0 || next == 0) {
+        next = 2;
+    }
+    for (uint64_t id = 1; id < next && rc == 0; id++) {
+        uint64_t fs_root = 0;
+        if (tree_subvol_get(id, &fs_root) == 0) {
+            rc = btree_share_refs((uint32_t)fs_root, seen);
+        }
+    }
+    kfree_n(seen, npages);
+    if (rc < 0) {
+        return -1;
+    }
+
+    uint32_t root = sb.root_tree;
+    if (btree_insert(root, root_item_key(ROOT_ITEM_FEATURES),
+                     features | TREE_FEATURE_NODE_REFS, &root) < 0) {
+        return -1;
+    }
+    sb.root_tree = root;
+    txn_dirty();
+    return 0;
+}
+
+#define TREE_MAX_READERS 32
+
+// Generation + 1 pinned by each active reader; 0 marks a free slot.
+static volatile uint64_t reader_gen[TREE_MAX_READERS];
+
+// Pin the last commit's generation. Nodes it reaches, and any retired
+// after it, stay allocated until tree_read_end. With open set the roots
+// are the open transaction's, which build on that commit; its nodes are
+// then copied rather than rewritten in place until the reader is done.
+static int tree_pin(struct tree_snapshot *snap, int open) {
+    if (snap == 0) {
+        return -1;
+    }
+    for (int i = 0; i < TREE_MAX_READERS; i++) {
+        // Pin before reading the roots: a commit in between only makes
+        // the pin older than the roots, which holds back more, not less.
+        uint64_t gen = sb_committed.generation;
+        if (!__sync_bool_compare_and_swap(&reader_gen[i], 0, gen + 1)) {
+            continue;
+        }
+        __sync_synchronize();
+
+        if (open) {
+            btree_reader_enter();
+        }
+        snap->slot = i;
+        snap->open = open;
+        snap->generation = gen;
+        snap->root_tree = open ? sb.root_tree : sb_committed.root_tree;
+        snap->fs_root = 0;
+        uint64_t fs_root = 0;
+        if (snap->root_tree != 0 &&
+            btree_lookup(snap->root_tree, subvol_key(tree_subvol_current()),
+                         &fs_root) == 0) {
+            snap->fs_root = (uint32_t)fs_root;
+        }
+        return 0;
+    }
+    kprintf("tree: out of reader slots\n");
+    return -1;
+}
+
+int tree_read_begin(struct tree_snapshot *snap) {
+    return tree_pin(snap, 0);
+}
+
+int tree_read_begin_open(struct tree_snapshot *snap) {
+    return tree_pin(snap, 1);
+}
+
+void tree_read_end(struct tree_snapshot *snap) {
+    if (snap == 0 || snap->slot < 0 || snap->slot >= TREE_MAX_READERS) {
+        return;
+    }
+    __sync_synchronize();
+    reader_gen[snap->slot] = 0;
+    snap->slot = -1;
+    if (snap->open) {
+        btree_reader_exit();
+    }
+}
+
+static uint64_t tree_oldest_reader(void) {
+    uint64_t oldest = ~0ULL;
+    for (int i = 0; i < TREE_MAX_READERS; i++) {
+        uint64_t pin = reader_gen[i];
+        if (pin != 0 && pin - 1 < oldest) {
+            oldest = pin - 1;
+        }
+    }
+    return oldest;
+}
+
+#define TREE_MAX_ROOTS 64
+
+// Store c's roots in roots[0, max) and return how many there are, which
+// may be more than max.
+static uint32_t tree_roots(const struct superblock *c, uint32_t *roots,
+                           uint32_t max) {
+    uint32_t n = 0;
+    uint32_t fixed[] = { c->root_tree, c->extent_root, c->btree_root };
+    for (uint32_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++, n++) {
+        if (n < max) roots[n] = fixed[i];
+    }
+    if (c->root_tree == 0) {
+        return n;
+    }
+
+    static const uint64_t items[] = {
+        ROOT_ITEM_EXTENT_ROOT, ROOT_ITEM_FS_ROOT, ROOT_ITEM_EXTENT_REF_ROOT,
+    };
+    for (uint32_t i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+        uint64_t blk = 0;
+        if (btree_lookup(c->root_tree, root_item_key(items[i]), &blk) == 0) {
+            if (n < max) roots[n] = (uint32_t)blk;
+            n++;
+        }
+    }
+
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, c->root_tree, subvol_key(0)); ;
+         rc = btree_cursor_next(&cur)) {
+        uint64_t key = 0;
+        uint64_t blk = 0;
+        if (rc < 0 || btree_cursor_get(&cur, &key, &blk) < 0) {
+            break;
+        }
+        if (n < max) roots[n] = (uint32_t)blk;
+        n++;
+    }
+    return n;
+}
+
+// Free tree nodes replaced before the commit of committed, the superblock
+// writesb() just put on disk; the nodes its roots reach are kept. The open
+// transaction's roots are not on disk yet and take no part. Past
+// TREE_MAX_ROOTS (many subvolumes) the roots go in pages of their own;
+// without those the list waits for the next commit.
+int tree_reclaim(const struct superblock *committed) {
+    static uint32_t few[TREE_MAX_ROOTS];
+    uint32_t *roots = few;
+    uint32_t n = tree_roots(committed, roots, TREE_MAX_ROOTS);
+    uint32_t pages = 0;
+    if (n > TREE_MAX_ROOTS) {
+        pages = (n * sizeof(uint32_t) + PGSIZE - 1) / PGSIZE;
+        roots = kalloc_n(pages);
+        if (roots == 0) {
+            kprintf("tree: no memory for %u roots, reclaim deferred\n", n);
+            return 0;
+        }
+        n = tree_roots(committed, roots, pages * (PGSIZE / sizeof(uint32_t)));
+    }
+
+    __sync_synchronize();
+    int freed = btree_reclaim(roots, (int)n, tree_oldest_reader());
+    if (pages) {
+        kfree_n(roots, pages);
+    }
+    return freed;
 }
 
 int tree_root_get(uint64_t item_type, uint64_t *out_block) {
@@ -104,8 +380,11 @@ int tree_subvol_create(uint64_t *id_out) {
         return -1;
     }
 
+    // The snapshot shares the whole tree; the first update on either side
+    // copies the root and pushes the extra reference down a level.
+    brefcnt_inc((uint32_t)fs_root);
     sb.root_tree = root;
-    writesb();
+    txn_dirty();
     if (id_out) *id_out = next;
     return 0;
 }
@@ -0,0 +1,121 @@
+#include <kernel/tree_log.h>
+#include <kernel/btree.h>
+#include <kernel/buf.h>
+#include <kernel/fs.h>
+#include <kernel/fs_tree.h>
+#include <kernel/printf.h>
+#include <kernel/txn.h>
+
+// Subvolume id -> that subvolume's log tree; 0 while nothing is logged.
+static uint32_t log_root = 0;
+
+// Every node of the log: each subvolume's tree, then the tree naming them.
+static int tree_log_visit(btree_visit_fn fn, void *arg) {
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, log_root, 0); rc == 0;
+         rc = btree_cursor_next(&cur)) {
+        uint64_t subvol = 0;
+        uint64_t root = 0;
+        if (btree_cursor_get(&cur, &subvol, &root) < 0 ||
+            btree_visit((uint32_t)root, fn, arg) < 0) {
+            return -1;
+        }
+    }
+    return btree_visit(log_root, fn, arg);
+}
+
+uint32_t tree_log_root(uint64_t subvol) {
+    uint64_t root = 0;
+    if (log_root == 0 || btree_lookup(log_root, subvol, &root) < 0) {
+        return 0;
+    }
+    return (uint32_t)root;
+}
+
+// Mount reads the log back from disk, so an update copies its nodes the
+// way it would under a reader instead of rewriting them in place.
+void tree_log_update_begin(void) {
+    btree_reader_enter();
+}
+
+int tree_log_update_end(uint64_t subvol, uint32_t root, int rc) {
+    uint32_t top = log_root;
+    if (rc == 0 && top == 0 && btree_create_empty(0, &top) < 0) {
+        rc = -1;
+    }
+    if (rc == 0 && btree_insert(top, subvol, root, &top) < 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        log_root = top;
+    }
+    btree_reader_exit();
+    return rc;
+}
+
+static void tree_log_write_node(uint32_t blk, void *arg) {
+    (void)arg;
+    bsync(blk);
+}
+
+// Write the log's dirty nodes, then superblocks naming it.
+int tree_log_sync(void) {
+    if (log_root == 0) {
+        return 0;
+    }
+    if (tree_log_visit(tree_log_write_node, 0) < 0) {
+        return -1;
+    }
+    writesb_log(log_root);
+    return 0;
+}
+
+static void tree_log_free_node(uint32_t blk, void *arg) {
+    (void)arg;
+    bfree(blk);
+}
+
+// The superblocks just written name no log; its nodes are free to go.
+void tree_log_committed(void) {
+    if (log_root == 0) {
+        return;
+    }
+    tree_log_visit(tree_log_free_node, 0);
+    log_root = 0;
+}
+
+static void tree_log_reserve_node(uint32_t blk, void *arg) {
+    (void)arg;
+    breserve(blk);
+}
+
+// Apply the log found at mount and commit the result. Its nodes are held
+// until that commit drops them.
+void tree_log_replay(void) {
+    log_root = sb.log_root;
+    sb.log_root = 0;
+    if (tree_log_visit(tree_log_reserve_node, 0) < 0) {
+        kprintf("tree_log: log unreadable, dropped\n");
+        txn_commit();
+        return;
+    }
+
+    int n = 0;
+    struct btree_cursor cur;
+    for (int rc = btree_cursor_seek(&cur, log_root, 0); rc == 0;
+         rc = btree_cursor_next(&cur)) {
+        uint64_t subvol = 0;
+        uint64_t root = 0;
+        btree_cursor_get(&cur, &subvol, &root);
+        if (fs_tree_log_replay(subvol, (uint32_t)root) < 0) {
+            kprintf("tree_log: replay of subvolume %u failed\n",
+                    (uint32_t)subvol);
+        }
+        n++;
+    }
+    if (txn_commit() < 0) {
+        kprintf("tree_log: commit after replay failed\n");
+        return;
+    }
+    kprintf("tree_log: replayed %d subvolume log(s)\n", n);
+}
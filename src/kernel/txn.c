@@ -0,0 +1,156 @@
+#include <kernel/txn.h>
+#include <kernel/btree.h>
+#include <kernel/buf.h>
+#include <kernel/extent.h>
+#include <kernel/fs.h>
+#include <kernel/fs_tree.h>
+#include <kernel/printf.h>
+#include <kernel/sched.h>
+#include <kernel/tree_log.h>
+#include "timer.h"
+
+static struct txn txn;
+static struct superblock closed; // What the commit in flight will write
+static int closed_rc;
+static int txn_thread_on = 0;
+
+// Note a change to the open transaction, opening one if need be.
+void txn_dirty(void) {
+    if (!txn.dirty) {
+        txn.dirty = 1;
+        txn.opened = ticks;
+    }
+}
+
+// Called by extent_commit_begin. Whatever changes after that point opens
+// the next transaction, while this one is written out.
+void txn_closed(void) {
+    txn.dirty = 0;
+}
+
+// Called by extent_commit_end once the superblocks are on disk.
+void txn_committed(void) {
+    txn.commits++;
+    tree_log_committed();
+}
+
+// Write out the closed transaction. The commit thread yields between
+// buffers so syscalls keep working on the open one meanwhile.
+static int txn_finish(int yielding) {
+    while (bflush_closed()) {
+        if (yielding) {
+            yield();
+        }
+    }
+    closed_rc = extent_commit_end(&closed);
+    txn.committing = 0;
+    wakeup(&txn.committing);
+    return closed_rc;
+}
+
+// Wait until the closed transaction, if any, is on disk.
+int txn_wait(void) {
+    if (!txn.committing) {
+        return 0;
+    }
+    while (txn.committing) {
+        sleep(&txn.committing);
+    }
+    return closed_rc;
+}
+
+// Close the open transaction and hand it to the commit thread, or write
+// it here when there is none. With a commit still in flight the pipeline
+// is full and the caller waits for it first.
+int txn_close(void) {
+    if (!txn.dirty) {
+        return 0;
+    }
+    if (txn.committing) {
+        txn.stalls++;
+        if (txn_wait() < 0) {
+            return -1;
+        }
+    }
+    // Buffered file data and the sizes the inode cache held back go out
+    // with this transaction, like every other change made during it.
+    if (fs_tree_writeback(0) < 0 || extent_commit_begin(&closed) < 0) {
+        return -1;
+    }
+    txn.committing = 1;
+    if (!txn_thread_on) {
+        return txn_finish(0);
+    }
+    wakeup(&txn);
+    return 0;
+}
+
+int txn_commit(void) {
+    if (txn_close() < 0) {
+        return -1;
+    }
+    return txn_wait();
+}
+
+// Whether the open transaction holds enough that it should not wait for
+// the timer: dirty buffers crowding the cache, replaced nodes and
+// deferred frees piling up in memory or out of it, or space tied up in
+// those frees.
+static int txn_pressure(void) {
+    if (bdirty_count() > NBUF / 2 || btree_stale_count() > TXN_MAX_STALE ||
+        extent_deferred_spare()) {
+        return 1;
+    }
+    uint32_t deferred = extent_deferred_blocks();
+    if (deferred == 0) {
+        return 0;
+    }
+    struct extent_stats st;
+    extent_stats(&st);
+    return deferred > st.free_blocks / 4;
+}
+
+// Close the open transaction at an operation boundary if it is old
+// enough or under pressure. An old one waits out a commit in flight; one
+// under pressure stalls the caller until that commit is done.
+int txn_poll(void) {
+    if (!txn.dirty) {
+        return 0;
+    }
+    int pressure = txn_pressure();
+    if (ticks - txn.opened < TXN_COMMIT_TICKS && !pressure) {
+        return 0;
+    }
+    if (txn.committing && !pressure) {
+        return 0;
+    }
+    return txn_close();
+}
+
+static void txn_thread(void) {
+    for (;;) {
+        while (!txn.committing) {
+            sleep(&txn);
+        }
+        if (txn_finish(1) < 0) {
+            kprintf("txn: commit of generation %d failed\n",
+                    (int)closed.generation);
+        }
+    }
+}
+
+// Start the commit thread. Until then, and if it cannot start, commits
+// are written by whoever closes the transaction.
+void txn_start(void) {
+    if (sched_create_kthread(txn_thread) < 0) {
+        kprintf("txn: no commit thread\n");
+        return;
+    }
+    txn_thread_on = 1;
+}
+
+void txn_stat(struct txn *out) {
+    if (out) {
+        *out = txn;
+    }
+}
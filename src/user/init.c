@@ -44,6 +44,15 @@ static inline long sys_clone(const char *src, const char *dst) {
 static inline long sys_snapshot(void) {
     return sys_call(SYSCALL_SNAPSHOT, 0, 0, 0, 0, 0, 0);
 }
+static inline long sys_defrag(const char *path, long mode, long budget) {
+    return sys_call(SYSCALL_DEFRAG, (long)path, mode, budget, 0, 0, 0);
+}
+static inline long sys_fsync(int fd) {
+    return sys_call(SYSCALL_FSYNC, fd, 0, 0, 0, 0, 0);
+}
+static inline long sys_fdatasync(int fd) {
+    return sys_call(SYSCALL_FDATASYNC, fd, 0, 0, 0, 0, 0);
+}
 static inline long sys_subvol_set(long id) {
     return sys_call(SYSCALL_SUBVOL_SET, id, 0, 0, 0, 0, 0);
 }
@@ -154,7 +163,7 @@ static int split_args(char *line, char *argv[], int max) {
 }
 
 static void cmd_help(void) {
-    uputs("Commands: help pwd cd ls mkdir touch cat write rm mv clone snapshot subvol exec exit\n");
+    uputs("Commands: help pwd cd ls mkdir touch cat write fsync rm mv clone snapshot subvol defrag exec exit\n");
     uputs("Built-ins run in child (except cd/exit). External: try /bin/<cmd> or /path\n");
 }
 
@@ -268,6 +277,19 @@ static void cmd_write(const char *path, const char *text) {
     sys_close(fd);
 }
 
+static void cmd_fsync(const char *path, int datasync) {
+    long fd = sys_open(path, O_TREE);
+    if (fd < 0) {
+        uputs("fsync: open failed\n");
+        return;
+    }
+    long r = datasync ? sys_fdatasync(fd) : sys_fsync(fd);
+    if (r < 0) {
+        uputs("fsync: failed\n");
+    }
+    sys_close(fd);
+}
+
 static void cmd_rm(const char *path) {
     if (sys_unlink(path) < 0) {
         uputs("rm: failed\n");
@@ -319,6 +341,45 @@ static void cmd_subvol(const char *idstr) {
     }
 }
 
+// defrag [-s] <path> [blocks]: with a block count, work in passes of that
+// many blocks and sleep a tick between them so other work keeps going.
+static void cmd_defrag(int argc, char *argv[]) {
+    long mode = 0;
+    int i = 1;
+    if (i < argc && ustreq(argv[i], "-s")) {
+        mode |= DEFRAG_KEEP_SHARED;
+        i++;
+    }
+    if (i >= argc) {
+        uputs("defrag: missing path\n");
+        return;
+    }
+    const char *path = argv[i++];
+    long budget = 0;
+    if (i < argc) {
+        for (const char *c = argv[i]; *c >= '0' && *c <= '9'; c++) {
+            budget = budget * 10 + (*c - '0');
+        }
+    }
+
+    uint64_t total = 0;
+    for (;;) {
+        long moved = sys_defrag(path, mode, budget);
+        if (moved < 0) {
+            uputs("defrag: failed\n");
+            return;
+        }
+        total += (uint64_t)moved;
+        if (budget == 0 || moved == 0) {
+            break;
+        }
+        sys_sleep(1);
+    }
+    uputs("defrag: moved ");
+    uputnum(total);
+    uputs(" blocks\n");
+}
+
 static int run_builtin(int argc, char *argv[]) {
     const char *cmd = argv[0];
     if(ustreq(cmd, "done")) {
@@ -360,6 +421,15 @@ static int run_builtin(int argc, char *argv[]) {
         cmd_write(argv[1], argv[2]);
         return 0;
     }
+    if (ustreq(cmd, "fsync")) {
+        if (argc < 2) { uputs("fsync: missing path\n"); return 0; }
+        if (argc >= 3 && ustreq(argv[1], "-d")) {
+            cmd_fsync(argv[2], 1);
+        } else {
+            cmd_fsync(argv[1], 0);
+        }
+        return 0;
+    }
     if (ustreq(cmd, "rm")) {
         if (argc < 2) { uputs("rm: missing path\n"); return 0; }
         cmd_rm(argv[1]);
@@ -381,6 +451,7 @@ static int run_builtin(int argc, char *argv[]) {
         cmd_subvol(argv[1]);
         return 0;
     }
+    if (ustreq(cmd, "defrag")) { cmd_defrag(argc, argv); return 0; }
     if (ustreq(cmd, "exec")) {
         if (argc < 2) { uputs("exec: missing path\n"); return 0; }
         if (sys_exec(argv[1]) < 0) uputs("exec: failed\n");
@@ -32,6 +32,7 @@ struct superblock {
     uint32_t extent_root;
     uint32_t root_tree;
     uint32_t fs_next_ino;
+    uint32_t log_root;
     uint64_t generation;
     uint32_t checksum;
     uint32_t reserved;